@@ -0,0 +1,260 @@
+// Debounce filters for the level sensors.
+//
+// Each filter debounces up to N sensors at once.  It is fed the raw levels of all
+// of them as a bitmask, bit i for sensor i, along with the micros() time they were
+// sampled, either from a captured edge or from a periodic check, and returns the
+// debounced levels as a bitmask.  Since the sensors are always sampled together
+// they share one time base, and the rest of the per-sensor state is kept in small
+// parallel arrays.  Times are only ever compared as differences so micros()
+// wrapping is harmless.  A time from before the last update, from an edge that
+// was captured while that update was being made, counts as no time going by, so
+// a filter has to be updated more often than every half of micros()' range (35
+// minutes), which the sensor task does.  The tuning parameters are template
+// arguments so they cost nothing at run time, and each instance keeps its own state.
+// SETTLE_MS is the longest a filter takes to follow an input that changes and
+// stays changed, not counting the time until its next update.
+
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include <stdint.h>
+
+#define DEBOUNCE_MASK(N) ((uint32_t)((1ULL<<(N))-1))
+
+/*
+ * Accept a change immediately, then ignore further changes for HOLD_MS.  This is
+ * the original tankReporter hysteresis.  Fast, but it follows sloshing.
+ */
+template <uint8_t N, uint32_t HOLD_MS>
+class HoldoffFilter
+  {
+  static_assert(N>0 && N<=32, "N must be between 1 and 32");
+
+  public:
+  static const uint32_t SETTLE_MS=HOLD_MS; //when it changed back during the hold off
+
+  void reset(uint32_t levels, uint32_t now)
+    {
+    output=levels&MASK;
+    holding=0;
+    for (uint8_t i=0;i<N;i++)
+      changedAt[i]=now;
+    }
+
+  uint32_t update(uint32_t levels, uint32_t now)
+    {
+    // Once the delay is over we stop comparing times, so a long quiet spell can't wrap
+    for (uint32_t m=holding;m;m&=m-1)
+      {
+      uint8_t i=__builtin_ctz(m);
+      if ((int32_t)(now-changedAt[i]) >= (int32_t)(HOLD_MS*1000UL))
+        holding&=~(1UL<<i);
+      }
+
+    // Any that changed and aren't holding take the new value and restart the timer
+    uint32_t changed=(levels^output)&MASK&~holding;
+    output^=changed;
+    holding|=changed;
+    for (uint32_t m=changed;m;m&=m-1)
+      changedAt[__builtin_ctz(m)]=now;
+    return output;
+    }
+
+  uint32_t value() const {return output;}
+
+  private:
+  static const uint32_t MASK=DEBOUNCE_MASK(N);
+  uint32_t output=0;
+  uint32_t holding=0;
+  uint32_t changedAt[N]={0};
+  };
+
+/*
+ * Integrate the time spent wet minus the time spent dry, clamped to INTEGRATE_MS.
+ * The output only changes when the integral reaches one end or the other, so the
+ * input has to be mostly in the new state for INTEGRATE_MS to be believed.
+ */
+template <uint8_t N, uint32_t INTEGRATE_MS>
+class IntegratorFilter
+  {
+  static_assert(N>0 && N<=32, "N must be between 1 and 32");
+
+  public:
+  static const uint32_t SETTLE_MS=INTEGRATE_MS;
+
+  void reset(uint32_t levels, uint32_t now)
+    {
+    output=levels&MASK;
+    lastLevels=output;
+    lastTime=now;
+    for (uint8_t i=0;i<N;i++)
+      integral[i]=(output>>i)&1?LIMIT:0;
+    }
+
+  uint32_t update(uint32_t levels, uint32_t now)
+    {
+    if ((int32_t)(now-lastTime)<0)
+      now=lastTime; //an edge from before the last update
+    uint32_t dt=now-lastTime;
+    if (dt>LIMIT)
+      dt=LIMIT;
+    lastTime=now;
+
+    // Each input was at its last level for the whole interval
+    for (uint8_t i=0;i<N;i++)
+      {
+      uint32_t bit=1UL<<i;
+      if (lastLevels&bit)
+        integral[i]=(LIMIT-integral[i]<dt)?LIMIT:integral[i]+dt;
+      else
+        integral[i]=(integral[i]<dt)?0:integral[i]-dt;
+
+      if (integral[i]==LIMIT)
+        output|=bit;
+      else if (integral[i]==0)
+        output&=~bit;
+      }
+    lastLevels=levels&MASK;
+    return output;
+    }
+
+  uint32_t value() const {return output;}
+
+  private:
+  static const uint32_t LIMIT=INTEGRATE_MS*1000UL;
+  static const uint32_t MASK=DEBOUNCE_MASK(N);
+  uint32_t output=0;
+  uint32_t lastLevels=0;
+  uint32_t lastTime=0;
+  uint32_t integral[N]={0}; //microseconds
+  };
+
+/*
+ * Sample the inputs every SAMPLE_MS and output the majority of the last SAMPLES.
+ */
+template <uint8_t N, uint8_t SAMPLES, uint32_t SAMPLE_MS>
+class MajorityFilter
+  {
+  static_assert(N>0 && N<=32, "N must be between 1 and 32");
+  static_assert(SAMPLES>0 && SAMPLES<=32 && (SAMPLES&1), "SAMPLES must be odd and no more than 32");
+
+  public:
+  // A majority of samples, the first of them up to two periods after the change
+  static const uint32_t SETTLE_MS=(SAMPLES/2+2)*SAMPLE_MS;
+
+  void reset(uint32_t levels, uint32_t now)
+    {
+    output=levels&MASK;
+    lastLevels=output;
+    lastSample=now;
+    for (uint8_t i=0;i<N;i++)
+      history[i]=(output>>i)&1?HISTORY_MASK:0;
+    }
+
+  uint32_t update(uint32_t levels, uint32_t now)
+    {
+    if ((int32_t)(now-lastSample)<0)
+      now=lastSample; //an edge from before the last update
+
+    // Shift in a sample for each period that has gone by.  No point in more than SAMPLES.
+    uint8_t samples=0;
+    while (now-lastSample >= SAMPLE_US && samples<SAMPLES)
+      {
+      for (uint8_t i=0;i<N;i++)
+        history[i]=((history[i]<<1)|((lastLevels>>i)&1))&HISTORY_MASK;
+      lastSample+=SAMPLE_US;
+      samples++;
+      }
+    if (now-lastSample >= SAMPLE_US) //we fell a long way behind
+      lastSample=now;
+    lastLevels=levels&MASK;
+
+    output=0;
+    for (uint8_t i=0;i<N;i++)
+      if (__builtin_popcount(history[i]) > SAMPLES/2)
+        output|=1UL<<i;
+    return output;
+    }
+
+  uint32_t value() const {return output;}
+
+  private:
+  static const uint32_t SAMPLE_US=SAMPLE_MS*1000UL;
+  static const uint32_t MASK=DEBOUNCE_MASK(N);
+  static const uint32_t HISTORY_MASK=DEBOUNCE_MASK(SAMPLES);
+  uint32_t output=0;
+  uint32_t lastLevels=0;
+  uint32_t lastSample=0;
+  uint32_t history[N]={0};  //one bit per sample, newest in bit 0
+  };
+
+/*
+ * Sample the inputs every SAMPLE_MS into fixed point exponential moving averages
+ * with a weight of 1/2^SHIFT.  An output goes wet above 3/4 and dry below 1/4.
+ */
+template <uint8_t N, uint8_t SHIFT, uint32_t SAMPLE_MS>
+class ExponentialFilter
+  {
+  static_assert(N>0 && N<=32, "N must be between 1 and 32");
+  static_assert(SHIFT>0 && SHIFT<=12, "SHIFT must be between 1 and 12");
+
+  // Samples for the average to get from one end past the switching point
+  static constexpr uint32_t samplesToSwitch(int32_t average, uint32_t samples)
+    {
+    return average>(1L<<16)*3/4?samples:samplesToSwitch(average+(((1L<<16)-average)>>SHIFT),samples+1);
+    }
+
+  public:
+  static const uint32_t SETTLE_MS=(samplesToSwitch(0,0)+1)*SAMPLE_MS;
+
+  void reset(uint32_t levels, uint32_t now)
+    {
+    output=levels&MASK;
+    lastLevels=output;
+    lastSample=now;
+    for (uint8_t i=0;i<N;i++)
+      average[i]=(output>>i)&1?FULL_SCALE:0;
+    }
+
+  uint32_t update(uint32_t levels, uint32_t now)
+    {
+    if ((int32_t)(now-lastSample)<0)
+      now=lastSample; //an edge from before the last update
+
+    uint16_t samples=0;
+    while (now-lastSample >= SAMPLE_US && samples<MAX_CATCH_UP)
+      {
+      // arithmetic shift of a negative difference is fine with gcc
+      for (uint8_t i=0;i<N;i++)
+        average[i]+=(((lastLevels>>i)&1?FULL_SCALE:0)-average[i])>>SHIFT;
+      lastSample+=SAMPLE_US;
+      samples++;
+      }
+    if (now-lastSample >= SAMPLE_US) //we fell a long way behind
+      lastSample=now;
+    lastLevels=levels&MASK;
+
+    for (uint8_t i=0;i<N;i++)
+      {
+      if (average[i] > FULL_SCALE*3/4)
+        output|=1UL<<i;
+      else if (average[i] < FULL_SCALE/4)
+        output&=~(1UL<<i);
+      }
+    return output;
+    }
+
+  uint32_t value() const {return output;}
+
+  private:
+  static const int32_t FULL_SCALE=1L<<16;
+  static const uint16_t MAX_CATCH_UP=8<<SHIFT; //enough to settle completely
+  static const uint32_t SAMPLE_US=SAMPLE_MS*1000UL;
+  static const uint32_t MASK=DEBOUNCE_MASK(N);
+  uint32_t output=0;
+  uint32_t lastLevels=0;
+  uint32_t lastSample=0;
+  int32_t average[N]={0};
+  };
+
+#endif
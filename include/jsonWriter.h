@@ -0,0 +1,234 @@
+// A small streaming JSON writer that never allocates memory.
+//
+// It writes into a fixed size buffer, streams to anything that is a Print (the
+// MQTT client, for instance), or just counts.  Counting first and then streaming
+// lets a payload go straight into PubSubClient's beginPublish()/endPublish()
+// without building it anywhere.  Writing into a buffer never overruns it; if
+// the output doesn't fit then truncated() is set and the buffer holds as much
+// as fit, still null terminated.  Streamed output is gathered into writes of up
+// to JSON_STREAM_CHUNK bytes rather than one per piece, which would be a TCP
+// write each for the MQTT client, so call end() once the output is finished.
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <Arduino.h>
+
+#define JSON_STREAM_CHUNK 64 //bytes held for the stream before they're written
+
+class JsonWriter
+  {
+  public:
+  // Just count the characters that would be written
+  JsonWriter() {}
+
+  // Write into a buffer of the given size, including the terminating null
+  JsonWriter(char* buffer, size_t size)
+    : buf(buffer), bufSize(size)
+    {
+    if (buf && bufSize>0)
+      buf[0]='\0';
+    }
+
+  // Stream the output to out
+  JsonWriter(Print* out)
+    : stream(out) {}
+
+  ~JsonWriter() {end();}
+
+  // Write out whatever is still held for the stream
+  void end()
+    {
+    if (stream && pending>0)
+      stream->write((const uint8_t*)chunk,pending);
+    pending=0;
+    }
+
+  void beginObject()
+    {
+    raw("{",1);
+    first=true;
+    }
+
+  // An object nested inside this one
+  void beginObject(const char* name)
+    {
+    key(name);
+    beginObject();
+    }
+
+  void endObject()
+    {
+    raw("}",1);
+    first=false;
+    }
+
+  void beginArray(const char* name)
+    {
+    key(name);
+    raw("[",1);
+    first=true;
+    }
+
+  void addElement(unsigned long value)
+    {
+    char tmp[12];
+    if (!first)
+      raw(",",1);
+    first=false;
+    raw(tmp,snprintf(tmp,sizeof(tmp),"%lu",value));
+    }
+
+  void endArray()
+    {
+    raw("]",1);
+    first=false;
+    }
+
+  void addString(const char* name, const char* value)
+    {
+    key(name);
+    quoted(value);
+    }
+
+  void addLong(const char* name, long value)
+    {
+    char tmp[12];
+    key(name);
+    raw(tmp,snprintf(tmp,sizeof(tmp),"%ld",value));
+    }
+
+  void addUnsigned(const char* name, unsigned long value)
+    {
+    char tmp[12];
+    key(name);
+    raw(tmp,snprintf(tmp,sizeof(tmp),"%lu",value));
+    }
+
+  // A fixed point number, value/10^places, written without using floating point
+  void addDecimal(const char* name, long value, uint8_t places)
+    {
+    char tmp[16];
+    unsigned long scale=1;
+    for (uint8_t i=0;i<places;i++)
+      scale*=10;
+    unsigned long magnitude=value<0?-(unsigned long)value:value;
+    key(name);
+    if (places==0)
+      raw(tmp,snprintf(tmp,sizeof(tmp),"%ld",value));
+    else
+      raw(tmp,snprintf(tmp,sizeof(tmp),"%s%lu.%0*lu",value<0?"-":"",magnitude/scale,(int)places,magnitude%scale));
+    }
+
+  // printf can't be relied on for 64 bits, so this does its own digits
+  void addUnsigned64(const char* name, uint64_t value)
+    {
+    char tmp[21];
+    char* p=tmp+sizeof(tmp);
+    do
+      {
+      *--p='0'+value%10;
+      value/=10;
+      } while (value>0);
+    key(name);
+    raw(p,tmp+sizeof(tmp)-p);
+    }
+
+  // Some of the existing payloads send numbers as strings, so keep doing that
+  void addUnsignedString(const char* name, unsigned long value)
+    {
+    char tmp[12];
+    snprintf(tmp,sizeof(tmp),"%lu",value);
+    addString(name,tmp);
+    }
+
+  void addBool(const char* name, bool value)
+    {
+    key(name);
+    if (value)
+      raw("true",4);
+    else
+      raw("false",5);
+    }
+
+  size_t length() const {return len;}
+  bool truncated() const {return overflow;}
+
+  private:
+  char* buf=NULL;
+  size_t bufSize=0;
+  Print* stream=NULL;
+  size_t len=0;
+  bool overflow=false;
+  bool first=true;
+  char chunk[JSON_STREAM_CHUNK];
+  size_t pending=0; //bytes in chunk
+
+  void key(const char* name)
+    {
+    if (!first)
+      raw(", ",2);
+    first=false;
+    quoted(name);
+    raw(":",1);
+    }
+
+  void quoted(const char* value)
+    {
+    raw("\"",1);
+    const char* run=value;  //unescaped characters are written in runs
+    for (const char* p=value;*p;p++)
+      {
+      unsigned char c=*p;
+      if (c>=0x20 && c!='"' && c!='\\')
+        continue;
+      raw(run,p-run);
+      run=p+1;
+      char esc[7];
+      switch (c)
+        {
+        case '"':  raw("\\\"",2); break;
+        case '\\': raw("\\\\",2); break;
+        case '\n': raw("\\n",2); break;
+        case '\r': raw("\\r",2); break;
+        case '\t': raw("\\t",2); break;
+        default:   raw(esc,snprintf(esc,sizeof(esc),"\\u%04x",c)); break;
+        }
+      }
+    raw(run,strlen(run));
+    raw("\"",1);
+    }
+
+  // Everything goes through here. A piece that doesn't fit in the buffer is
+  // dropped whole, so an escape sequence is never cut in half.
+  void raw(const char* text, size_t n)
+    {
+    if (n==0)
+      return;
+    if (buf)
+      {
+      if (overflow || len+n >= bufSize)
+        {
+        overflow=true;
+        return;
+        }
+      memcpy(buf+len,text,n);
+      buf[len+n]='\0';
+      }
+    else if (stream)
+      {
+      if (pending+n > sizeof(chunk))
+        end();
+      if (n >= sizeof(chunk)) //a long string, write it as it is
+        stream->write((const uint8_t*)text,n);
+      else
+        {
+        memcpy(chunk+pending,text,n);
+        pending+=n;
+        }
+      }
+    len+=n;
+    }
+  };
+
+#endif
@@ -0,0 +1,89 @@
+// A serial command line reader that never allocates memory.
+//
+// Characters are collected into a fixed size buffer until a carriage return or
+// newline arrives, and then the line is handed out null terminated in place, so
+// the command dispatcher can take it apart without copying.  CR, LF and CRLF all
+// end a line and empty lines are ignored.  A line too long for the buffer is
+// thrown away whole rather than cut short, since a truncated setting is worse
+// than none, and overflowed() says so.  While a complete line is waiting to be
+// taken nothing more is read, so further input stays in the UART's own receive
+// ring buffer instead of needing a second one here.
+
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <Arduino.h>
+
+template <size_t SIZE>
+class LineReader
+  {
+  static_assert(SIZE>1, "SIZE must leave room for the null");
+
+  public:
+  // Read what's available from in.  Returns the line when one is complete, or NULL.
+  char* poll(Stream& in)
+    {
+    while (!ready && in.available()>0)
+      add((char)in.read());
+    return ready?buf:NULL;
+    }
+
+  // Feed one character.  Returns true when a line is complete.
+  bool add(char c)
+    {
+    if (ready)
+      return true;
+    if (c=='\r' || c=='\n')
+      {
+      if (discarding)
+        {
+        discarding=false;
+        overflow=true;
+        len=0;
+        }
+      else if (len>0)
+        {
+        buf[len]='\0';
+        ready=true;
+        }
+      return ready;
+      }
+    if (discarding)
+      return false;
+    if (len>=SIZE-1)
+      {
+      discarding=true;
+      overflows++;
+      return false;
+      }
+    buf[len++]=c;
+    return false;
+    }
+
+  // Start on the next line.  The last line's buffer is reused, so finish with it first.
+  void next()
+    {
+    ready=false;
+    len=0;
+    }
+
+  // True once if a line was thrown away since the last time this was called
+  bool overflowed()
+    {
+    bool was=overflow;
+    overflow=false;
+    return was;
+    }
+
+  unsigned long overflowCount() const {return overflows;}
+
+  private:
+  char buf[SIZE];
+  size_t len=0;
+  bool ready=false;
+  bool discarding=false; //throwing away the rest of a line that was too long
+  bool overflow=false;
+  unsigned long overflows=0;
+  };
+
+#endif
@@ -0,0 +1,50 @@
+// A latency histogram with logarithmic buckets, for the metrics registry.
+//
+// Bucket 0 counts zeros and bucket b counts values from 2^(b-1) up to 2^b-1, with
+// everything too big for the last bucket counted there.  Recording is a count
+// leading zeros and an increment, so it is cheap enough for the loop itself.
+// The counts stop at their maximum rather than wrapping.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+template <uint8_t BUCKETS>
+class LogHistogram
+  {
+  static_assert(BUCKETS>1 && BUCKETS<=33, "BUCKETS must be between 2 and 33");
+
+  public:
+  void record(uint32_t value)
+    {
+    uint8_t b=value==0?0:32-__builtin_clz(value);
+    if (b>=BUCKETS)
+      b=BUCKETS-1;
+    if (counts[b]!=UINT16_MAX)
+      counts[b]++;
+    }
+
+  void reset()
+    {
+    for (uint8_t b=0;b<BUCKETS;b++)
+      counts[b]=0;
+    }
+
+  uint16_t bucket(uint8_t b) const {return counts[b];}
+
+  // One more than the highest bucket with anything in it, so empty buckets at the
+  // top don't need to be sent
+  uint8_t used() const
+    {
+    uint8_t n=BUCKETS;
+    while (n>0 && counts[n-1]==0)
+      n--;
+    return n;
+    }
+
+  private:
+  uint16_t counts[BUCKETS]={0};
+  };
+
+#endif
@@ -0,0 +1,62 @@
+// A network client that notices whether the MQTT broker kept our session.
+//
+// With a persistent session (clean session off) the broker remembers our
+// subscriptions between connections, so there's no need to subscribe again, but
+// only if the broker says so in the session present flag of its CONNACK.
+// PubSubClient reads the CONNACK itself and doesn't pass the flag on.  It does read
+// every byte through the client one at a time, though, so this wraps the client
+// and picks the flag out of the packet as it goes by.  Call expectConnack() just
+// before connecting.  Base is the client class being wrapped, plain or TLS, and
+// ConnackFlags lets the caller look at either one the same way.
+
+#ifndef SESSION_CLIENT_H
+#define SESSION_CLIENT_H
+
+#include <Arduino.h>
+
+class ConnackFlags
+  {
+  public:
+  // The next bytes read are a CONNACK: type, length, flags, return code
+  void expectConnack()
+    {
+    connackBytes=0;
+    present=false;
+    }
+
+  // True if the broker still had our session when we last connected
+  bool sessionPresent() const {return present;}
+
+  protected:
+  void saw(int c)
+    {
+    if (c>=0 && connackBytes<CONNACK_LENGTH)
+      {
+      if (connackBytes==CONNACK_FLAGS)
+        present=(c&1)!=0;
+      connackBytes++;
+      }
+    }
+
+  private:
+  static const uint8_t CONNACK_LENGTH=4;
+  static const uint8_t CONNACK_FLAGS=2;   //where the session present flag is
+  uint8_t connackBytes=CONNACK_LENGTH;     //nothing expected
+  bool present=false;
+  };
+
+template <class Base>
+class SessionClient : public Base, public ConnackFlags
+  {
+  public:
+  int read() override
+    {
+    int c=Base::read();
+    saw(c);
+    return c;
+    }
+
+  using Base::read;
+  };
+
+#endif
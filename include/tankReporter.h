@@ -4,6 +4,25 @@
 #define LED_OFF HIGH
 
 #define SENSOR_PORT D1
+#define SENSOR_MAX 4 //level sensors that can be connected
+#define SENSOR_PORTS {SENSOR_PORT, D5, D6, D7} //must all be GPIO0 to GPIO15
+#define SENSOR_NAMES {"low", "reserve", "full", "high"}
+#define DEFAULT_SENSOR_COUNT 1
+#define ANALOG_OVERSAMPLE 16 //A0 reads added up into each analog sample, for two more bits
+#define ANALOG_IIR_SHIFT 3 //analog filter weight is 1/2^ANALOG_IIR_SHIFT
+#define ANALOG_IIR_FRACTION 8 //fraction bits kept by the analog filter
+#define ANALOG_CALIBRATION_POINTS 8
+#define ANALOG_CALIBRATION_SIZE 80
+#define DEFAULT_ANALOG_CALIBRATION "0:0,1023:100"
+#define ANALOG_RADIO_QUIET 50 //milliseconds after sending before the ADC is read
+#define ANALOG_REPORT_CHANGE 20 //tenths of a percent the level must move to report in change mode
+#define ADC_TASK_INTERVAL 10 //milliseconds between A0 reads
+#define ADC_TASK_LATE_LIMIT 100 //milliseconds
+#define DEFAULT_PULSES_PER_UNIT 450 //a common hall effect flow meter, per litre
+#define PULSE_WINDOW_SAMPLES 8 //pulse task runs the flow rate is averaged over
+#define PULSE_SAVE_INTERVAL 900 //seconds between saving the pulse total to flash
+#define PULSE_TASK_INTERVAL 250 //milliseconds
+#define PULSE_TASK_LATE_LIMIT 1000 //milliseconds
 #define WARNING_LED_PORT_RED D2
 #define OK_LED_PORT_GREEN D3
 #define DRY LED_ON
@@ -11,31 +30,138 @@
 #define DRY_RED_BRIGHTNESS 48
 #define DRY_GREEN_BRIGHTNESS 128
 #define WET_GREEN_BRIGHTNESS 200 //higher number is less bright
-#define HYSTERESIS_DELAY 2000 //milliseconds
+#define LED_DARK -1 //an LED pattern level that is off rather than dimmed
+#define LED_BLINK_TIME 250 //milliseconds on and off for the blink pattern
+#define HYSTERESIS_DELAY 2000 //milliseconds, for the holdoff filter
+#define INTEGRATOR_DELAY 3000 //milliseconds of net wet or dry time to change the integrator filter
+#define MAJORITY_SAMPLES 15 //samples the majority filter votes on, must be odd and <= 32
+#define MAJORITY_SAMPLE_PERIOD 200 //milliseconds between majority filter samples
+#define EXPONENTIAL_SHIFT 4 //exponential filter weight is 1/2^EXPONENTIAL_SHIFT
+#define EXPONENTIAL_SAMPLE_PERIOD 100 //milliseconds between exponential filter samples
+#define FILTER_HOLDOFF 0 //take a change right away then ignore changes for HYSTERESIS_DELAY
+#define FILTER_INTEGRATOR 1 //change after mostly being in the new state for INTEGRATOR_DELAY
+#define FILTER_MAJORITY 2 //majority vote of the last MAJORITY_SAMPLES
+#define FILTER_EXPONENTIAL 3 //exponential moving average with hysteresis
+#define FILTER_COUNT 4
+#define DEFAULT_DEBOUNCE_FILTER FILTER_HOLDOFF
+#define SENSOR_EDGE_BUFFER_SIZE 64 //sensor transitions that can be buffered, must be a power of 2
 #define WIFI_LED_PORT LED_BUILTIN
 #define WARNING_LED_FLASH_RATE 1 //seconds
 #define VALID_SETTINGS_FLAG 0xDAB0
-#define SSID_SIZE 100
+#define SSID_SIZE 33 //802.11 allows 32 characters
+#define SETTINGS_STRINGS_SIZE 400 //all the string settings together, with a null each
 #define PASSWORD_SIZE 50
 #define ADDRESS_SIZE 30
 #define USERNAME_SIZE 50
 #define MY_HOSTNAME "GolfCart"
 #define MQTT_CLIENTID_SIZE 25
 #define MQTT_TOPIC_SIZE 150
+#define MQTT_TOPIC_SUFFIX_SIZE 20 //longest fixed topic suffix, plus one
+#define SERIAL_COMMAND_SIZE 200 //longest serial command line, plus one
 #define MQTT_TOPIC_LEVEL "level"
 #define MQTT_TOPIC_READING "value"
 #define MQTT_TOPIC_PERIOD "period"
+#define MQTT_TOPIC_HISTORY "history" //readings that were queued while offline
+#define MQTT_TOPIC_FLOW "flow" //flow meter total and rate
 #define MQTT_CLIENT_ID_ROOT "tankReporter"
 #define MQTT_TOPIC_COMMAND_REQUEST "command"
 #define MQTT_PAYLOAD_SENSOR_WET "wet"
 #define MQTT_PAYLOAD_SENSOR_DRY "dry"
 #define MQTT_PAYLOAD_SETTINGS_COMMAND "settings" //show all user accessable settings
-#define MQTT_PAYLOAD_RESET_PULSE_COMMAND "resetPulseCounter" //reset the pulse counter to zero
 #define MQTT_PAYLOAD_REBOOT_COMMAND "reboot" //reboot the controller
 #define MQTT_PAYLOAD_VERSION_COMMAND "version" //show the version number
 #define MQTT_PAYLOAD_STATUS_COMMAND "status" //show the most recent flow values
-#define JSON_STATUS_SIZE 450 //Keep an eye on this if status items are added
-#define PUBLISH_DELAY 400 //milliseconds to wait after publishing to MQTT to allow transaction to finish
+#define MQTT_PAYLOAD_METRICS_COMMAND "metrics" //send the metrics registry
+#define MQTT_PAYLOAD_RESET_PULSE_COMMAND "resetPulseCounter" //reset the pulse counter to zero
+// Task scheduler intervals and the lateness allowed before a run counts as an overrun
+#define SENSOR_TASK_INTERVAL 20 //milliseconds
+#define SENSOR_TASK_LATE_LIMIT 50 //milliseconds
+#define LED_TASK_INTERVAL 50 //milliseconds
+#define LED_TASK_LATE_LIMIT 250 //milliseconds
+#define SERIAL_TASK_INTERVAL 20 //milliseconds
+#define SERIAL_TASK_LATE_LIMIT 250 //milliseconds
+#define OTA_TASK_INTERVAL 50 //milliseconds
+#define OTA_TASK_LATE_LIMIT 250 //milliseconds
+#define WIFI_TASK_INTERVAL 100 //milliseconds between network state machine steps
+#define WIFI_TASK_LATE_LIMIT 1000 //milliseconds
+#define WIFI_RETRY_INTERVAL 30000 //milliseconds between failed connection attempts
+#define WIFI_SCAN_TIMEOUT 10000 //milliseconds to wait for an asynchronous scan
+#define WIFI_CONNECT_TIMEOUT 30000 //milliseconds to wait for association or an IP address
+#define WIFI_FAST_CONNECT_TIMEOUT 5000 //same, but when using the cached access point and lease
+#define MQTT_TASK_INTERVAL 50 //milliseconds
+#define MQTT_TASK_LATE_LIMIT 250 //milliseconds
+#define MQTT_DNS_TIMEOUT 2000 //milliseconds to look up the broker's address
+#define MQTT_TCP_TIMEOUT 2000 //milliseconds to open the TCP connection to the broker
+#define MQTT_CONNACK_TIMEOUT 3 //seconds to wait for CONNACK, and for SUBACK
+#define MQTT_BACKOFF_MIN 1000 //milliseconds before the first retry
+#define MQTT_BACKOFF_MAX 300000 //milliseconds, the longest wait between retries
+#define MQTT_SUBACK_HEADER 0x90 //first byte of an MQTT SUBACK packet
+#define MQTT_DNS_TTL 3600 //seconds the broker's looked up address is used for
+#define MQTT_KEEPALIVE_MARGIN 30 //seconds of keepalive beyond the report interval
+#define MQTT_KEEPALIVE_MIN 15 //seconds
+#define MQTT_KEEPALIVE_MAX 1800 //seconds
+#define MQTT_BACKUP_BROKERS_SIZE 100 //host[:port] of each backup broker, separated by commas
+#define MQTT_BROKER_MAX 3 //the broker and its backups
+#define MQTT_BROKER_DOWN_AFTER 3 //failed connection attempts in a row before trying another broker
+#define MQTT_HEALTH_SHIFT 3 //each new latency or error counts for 1/8 of a broker's health
+#define MQTT_ERROR_PENALTY 5000 //milliseconds of latency a broker that always fails is scored as
+#define MQTT_FAILBACK_PROBE 300 //seconds between checks that the primary broker is back
+#define MQTT_PROBE_TIMEOUT 250 //milliseconds for each step of that check
+#define TLS_OFF 0 //plain MQTT
+#define TLS_FINGERPRINT 1 //TLS, checking the broker's certificate against its SHA1 fingerprint
+#define TLS_CA 2 //TLS, checking the broker's certificate against the CA certificates in TLS_CA_FILE
+#define TLS_CA_FILE "/ca.pem"
+#define TLS_FINGERPRINT_SIZE 60 //SHA1 as hex pairs with separators, plus one
+#define TLS_SESSION_SIZE 96 //bytes of RTC memory for a BearSSL::Session
+#define TLS_RX_BUFFER_SIZE 1024 //bytes, if the broker will send records this small
+#define TLS_FULL_RX_BUFFER_SIZE (16384+325) //bytes, a whole TLS record and its overhead
+#define TLS_TX_BUFFER_SIZE 512 //bytes
+#define TLS_FRAGMENT_UNKNOWN 0
+#define TLS_FRAGMENT_SMALL 1 //the broker agreed to TLS_RX_BUFFER_SIZE records
+#define TLS_FRAGMENT_FULL 2 //it didn't
+#define TLS_HANDSHAKE_TIMEOUT 2000 //milliseconds to wait for the broker at each step of the TCP connection and TLS handshake
+#define TLS_NTP_SERVER "pool.ntp.org"
+#define TLS_MIN_TIME 1700000000 //Unix time before which the clock can't have been set
+#define TLS_TIME_WAIT 5000 //milliseconds to wait for SNTP before giving up on a connection attempt
+#define TLS_CLOCK_DRIFT 5 //seconds the time of day can wander before its offset is saved again
+#define REPORT_TASK_LATE_LIMIT 1000 //milliseconds
+#define SLEEP_TASK_INTERVAL 100 //milliseconds
+#define SLEEP_TASK_LATE_LIMIT 1000 //milliseconds
+#define SLEEP_COMMAND_WINDOW 1500 //milliseconds to wait for retained commands after reporting
+#define SLEEP_MAX_AWAKE_TIME 30000 //milliseconds, go back to sleep if we can't report by then
+#define REPORT_MODE_PERIODIC 0 //report every reportPeriod seconds
+#define REPORT_MODE_CHANGE 1 //report when the reading changes, and every heartbeatPeriod seconds
+#define DEFAULT_HEARTBEAT_PERIOD 3600 //seconds
+#define MAX_PERIOD (ULONG_MAX/1000) //seconds, the longest period that still fits in milliseconds
+#define MAX_SLEEP_TIME 10800 //seconds, the ESP8266 can't sleep much longer than 3 hours
+#define QUEUE_TASK_INTERVAL 200 //milliseconds
+#define QUEUE_TASK_LATE_LIMIT 1000 //milliseconds
+#define RTC_QUEUE_SIZE 32 //readings held in RTC memory before moving them to flash
+#define QUEUE_FILE_NAME "/queue.dat"
+#define QUEUE_FILE_MAGIC 0x51554531
+#define DEFAULT_QUEUE_DEPTH 1000 //readings held in the flash queue file
+#define MAX_QUEUE_DEPTH 8000
+#define QUEUE_FLUSH_BATCH 8 //queued readings sent per run of the queue task
+#define QUEUE_DROP_OLDEST 0 //when the queue is full, lose the oldest reading
+#define QUEUE_DROP_NEWEST 1 //when the queue is full, lose the new reading
+#define SETTINGS_COMMIT_DELAY 2000 //milliseconds without changes before the settings are written to flash
+#define SETTINGS_TASK_LATE_LIMIT 1000 //milliseconds
+#define SETTINGS_JOURNAL_NAME "/settings%u.jnl"
+#define SETTINGS_JOURNAL_NAME_SIZE 20
+#define SETTINGS_JOURNAL_MAGIC 0x534A4E31
+#define METRICS_TASK_INTERVAL 1000 //milliseconds between heap samples
+#define METRICS_TASK_LATE_LIMIT 1000 //milliseconds
+#define HISTOGRAM_BUCKETS 24 //log2 latency buckets, the last one counts 8 seconds and up
+#define SETTINGS_SCHEMA_VERSION 1 //of the saved settings format. 0 was the whole conf struct.
+#define SETTINGS_JOURNAL_SEGMENTS 4 //files the settings journal goes round
+#define SETTINGS_SEGMENT_SIZE 4096 //bytes, one flash sector
+#define JSON_STATUS_SIZE 450 //MQTT client buffer size. Outgoing JSON is streamed so it isn't limited by this.
+#define PUBLISH_PIPELINE_DEPTH 4 //messages waiting to be published
+#define PUBLISH_SLOT_SIZE 320 //topic and payload of a pipelined message, with both nulls
+#define PUBLISH_ACK_POLL 1 //milliseconds flush() waits each time it checks for the acknowledgement
+#define PUBLISH_ACK_TIMEOUT 2000 //milliseconds to wait for a message to be acknowledged
+#define PUBLISH_TASK_INTERVAL 0 //milliseconds, every pass through the loop while there's work
+#define PUBLISH_TASK_LATE_LIMIT 50 //milliseconds
 
 // Error codes copied from the MQTT library
 // #define MQTT_CONNECTION_REFUSED            -2
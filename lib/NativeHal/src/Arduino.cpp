@@ -0,0 +1,469 @@
+// The Arduino core stand-ins: simulated time, GPIO, the serial port and the ESP
+// class.  See Arduino.h.
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "nativeHal.h"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define HAL_HEAP_SIZE 81920 //what the firmware sees as the heap, about what an ESP8266 has free at boot
+#define HAL_RTC_MEMORY_SIZE 512
+#define HAL_SERIAL_OUTPUT_SIZE 16384
+
+HardwareSerial Serial;
+EspClass ESP;
+volatile uint32_t halGpioIn=0;
+
+/************************
+ * Time
+ */
+static uint64_t nowMicros=0;
+static bool realTime=false;
+static uint64_t realStart=0; //the host clock when real time was turned on, less nowMicros
+
+static uint64_t hostMicros()
+  {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t)now.tv_sec*1000000+now.tv_nsec/1000;
+  }
+
+static uint64_t currentMicros()
+  {
+  return realTime?hostMicros()-realStart:nowMicros;
+  }
+
+unsigned long millis()
+  {
+  return currentMicros()/1000;
+  }
+
+unsigned long micros()
+  {
+  return currentMicros();
+  }
+
+void halAdvanceMicros(uint64_t us)
+  {
+  if (realTime)
+    realStart-=us;
+  else
+    nowMicros+=us;
+  }
+
+void halAdvanceMillis(unsigned long ms)
+  {
+  halAdvanceMicros((uint64_t)ms*1000);
+  }
+
+void halRealTime(bool on)
+  {
+  if (on && !realTime)
+    realStart=hostMicros()-nowMicros;
+  else if (!on && realTime)
+    nowMicros=hostMicros()-realStart;
+  realTime=on;
+  }
+
+void delay(unsigned long ms)
+  {
+  if (realTime)
+    usleep(ms*1000);
+  else
+    halAdvanceMillis(ms);
+  }
+
+void delayMicroseconds(unsigned int us)
+  {
+  halAdvanceMicros(us);
+  }
+
+void yield()
+  {
+  }
+
+void configTime(int timezone, int daylightOffset, const char* server1, const char* server2, const char* server3)
+  {
+  }
+
+/************************
+ * GPIO
+ */
+static void (*pinIsr[HAL_PINS])();
+static int pinIsrMode[HAL_PINS];
+static int outputLevel[HAL_PINS];
+static bool outputLevelsSet=false;
+static int analogValue=0;
+
+static void startOutputs()
+  {
+  if (!outputLevelsSet)
+    {
+    for (int i=0;i<HAL_PINS;i++)
+      outputLevel[i]=-1;
+    outputLevelsSet=true;
+    }
+  }
+
+void pinMode(uint8_t pin, uint8_t mode)
+  {
+  if (mode==INPUT_PULLUP && pin<HAL_PINS && pin!=A0)
+    halGpioIn|=1UL<<pin; //nothing is pulling it down yet
+  }
+
+int digitalRead(uint8_t pin)
+  {
+  return GPIP(pin);
+  }
+
+void digitalWrite(uint8_t pin, uint8_t level)
+  {
+  startOutputs();
+  if (pin<HAL_PINS)
+    outputLevel[pin]=level;
+  }
+
+int halOutputLevel(uint8_t pin)
+  {
+  startOutputs();
+  return pin<HAL_PINS?outputLevel[pin]:-1;
+  }
+
+void analogWrite(uint8_t pin, int value)
+  {
+  digitalWrite(pin,value);
+  }
+
+int analogRead(uint8_t pin)
+  {
+  return analogValue;
+  }
+
+void halSetAnalog(int value)
+  {
+  analogValue=value;
+  }
+
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode)
+  {
+  if (pin<HAL_PINS)
+    {
+    pinIsr[pin]=isr;
+    pinIsrMode[pin]=mode;
+    }
+  }
+
+void detachInterrupt(uint8_t pin)
+  {
+  if (pin<HAL_PINS)
+    pinIsr[pin]=NULL;
+  }
+
+void noInterrupts()
+  {
+  }
+
+void interrupts()
+  {
+  }
+
+void halSetPin(uint8_t pin, uint8_t level)
+  {
+  if (pin>=HAL_PINS || pin==A0 || (int)GPIP(pin)==(level?1:0))
+    return;
+  if (level)
+    halGpioIn|=1UL<<pin;
+  else
+    halGpioIn&=~(1UL<<pin);
+  int mode=pinIsrMode[pin];
+  if (pinIsr[pin]!=NULL && (mode==CHANGE || (mode==RISING && level) || (mode==FALLING && !level)))
+    pinIsr[pin]();
+  }
+
+long random(long howBig)
+  {
+  return howBig>0?rand()%howBig:0;
+  }
+
+long random(long howSmall, long howBig)
+  {
+  return howBig>howSmall?howSmall+random(howBig-howSmall):howSmall;
+  }
+
+void randomSeed(unsigned long seed)
+  {
+  srand(seed);
+  }
+
+/************************
+ * Strings and printing
+ */
+static std::string formatNumber(unsigned long long n, int base, bool negative)
+  {
+  char buf[70];
+  char* p=&buf[sizeof(buf)-1];
+  *p='\0';
+  if (base<2)
+    base=10;
+  do
+    {
+    int digit=n%base;
+    *--p=digit<10?'0'+digit:'A'+digit-10;
+    n/=base;
+    } while (n>0);
+  if (negative)
+    *--p='-';
+  return std::string(p);
+  }
+
+String::String(int value, unsigned char base) : String((long)value,base) {}
+String::String(unsigned int value, unsigned char base) : String((unsigned long)value,base) {}
+String::String(long value, unsigned char base)
+  : s(formatNumber(value<0 && base==10?-(unsigned long long)value:(unsigned long)value,base,value<0 && base==10)) {}
+String::String(unsigned long value, unsigned char base) : s(formatNumber(value,base,false)) {}
+
+bool IPAddress::fromString(const char* text)
+  {
+  uint32_t parts[4];
+  int used=0;
+  if (text==NULL || sscanf(text,"%u.%u.%u.%u%n",&parts[0],&parts[1],&parts[2],&parts[3],&used)!=4
+      || text[used]!='\0')
+    return false;
+  for (int i=0;i<4;i++)
+    if (parts[i]>255)
+      return false;
+  address=parts[0]|(parts[1]<<8)|(parts[2]<<16)|(parts[3]<<24);
+  return true;
+  }
+
+String IPAddress::toString() const
+  {
+  char buf[16];
+  snprintf(buf,sizeof(buf),"%u.%u.%u.%u",(*this)[0],(*this)[1],(*this)[2],(*this)[3]);
+  return String(buf);
+  }
+
+size_t Print::write(const uint8_t* data, size_t size)
+  {
+  size_t n=0;
+  while (size-- && write(*data++))
+    n++;
+  return n;
+  }
+
+size_t Print::print(long n, int base)
+  {
+  char buf[70];
+  if (base==DEC)
+    {
+    snprintf(buf,sizeof(buf),"%ld",n);
+    return write(buf);
+    }
+  return print((unsigned long)n,base);
+  }
+
+size_t Print::print(unsigned long n, int base)
+  {
+  return print((unsigned long long)n,base);
+  }
+
+size_t Print::print(long long n, int base)
+  {
+  char buf[70];
+  if (base==DEC)
+    {
+    snprintf(buf,sizeof(buf),"%lld",n);
+    return write(buf);
+    }
+  return print((unsigned long long)n,base);
+  }
+
+size_t Print::print(unsigned long long n, int base)
+  {
+  char buf[70];
+  char* p=&buf[sizeof(buf)-1];
+  *p='\0';
+  if (base<2)
+    base=DEC;
+  do
+    {
+    int digit=n%base;
+    *--p=digit<10?'0'+digit:'A'+digit-10;
+    n/=base;
+    } while (n>0);
+  return write(p);
+  }
+
+size_t Print::print(double n, int digits)
+  {
+  char buf[64];
+  snprintf(buf,sizeof(buf),"%.*f",digits,n);
+  return write(buf);
+  }
+
+size_t Print::printf(const char* format, ...)
+  {
+  char buf[256];
+  va_list args;
+  va_start(args,format);
+  int n=vsnprintf(buf,sizeof(buf),format,args);
+  va_end(args);
+  if (n<0)
+    return 0;
+  return write((const uint8_t*)buf,(size_t)n<sizeof(buf)?n:sizeof(buf)-1);
+  }
+
+/************************
+ * The serial port.  Input and output go through fixed ring buffers.
+ */
+static char serialIn[HAL_SERIAL_SIZE];
+static size_t serialInHead=0, serialInCount=0;
+static char serialOut[HAL_SERIAL_OUTPUT_SIZE];
+static size_t serialOutHead=0, serialOutCount=0;
+static bool serialEcho=false;
+
+int HardwareSerial::available()
+  {
+  return serialInCount;
+  }
+
+int HardwareSerial::peek()
+  {
+  return serialInCount>0?(uint8_t)serialIn[serialInHead]:-1;
+  }
+
+int HardwareSerial::read()
+  {
+  int c=peek();
+  if (c>=0)
+    {
+    serialInHead=(serialInHead+1)%sizeof(serialIn);
+    serialInCount--;
+    }
+  return c;
+  }
+
+size_t HardwareSerial::write(uint8_t c)
+  {
+  return write(&c,1);
+  }
+
+size_t HardwareSerial::write(const uint8_t* data, size_t size)
+  {
+  if (serialEcho)
+    fwrite(data,1,size,stdout);
+  for (size_t i=0;i<size;i++)
+    {
+    serialOut[(serialOutHead+serialOutCount)%sizeof(serialOut)]=data[i];
+    if (serialOutCount<sizeof(serialOut))
+      serialOutCount++;
+    else
+      serialOutHead=(serialOutHead+1)%sizeof(serialOut); //lose the oldest
+    }
+  return size;
+  }
+
+void halSerialInput(const char* text)
+  {
+  while (*text && serialInCount<sizeof(serialIn))
+    {
+    serialIn[(serialInHead+serialInCount)%sizeof(serialIn)]=*text++;
+    serialInCount++;
+    }
+  }
+
+size_t halSerialOutput(char* buf, size_t size)
+  {
+  size_t n=0;
+  while (serialOutCount>0 && n+1<size)
+    {
+    buf[n++]=serialOut[serialOutHead];
+    serialOutHead=(serialOutHead+1)%sizeof(serialOut);
+    serialOutCount--;
+    }
+  if (size>0)
+    buf[n]='\0';
+  return n;
+  }
+
+void halSerialEcho(bool on)
+  {
+  serialEcho=on;
+  }
+
+/************************
+ * The ESP class.  Restarts and deep sleep just note that they were asked for.
+ */
+static bool restartRequested=false;
+static uint64_t deepSleepRequested=0;
+static uint32_t rtcMemory[HAL_RTC_MEMORY_SIZE/4];
+
+void EspClass::restart()
+  {
+  restartRequested=true;
+  }
+
+void EspClass::deepSleep(uint64_t micros, int mode)
+  {
+  deepSleepRequested=micros>0?micros:1;
+  }
+
+bool halRestartRequested()
+  {
+  return restartRequested;
+  }
+
+uint64_t halDeepSleepRequested()
+  {
+  return deepSleepRequested;
+  }
+
+void halClearRequests()
+  {
+  restartRequested=false;
+  deepSleepRequested=0;
+  }
+
+size_t halHeapInUse()
+  {
+#ifdef __GLIBC__
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+  }
+
+// Counted from the first call, so the host's own allocations don't show
+uint32_t EspClass::getFreeHeap()
+  {
+  static size_t baseline=halHeapInUse();
+  size_t inUse=halHeapInUse();
+  size_t used=inUse>baseline?inUse-baseline:0;
+  return used<HAL_HEAP_SIZE?HAL_HEAP_SIZE-used:0;
+  }
+
+uint16_t EspClass::getMaxFreeBlockSize()
+  {
+  uint32_t free=getFreeHeap();
+  return free>0xffff?0xffff:free;
+  }
+
+// Offsets are in 4 byte blocks, as on the ESP8266
+bool EspClass::rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size)
+  {
+  if (offset*4+size>sizeof(rtcMemory))
+    return false;
+  memcpy(data,(uint8_t*)rtcMemory+offset*4,size);
+  return true;
+  }
+
+bool EspClass::rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size)
+  {
+  if (offset*4+size>sizeof(rtcMemory))
+    return false;
+  memcpy((uint8_t*)rtcMemory+offset*4,data,size);
+  return true;
+  }
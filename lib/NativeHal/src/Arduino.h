@@ -0,0 +1,216 @@
+// A thin stand-in for the Arduino core and the ESP8266 SDK, so that src/main.cpp
+// builds and runs on a Linux host in the native environment.  It only covers what
+// main.cpp uses: time, GPIO, the serial port, RTC memory and the heap figures.
+//
+// Time is simulated.  It only moves when delay() is called or a test moves it on,
+// so a run does the same thing every time, however fast the host is.  A test
+// that calls loop() over and over has to move time on itself, since the firmware
+// is busy on every pass while it isn't configured.  Input pins
+// are set by the test and fire any interrupt attached to them.  The serial port
+// reads from a buffer the test fills and its output is kept for the test to look
+// at.  Nothing here allocates after startup, so tests can watch the heap (only
+// the LittleFS stand-in does, as files grow).  The controls a test uses are in
+// nativeHal.h.
+
+#ifndef NATIVE_HAL_ARDUINO_H
+#define NATIVE_HAL_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <functional>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 3
+#define RISING 4
+#define FALLING 5
+
+// The Wemos D1 mini pin names
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define A0 17
+#define LED_BUILTIN 2
+#define HAL_PINS 18
+
+#define HEX 16
+#define DEC 10
+
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define PROGMEM
+#define F(x) x
+#define digitalPinToInterrupt(p) (p)
+
+// The GPIO input register, one bit per pin
+extern volatile uint32_t halGpioIn;
+#define GPI halGpioIn
+#define GPIP(p) ((halGpioIn>>(p))&1)
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t level);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode);
+void detachInterrupt(uint8_t pin);
+void noInterrupts();
+void interrupts();
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+void configTime(int timezone, int daylightOffset, const char* server1,
+                const char* server2=nullptr, const char* server3=nullptr);
+
+class String
+  {
+  public:
+  String(const char* s="") : s(s!=NULL?s:"") {}
+  String(const std::string& s) : s(s) {}
+  String(int value, unsigned char base=10);
+  String(unsigned int value, unsigned char base=10);
+  String(long value, unsigned char base=10);
+  String(unsigned long value, unsigned char base=10);
+  const char* c_str() const {return s.c_str();}
+  unsigned int length() const {return s.length();}
+  bool reserve(unsigned int size) {s.reserve(size); return true;}
+  String& operator+=(char c) {s+=c; return *this;}
+  String& operator+=(const char* t) {s+=t; return *this;}
+  String& operator+=(const String& t) {s+=t.s; return *this;}
+  bool operator==(const char* t) const {return s==t;}
+  bool operator==(const String& t) const {return s==t.s;}
+  bool operator!=(const char* t) const {return s!=t;}
+  String operator+(const char* t) const {return String(s+t);}
+  String operator+(const String& t) const {return String(s+t.s);}
+  friend String operator+(const char* a, const String& b) {return String(std::string(a)+b.s);}
+
+  private:
+  std::string s;
+  };
+
+class IPAddress
+  {
+  public:
+  IPAddress() : address(0) {}
+  IPAddress(uint32_t address) : address(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a|(b<<8)|(c<<16)|((uint32_t)d<<24)) {}
+  bool fromString(const char* text);
+  String toString() const;
+  bool isSet() const {return address!=0;}
+  operator uint32_t() const {return address;}
+  uint8_t operator[](int i) const {return (address>>(8*i))&0xff;}
+  bool operator==(const IPAddress& other) const {return address==other.address;}
+
+  private:
+  uint32_t address;  //first octet in the low byte, as lwip keeps it
+  };
+
+class Print
+  {
+  public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c)=0;
+  virtual size_t write(const uint8_t* data, size_t size);
+  size_t write(const char* s) {return write((const uint8_t*)s,strlen(s));}
+  virtual void flush() {}
+
+  size_t print(const char* s) {return write(s);}
+  size_t print(const String& s) {return write(s.c_str());}
+  size_t print(char c) {return write((uint8_t)c);}
+  size_t print(unsigned char n, int base=DEC) {return print((unsigned long)n,base);}
+  size_t print(int n, int base=DEC) {return print((long)n,base);}
+  size_t print(unsigned int n, int base=DEC) {return print((unsigned long)n,base);}
+  size_t print(long n, int base=DEC);
+  size_t print(unsigned long n, int base=DEC);
+  size_t print(long long n, int base=DEC);
+  size_t print(unsigned long long n, int base=DEC);
+  size_t print(double n, int digits=2);
+  size_t print(const IPAddress& ip) {return print(ip.toString());}
+
+  size_t println() {return write("\r\n");}
+  template <typename T> size_t println(T value) {return print(value)+println();}
+  template <typename T> size_t println(T value, int format) {return print(value,format)+println();}
+
+  size_t printf(const char* format, ...) __attribute__((format(printf,2,3)));
+  };
+
+class Stream : public Print
+  {
+  public:
+  virtual int available()=0;
+  virtual int read()=0;
+  virtual int peek()=0;
+  void setTimeout(unsigned long timeout) {this->timeout=timeout;}
+
+  protected:
+  unsigned long timeout=1000;
+  };
+
+class HardwareSerial : public Stream
+  {
+  public:
+  void begin(unsigned long baud) {}
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t size) override;
+  using Print::write;
+  operator bool() const {return true;}
+  };
+
+extern HardwareSerial Serial;
+
+class EspClass
+  {
+  public:
+  void restart();
+  void deepSleep(uint64_t micros, int mode=0);
+  uint32_t getChipId() {return 0x5eed01;}
+  uint32_t getFreeHeap();
+  uint16_t getMaxFreeBlockSize();
+  uint8_t getHeapFragmentation() {return 0;}
+  uint32_t getCycleCount() {return micros()*80;}
+  const char* getResetReason() {return "Power On";}
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t* data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t* data, size_t size);
+  };
+
+extern EspClass ESP;
+
+#define RF_DEFAULT 0
+#define RF_DISABLED 4
+#define WAKE_RF_DEFAULT 0
+#define WAKE_RFCAL 1
+#define WAKE_NO_RFCAL 2
+#define WAKE_RF_DISABLED 4
+
+void setup();
+void loop();
+
+#endif
@@ -0,0 +1,28 @@
+// Over the air updates can't happen on the host, so none of these callbacks are
+// ever called
+
+#ifndef NATIVE_HAL_ARDUINO_OTA_H
+#define NATIVE_HAL_ARDUINO_OTA_H
+
+#include <Arduino.h>
+
+#define U_FLASH 0
+#define U_FS 100
+
+typedef enum {OTA_AUTH_ERROR, OTA_BEGIN_ERROR, OTA_CONNECT_ERROR, OTA_RECEIVE_ERROR, OTA_END_ERROR} ota_error_t;
+
+class ArduinoOTAClass
+  {
+  public:
+  void onStart(std::function<void()> fn) {}
+  void onEnd(std::function<void()> fn) {}
+  void onProgress(std::function<void(unsigned int, unsigned int)> fn) {}
+  void onError(std::function<void(ota_error_t)> fn) {}
+  void begin() {}
+  void handle() {}
+  int getCommand() {return U_FLASH;}
+  };
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
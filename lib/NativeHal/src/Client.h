@@ -0,0 +1,20 @@
+// The Arduino network client interface, as PubSubClient expects it
+
+#ifndef NATIVE_HAL_CLIENT_H
+#define NATIVE_HAL_CLIENT_H
+
+#include <Arduino.h>
+
+class Client : public Stream
+  {
+  public:
+  virtual int connect(IPAddress ip, uint16_t port)=0;
+  virtual int connect(const char* host, uint16_t port)=0;
+  virtual size_t write(uint8_t c)=0;
+  virtual size_t write(const uint8_t* data, size_t size)=0;
+  virtual void stop()=0;
+  virtual uint8_t connected()=0;
+  virtual operator bool()=0;
+  };
+
+#endif
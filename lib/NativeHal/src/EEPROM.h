@@ -0,0 +1,31 @@
+// The emulated EEPROM, which starts out erased as on a new device.  Only the
+// parts main.cpp uses to read settings left by older versions.
+
+#ifndef NATIVE_HAL_EEPROM_H
+#define NATIVE_HAL_EEPROM_H
+
+#include <Arduino.h>
+
+#define HAL_EEPROM_SIZE 4096
+
+class EEPROMClass
+  {
+  public:
+  EEPROMClass() {memset(data,0xff,sizeof(data));}
+  void begin(size_t size) {this->size=size<=HAL_EEPROM_SIZE?size:HAL_EEPROM_SIZE;}
+  void end() {}
+  bool commit() {return true;}
+  uint8_t read(int address) {return address>=0 && address<HAL_EEPROM_SIZE?data[address]:0xff;}
+  void write(int address, uint8_t value) {if (address>=0 && address<HAL_EEPROM_SIZE) data[address]=value;}
+  uint8_t* getDataPtr() {return data;}
+  const uint8_t* getConstDataPtr() const {return data;}
+  size_t length() {return size;}
+
+  private:
+  uint8_t data[HAL_EEPROM_SIZE];
+  size_t size=0;
+  };
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,256 @@
+// The WiFi and network client stand-ins.  See ESP8266WiFi.h.
+
+#include <ESP8266WiFi.h>
+#include "nativeHal.h"
+#include "halBroker.h"
+#include "lwip/dhcp.h"
+
+ESP8266WiFiClass WiFi;
+
+static struct dhcp lease={HAL_DHCP_LEASE,HAL_DHCP_LEASE/2,HAL_DHCP_LEASE*7/8};
+static struct netif station={&lease};
+struct netif* netif_default=&station;
+
+static bool wifiUp=true;
+static bool brokerUp=true;
+static bool joined=false;       //begin() was called and the network was up
+static int8_t scanResult=WIFI_SCAN_FAILED;
+static uint8_t bssid[6]={0x02,0x00,0x00,0x00,0x00,0x01};
+static std::function<void(const WiFiEventStationModeConnected&)> connectedHandler;
+static std::function<void(const WiFiEventStationModeDisconnected&)> disconnectedHandler;
+static WiFiEventHandlerOpaque handlerToken;
+
+static void leave()
+  {
+  if (!joined)
+    return;
+  joined=false;
+  halDropConnections();
+  if (disconnectedHandler)
+    {
+    WiFiEventStationModeDisconnected event;
+    memcpy(event.bssid,bssid,sizeof(event.bssid));
+    event.reason=8; //assoc leave
+    disconnectedHandler(event);
+    }
+  }
+
+void halSetWifi(bool up)
+  {
+  wifiUp=up;
+  if (!up)
+    leave();
+  }
+
+void halSetBroker(bool up)
+  {
+  brokerUp=up;
+  if (!up)
+    halDropConnections();
+  }
+
+bool ESP8266WiFiClass::config(IPAddress localIP, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress dns2)
+  {
+  return true;
+  }
+
+wl_status_t ESP8266WiFiClass::begin(const char* ssid, const char* password, int32_t channel, const uint8_t* bssid, bool connect)
+  {
+  leave();
+  if (!wifiUp || strcmp(ssid,HAL_SSID)!=0)
+    return WL_NO_SSID_AVAIL;
+  joined=true;
+  if (connectedHandler)
+    {
+    WiFiEventStationModeConnected event;
+    event.ssid=ssid;
+    memcpy(event.bssid,::bssid,sizeof(event.bssid));
+    event.channel=6;
+    connectedHandler(event);
+    }
+  return WL_CONNECTED;
+  }
+
+bool ESP8266WiFiClass::disconnect(bool wifiOff)
+  {
+  leave();
+  return true;
+  }
+
+wl_status_t ESP8266WiFiClass::status()
+  {
+  return joined?WL_CONNECTED:WL_DISCONNECTED;
+  }
+
+int8_t ESP8266WiFiClass::scanNetworks(bool async, bool showHidden, uint8_t channel, uint8_t* ssid)
+  {
+  scanResult=wifiUp?1:0;
+  return scanResult;
+  }
+
+int8_t ESP8266WiFiClass::scanComplete()
+  {
+  return scanResult;
+  }
+
+void ESP8266WiFiClass::scanDelete()
+  {
+  scanResult=WIFI_SCAN_FAILED;
+  }
+
+String ESP8266WiFiClass::SSID(uint8_t i)
+  {
+  return String(i<scanResult?HAL_SSID:"");
+  }
+
+uint8_t* ESP8266WiFiClass::BSSID()
+  {
+  return bssid;
+  }
+
+IPAddress ESP8266WiFiClass::localIP()
+  {
+  return joined?IPAddress(127,0,0,2):IPAddress();
+  }
+
+int ESP8266WiFiClass::hostByName(const char* name, IPAddress& address, uint32_t timeoutMs)
+  {
+  if (!joined)
+    return 0;
+  address=IPAddress(127,0,0,1);
+  return 1;
+  }
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeConnected(std::function<void(const WiFiEventStationModeConnected&)> fn)
+  {
+  connectedHandler=fn;
+  return &handlerToken;
+  }
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> fn)
+  {
+  disconnectedHandler=fn;
+  return &handlerToken;
+  }
+
+/************************
+ * What the broker has sent and the device hasn't read yet
+ */
+static uint8_t outbox[HAL_BROKER_OUTBOX_SIZE];
+static size_t outboxHead=0, outboxCount=0;
+
+bool halBrokerSend(const uint8_t* data, size_t size)
+  {
+  if (outboxCount+size>sizeof(outbox))
+    return false;
+  for (size_t i=0;i<size;i++)
+    outbox[(outboxHead+outboxCount++)%sizeof(outbox)]=data[i];
+  return true;
+  }
+
+int halBrokerAvailable()
+  {
+  return outboxCount;
+  }
+
+int halBrokerPeek()
+  {
+  return outboxCount>0?outbox[outboxHead]:-1;
+  }
+
+int halBrokerRead()
+  {
+  int c=halBrokerPeek();
+  if (c>=0)
+    {
+    outboxHead=(outboxHead+1)%sizeof(outbox);
+    outboxCount--;
+    }
+  return c;
+  }
+
+void halBrokerClear()
+  {
+  outboxHead=0;
+  outboxCount=0;
+  }
+
+bool halBrokerUp()
+  {
+  return joined && brokerUp;
+  }
+
+/************************
+ * The network client.  An open client talks to the broker: what it writes is
+ * thrown away and what it reads comes from the broker's outbox.
+ */
+static WiFiClient* clients[4];
+
+void halDropConnections()
+  {
+  for (unsigned int i=0;i<sizeof(clients)/sizeof(clients[0]);i++)
+    if (clients[i]!=NULL)
+      clients[i]->stop();
+  halBrokerClear();
+  }
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+  {
+  stop();
+  if (!joined || !brokerUp)
+    return 0;
+  for (unsigned int i=0;i<sizeof(clients)/sizeof(clients[0]);i++)
+    if (clients[i]==NULL)
+      {
+      clients[i]=this;
+      open=true;
+      return 1;
+      }
+  return 0;
+  }
+
+int WiFiClient::connect(const char* host, uint16_t port)
+  {
+  IPAddress address;
+  if (WiFi.hostByName(host,address)!=1)
+    return 0;
+  return connect(address,port);
+  }
+
+size_t WiFiClient::write(uint8_t c)
+  {
+  return open?1:0;
+  }
+
+size_t WiFiClient::write(const uint8_t* data, size_t size)
+  {
+  return open?size:0;
+  }
+
+int WiFiClient::available()
+  {
+  return open?halBrokerAvailable():0;
+  }
+
+int WiFiClient::read()
+  {
+  return open?halBrokerRead():-1;
+  }
+
+int WiFiClient::peek()
+  {
+  return open?halBrokerPeek():-1;
+  }
+
+void WiFiClient::stop()
+  {
+  for (unsigned int i=0;i<sizeof(clients)/sizeof(clients[0]);i++)
+    if (clients[i]==this)
+      clients[i]=NULL;
+  open=false;
+  }
+
+uint8_t WiFiClient::connected()
+  {
+  return open;
+  }
@@ -0,0 +1,135 @@
+// The ESP8266 WiFi stand-in.  There is one access point, HAL_SSID, that takes any
+// password, and one broker that any name resolves to.  Tests bring either up or
+// down with halSetWifi() and halSetBroker().  The TLS client behaves just like the
+// plain one, since there's nothing to encrypt on the host.
+
+#ifndef NATIVE_HAL_ESP8266_WIFI_H
+#define NATIVE_HAL_ESP8266_WIFI_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+typedef enum
+  {
+  WL_IDLE_STATUS=0,
+  WL_NO_SSID_AVAIL=1,
+  WL_SCAN_COMPLETED=2,
+  WL_CONNECTED=3,
+  WL_CONNECT_FAILED=4,
+  WL_CONNECTION_LOST=5,
+  WL_WRONG_PASSWORD=6,
+  WL_DISCONNECTED=7
+  } wl_status_t;
+
+typedef enum {WIFI_OFF=0, WIFI_STA=1, WIFI_AP=2, WIFI_AP_STA=3} WiFiMode_t;
+
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+struct WiFiEventStationModeConnected
+  {
+  String ssid;
+  uint8_t bssid[6];
+  uint8_t channel;
+  };
+
+struct WiFiEventStationModeDisconnected
+  {
+  String ssid;
+  uint8_t bssid[6];
+  uint8_t reason;
+  };
+
+struct WiFiEventHandlerOpaque
+  {
+  };
+typedef WiFiEventHandlerOpaque* WiFiEventHandler;
+
+class ESP8266WiFiClass
+  {
+  public:
+  bool mode(WiFiMode_t mode) {return true;}
+  bool persistent(bool persistent) {return true;}
+  bool hostname(const char* name) {return true;}
+  bool config(IPAddress localIP, IPAddress gateway, IPAddress subnet, IPAddress dns1=IPAddress(), IPAddress dns2=IPAddress());
+  wl_status_t begin(const char* ssid, const char* password, int32_t channel=0, const uint8_t* bssid=NULL, bool connect=true);
+  bool disconnect(bool wifiOff=false);
+  wl_status_t status();
+
+  int8_t scanNetworks(bool async=false, bool showHidden=false, uint8_t channel=0, uint8_t* ssid=NULL);
+  int8_t scanComplete();
+  void scanDelete();
+  String SSID(uint8_t i);
+  int32_t RSSI() {return -60;}
+  uint8_t* BSSID();
+  int32_t channel() {return 6;}
+
+  IPAddress localIP();
+  IPAddress gatewayIP() {return IPAddress(127,0,0,1);}
+  IPAddress subnetMask() {return IPAddress(255,0,0,0);}
+  IPAddress dnsIP(uint8_t i=0) {return IPAddress(127,0,0,1);}
+  int hostByName(const char* name, IPAddress& address, uint32_t timeoutMs=10000);
+
+  WiFiEventHandler onStationModeConnected(std::function<void(const WiFiEventStationModeConnected&)> fn);
+  WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> fn);
+  };
+
+extern ESP8266WiFiClass WiFi;
+
+class WiFiClient : public Client
+  {
+  public:
+  ~WiFiClient() {stop();}
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char* host, uint16_t port) override;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override {}
+  bool flush(unsigned int maxWaitMs) {return true;}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override {return connected();}
+  void setNoDelay(bool noDelay) {}
+
+  private:
+  bool open=false;
+  };
+
+namespace BearSSL
+  {
+  class Session
+    {
+    public:
+    Session() {memset(session,0,sizeof(session));}
+
+    private:
+    unsigned char session[88];  //as big as the real one
+    };
+
+  class X509List
+    {
+    public:
+    X509List(const char* pem) {}
+    };
+
+  class WiFiClientSecure : public WiFiClient
+    {
+    public:
+    void setSession(Session* session) {}
+    bool setFingerprint(const char* fingerprint) {return fingerprint!=NULL && strlen(fingerprint)>=40;}
+    void setTrustAnchors(X509List* anchors) {}
+    void setX509Time(time_t now) {}
+    void setInsecure() {}
+    void setBufferSizes(int receive, int transmit) {}
+    static bool probeMaxFragmentLength(IPAddress ip, uint16_t port, uint16_t length) {return true;}
+    };
+  }
+
+// Used by the WiFi stand-in to drop connections when the network goes away
+void halDropConnections();
+
+#endif
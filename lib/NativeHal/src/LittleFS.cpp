@@ -0,0 +1,188 @@
+// The in-memory file system.  See LittleFS.h.
+
+#include <LittleFS.h>
+#include <dirent.h>
+#include "nativeHal.h"
+
+FS LittleFS;
+
+static struct
+  {
+  char name[HAL_FILE_NAME_SIZE];
+  std::string data;
+  } files[HAL_FILES];
+static std::string hostDirectory; //where changes are written back, empty for nowhere
+
+static std::string hostPath(const char* name)
+  {
+  return hostDirectory+"/"+(name[0]=='/'?name+1:name);
+  }
+
+// Write a whole file back to the host.  They are small enough not to bother with
+// just the changed part.
+static void writeBack(int slot)
+  {
+  if (hostDirectory.empty())
+    return;
+  FILE* f=fopen(hostPath(files[slot].name).c_str(),"wb");
+  if (f==NULL)
+    return;
+  fwrite(files[slot].data.data(),1,files[slot].data.size(),f);
+  fclose(f);
+  }
+
+bool halFilesDirectory(const char* dir)
+  {
+  hostDirectory.clear();
+  if (dir==NULL)
+    return true;
+  DIR* d=opendir(dir);
+  if (d==NULL)
+    return false;
+  LittleFS.format();
+  int slot=0;
+  struct dirent* entry;
+  while ((entry=readdir(d))!=NULL && slot<HAL_FILES)
+    {
+    if (entry->d_name[0]=='.' || strlen(entry->d_name)+1>=HAL_FILE_NAME_SIZE)
+      continue;
+    std::string path=std::string(dir)+"/"+entry->d_name;
+    FILE* f=fopen(path.c_str(),"rb");
+    if (f==NULL)
+      continue;
+    files[slot].name[0]='/';
+    strcpy(files[slot].name+1,entry->d_name);
+    char buf[4096];
+    size_t n;
+    while ((n=fread(buf,1,sizeof(buf),f))>0)
+      files[slot].data.append(buf,n);
+    fclose(f);
+    slot++;
+    }
+  closedir(d);
+  hostDirectory=dir;
+  return true;
+  }
+
+static int findFile(const char* path)
+  {
+  for (int i=0;i<HAL_FILES;i++)
+    if (files[i].name[0]!='\0' && strcmp(files[i].name,path)==0)
+      return i;
+  return -1;
+  }
+
+bool FS::format()
+  {
+  for (int i=0;i<HAL_FILES;i++)
+    {
+    if (files[i].name[0]!='\0' && !hostDirectory.empty())
+      ::remove(hostPath(files[i].name).c_str());
+    files[i].name[0]='\0';
+    files[i].data.clear();
+    }
+  return true;
+  }
+
+File FS::open(const char* path, const char* mode)
+  {
+  bool plus=strchr(mode,'+')!=NULL;
+  int slot=findFile(path);
+  if (mode[0]=='r')
+    return slot>=0?File(slot,true,plus,0):File();
+  if (strlen(path)>=HAL_FILE_NAME_SIZE)
+    return File();
+  for (int i=0;slot<0 && i<HAL_FILES;i++)
+    if (files[i].name[0]=='\0')
+      {
+      strcpy(files[i].name,path);
+      files[i].data.clear();
+      slot=i;
+      }
+  if (slot<0)
+    return File(); //full
+  if (mode[0]=='w')
+    files[slot].data.clear();
+  writeBack(slot);
+  return File(slot,plus,true,mode[0]=='a'?files[slot].data.size():0);
+  }
+
+bool FS::exists(const char* path)
+  {
+  return findFile(path)>=0;
+  }
+
+bool FS::remove(const char* path)
+  {
+  int slot=findFile(path);
+  if (slot<0)
+    return false;
+  if (!hostDirectory.empty())
+    ::remove(hostPath(path).c_str());
+  files[slot].name[0]='\0';
+  files[slot].data.clear();
+  return true;
+  }
+
+bool FS::rename(const char* from, const char* to)
+  {
+  int slot=findFile(from);
+  if (slot<0 || strlen(to)>=HAL_FILE_NAME_SIZE)
+    return false;
+  remove(to);
+  if (!hostDirectory.empty())
+    ::rename(hostPath(from).c_str(),hostPath(to).c_str());
+  strcpy(files[slot].name,to);
+  return true;
+  }
+
+size_t File::write(const uint8_t* data, size_t size)
+  {
+  if (slot<0 || !writable)
+    return 0;
+  std::string& d=files[slot].data;
+  if (at>d.size())
+    d.resize(at,'\0');
+  d.replace(at,size,(const char*)data,size);
+  at+=size;
+  writeBack(slot);
+  return size;
+  }
+
+size_t File::read(uint8_t* data, size_t size)
+  {
+  if (slot<0 || !readable)
+    return 0;
+  const std::string& d=files[slot].data;
+  size_t n=at<d.size()?d.size()-at:0;
+  if (n>size)
+    n=size;
+  memcpy(data,d.data()+at,n);
+  at+=n;
+  return n;
+  }
+
+int File::read()
+  {
+  uint8_t c;
+  return read(&c,1)==1?c:-1;
+  }
+
+int File::available()
+  {
+  size_t s=size();
+  return readable && at<s?s-at:0;
+  }
+
+bool File::seek(uint32_t position)
+  {
+  if (slot<0 || position>files[slot].data.size())
+    return false;
+  at=position;
+  return true;
+  }
+
+size_t File::size() const
+  {
+  return slot>=0?files[slot].data.size():0;
+  }
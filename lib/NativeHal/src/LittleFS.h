@@ -0,0 +1,52 @@
+// The LittleFS stand-in: a handful of files kept in memory, which last as long
+// as the process does unless halFilesDirectory() gives them a home on the host.
+// Files open with the same modes as fopen().
+
+#ifndef NATIVE_HAL_LITTLEFS_H
+#define NATIVE_HAL_LITTLEFS_H
+
+#include <Arduino.h>
+
+#define HAL_FILES 16
+#define HAL_FILE_NAME_SIZE 32
+
+class File : public Print
+  {
+  public:
+  File() {}
+  File(int slot, bool readable, bool writable, size_t position)
+    : slot(slot), readable(readable), writable(writable), at(position) {}
+  size_t write(uint8_t c) override {return write(&c,1);}
+  size_t write(const uint8_t* data, size_t size) override;
+  using Print::write;
+  size_t read(uint8_t* data, size_t size);
+  int read();
+  int available();
+  bool seek(uint32_t position);
+  size_t position() const {return at;}
+  size_t size() const;
+  void close() {slot=-1;}
+  operator bool() const {return slot>=0;}
+
+  private:
+  int slot=-1;
+  bool readable=false;
+  bool writable=false;
+  size_t at=0;
+  };
+
+class FS
+  {
+  public:
+  bool begin() {return true;}
+  void end() {}
+  bool format();
+  File open(const char* path, const char* mode);
+  bool exists(const char* path);
+  bool remove(const char* path);
+  bool rename(const char* from, const char* to);
+  };
+
+extern FS LittleFS;
+
+#endif
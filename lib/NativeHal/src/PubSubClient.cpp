@@ -0,0 +1,183 @@
+// The MQTT client stand-in.  See PubSubClient.h.
+
+#include <PubSubClient.h>
+#include "nativeHal.h"
+#include "halBroker.h"
+
+#define HAL_MQTT_TOPIC_SIZE 128
+#define HAL_MQTT_PAYLOAD_SIZE 2048
+#define HAL_MQTT_INBOX 8 //messages waiting to be delivered
+
+static char lastTopic[HAL_MQTT_TOPIC_SIZE];
+static char lastPayload[HAL_MQTT_PAYLOAD_SIZE];
+static size_t lastPayloadLength=0;
+static unsigned long publishCount=0;
+static bool sessionKept=false; //the broker has a session for the device
+static bool connectedNow=false;
+
+static struct
+  {
+  char topic[HAL_MQTT_TOPIC_SIZE];
+  char payload[HAL_MQTT_PAYLOAD_SIZE];
+  size_t length;
+  } inbox[HAL_MQTT_INBOX];
+static size_t inboxHead=0, inboxCount=0;
+
+void halMqttDeliver(const char* topic, const char* payload)
+  {
+  if (inboxCount>=HAL_MQTT_INBOX)
+    return;
+  size_t slot=(inboxHead+inboxCount++)%HAL_MQTT_INBOX;
+  snprintf(inbox[slot].topic,sizeof(inbox[slot].topic),"%s",topic);
+  inbox[slot].length=snprintf(inbox[slot].payload,sizeof(inbox[slot].payload),"%s",payload);
+  }
+
+bool halMqttConnected()
+  {
+  return connectedNow && halBrokerUp();
+  }
+
+unsigned long halMqttPublishCount()
+  {
+  return publishCount;
+  }
+
+const char* halMqttLastTopic()
+  {
+  return lastTopic;
+  }
+
+const char* halMqttLastPayload()
+  {
+  return lastPayload;
+  }
+
+boolean PubSubClient::connect(const char* id, const char* user, const char* pass)
+  {
+  return connect(id,user,pass,NULL,0,false,NULL,true);
+  }
+
+boolean PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic,
+                              uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession)
+  {
+  if (!client->connected() && !client->connect(IPAddress(127,0,0,1),1883))
+    {
+    code=MQTT_CONNECT_FAILED;
+    return false;
+    }
+  if (cleanSession)
+    sessionKept=false;
+  uint8_t connack[4]={0x20,0x02,(uint8_t)(sessionKept?1:0),0x00};
+  halBrokerSend(connack,sizeof(connack));
+  for (unsigned int i=0;i<sizeof(connack);i++)
+    if (client->read()<0)
+      {
+      code=MQTT_CONNECTION_TIMEOUT;
+      client->stop();
+      return false;
+      }
+  sessionKept=!cleanSession;
+  connectedNow=true;
+  code=MQTT_CONNECTED;
+  return true;
+  }
+
+void PubSubClient::disconnect()
+  {
+  client->stop();
+  connectedNow=false;
+  code=MQTT_DISCONNECTED;
+  }
+
+boolean PubSubClient::connected()
+  {
+  if (code==MQTT_CONNECTED && !client->connected())
+    {
+    connectedNow=false;
+    code=MQTT_CONNECTION_LOST;
+    }
+  return code==MQTT_CONNECTED;
+  }
+
+boolean PubSubClient::subscribe(const char* topic, uint8_t qos)
+  {
+  if (!connected())
+    return false;
+  uint8_t suback[5]={0x90,0x03,0x00,++packetId,qos};
+  return halBrokerSend(suback,sizeof(suback));
+  }
+
+boolean PubSubClient::loop()
+  {
+  if (!connected())
+    return false;
+  while (client->available()>0) //whole packets, always, as the real one reads them
+    client->read();
+  while (inboxCount>0)
+    {
+    size_t slot=inboxHead;
+    inboxHead=(inboxHead+1)%HAL_MQTT_INBOX;
+    inboxCount--;
+    if (callback)
+      callback(inbox[slot].topic,(uint8_t*)inbox[slot].payload,inbox[slot].length);
+    }
+  return true;
+  }
+
+boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained)
+  {
+  return publish(topic,(const uint8_t*)payload,payload!=NULL?strlen(payload):0,retained);
+  }
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, boolean retained)
+  {
+  if (!connected() || 5+2+strlen(topic)+length>bufferSize) //as the real one, it all has to fit the buffer
+    return false;
+  snprintf(lastTopic,sizeof(lastTopic),"%s",topic);
+  lastPayloadLength=length<sizeof(lastPayload)?length:sizeof(lastPayload)-1;
+  memcpy(lastPayload,payload,lastPayloadLength);
+  lastPayload[lastPayloadLength]='\0';
+  publishCount++;
+  return true;
+  }
+
+boolean PubSubClient::beginPublish(const char* topic, unsigned int length, boolean retained)
+  {
+  if (!connected())
+    return false;
+  snprintf(lastTopic,sizeof(lastTopic),"%s",topic);
+  lastPayloadLength=0;
+  lastPayload[0]='\0';
+  streamLength=length;
+  streamed=0;
+  return true;
+  }
+
+size_t PubSubClient::write(uint8_t c)
+  {
+  return write(&c,1);
+  }
+
+size_t PubSubClient::write(const uint8_t* data, size_t size)
+  {
+  if (!connected())
+    return 0;
+  for (size_t i=0;i<size && lastPayloadLength+1<sizeof(lastPayload);i++)
+    lastPayload[lastPayloadLength++]=data[i];
+  lastPayload[lastPayloadLength]='\0';
+  streamed+=size;
+  return size;
+  }
+
+int PubSubClient::endPublish()
+  {
+  if (!connected())
+    return 0;
+  if (streamed!=streamLength)
+    {
+    disconnect(); //the broker would have lost track of the packets
+    return 0;
+    }
+  publishCount++;
+  return 1;
+  }
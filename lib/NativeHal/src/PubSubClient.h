@@ -0,0 +1,63 @@
+// The PubSubClient stand-in.  It talks to the broker stand-in through the network
+// client it's given, reading CONNACK and SUBACK from it byte by byte as the real
+// one does, so whatever wraps the client sees the same bytes.  What's published is
+// kept for the test to look at, and messages from halMqttDeliver() go to the
+// callback from loop().  A streamed publish whose length doesn't match what
+// beginPublish() was told would corrupt the connection, so it drops it.
+
+#ifndef NATIVE_HAL_PUBSUBCLIENT_H
+#define NATIVE_HAL_PUBSUBCLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECTION_LOST -3
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+#define MQTT_MAX_PACKET_SIZE 256
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+class PubSubClient : public Print
+  {
+  public:
+  PubSubClient(Client& client) : client(&client) {}
+  PubSubClient& setServer(IPAddress ip, uint16_t port) {return *this;}
+  PubSubClient& setServer(const char* host, uint16_t port) {return *this;}
+  PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) {this->callback=callback; return *this;}
+  PubSubClient& setClient(Client& client) {this->client=&client; return *this;}
+  PubSubClient& setKeepAlive(uint16_t seconds) {return *this;}
+  PubSubClient& setSocketTimeout(uint16_t seconds) {return *this;}
+  bool setBufferSize(uint16_t size) {bufferSize=size; return true;}
+  uint16_t getBufferSize() {return bufferSize;}
+
+  boolean connect(const char* id, const char* user, const char* pass);
+  boolean connect(const char* id, const char* user, const char* pass, const char* willTopic,
+                  uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession=true);
+  void disconnect();
+  boolean connected();
+  int state() {return code;}
+  boolean loop();
+  boolean subscribe(const char* topic, uint8_t qos=0);
+
+  boolean publish(const char* topic, const char* payload, boolean retained=false);
+  boolean publish(const char* topic, const uint8_t* payload, unsigned int length, boolean retained=false);
+  boolean beginPublish(const char* topic, unsigned int length, boolean retained);
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t size) override;
+  using Print::write;
+  int endPublish();
+
+  private:
+  Client* client;
+  MQTT_CALLBACK_SIGNATURE;
+  uint16_t bufferSize=MQTT_MAX_PACKET_SIZE;
+  int code=MQTT_DISCONNECTED;
+  unsigned int streamLength=0;    //what beginPublish() said
+  unsigned int streamed=0;        //what has been written since
+  uint8_t packetId=0;
+  };
+
+#endif
@@ -0,0 +1,18 @@
+// Between the network client and the MQTT client stand-ins: the bytes the broker
+// has sent that the device hasn't read yet
+
+#ifndef NATIVE_HAL_BROKER_H
+#define NATIVE_HAL_BROKER_H
+
+#include <Arduino.h>
+
+#define HAL_BROKER_OUTBOX_SIZE 64
+
+bool halBrokerUp();
+bool halBrokerSend(const uint8_t* data, size_t size);
+int halBrokerAvailable();
+int halBrokerPeek();
+int halBrokerRead();
+void halBrokerClear();
+
+#endif
@@ -0,0 +1,46 @@
+// Run the firmware on the host: "pio run -e native" and then run
+// .pio/build/native/program.  Time runs at its real pace, what you type goes to
+// the serial port and the serial output comes to the terminal.  Unit tests and
+// benchmarks bring their own main().
+//
+// Given a directory, the file system starts with the files in it and changes go
+// back there, so it doubles as a settings image tool.  Unpack a LittleFS image
+// with "mklittlefs -u dir image.bin", run "program dir" to see the settings it
+// holds or change them with the usual commands, "reboot" to write them out and
+// stop, then pack it again with "mklittlefs -c dir -s <size> image.bin".  Starting
+// with an empty directory makes a new image.
+
+#ifndef PIO_UNIT_TESTING
+
+#include <Arduino.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "nativeHal.h"
+
+int main(int argc, char** argv)
+  {
+  if (argc>1 && !halFilesDirectory(argv[1]))
+    {
+    fprintf(stderr,"Can't read the directory %s\n",argv[1]);
+    return 1;
+    }
+  halRealTime(true);
+  halSerialEcho(true);
+  fcntl(STDIN_FILENO,F_SETFL,fcntl(STDIN_FILENO,F_GETFL)|O_NONBLOCK);
+  setup();
+  while (!halRestartRequested() && halDeepSleepRequested()==0)
+    {
+    char buf[128];
+    ssize_t n=read(STDIN_FILENO,buf,sizeof(buf)-1);
+    if (n>0)
+      {
+      buf[n]='\0';
+      halSerialInput(buf);
+      }
+    loop();
+    fflush(stdout);
+    }
+  return 0;
+  }
+
+#endif
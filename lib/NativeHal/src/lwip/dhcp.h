@@ -0,0 +1,21 @@
+// The DHCP lease times as lwip keeps them.  The stand-in network hands out a lease
+// of HAL_DHCP_LEASE seconds.
+
+#ifndef NATIVE_HAL_LWIP_DHCP_H
+#define NATIVE_HAL_LWIP_DHCP_H
+
+#include <stdint.h>
+#include "lwip/netif.h"
+
+#define HAL_DHCP_LEASE 3600
+
+struct dhcp
+  {
+  uint32_t offered_t0_lease; //seconds
+  uint32_t offered_t1_renew;
+  uint32_t offered_t2_rebind;
+  };
+
+#define netif_dhcp_data(netif) ((netif)->dhcp)
+
+#endif
@@ -0,0 +1,15 @@
+// Just enough of lwip's network interface for the DHCP lease to be looked at
+
+#ifndef NATIVE_HAL_LWIP_NETIF_H
+#define NATIVE_HAL_LWIP_NETIF_H
+
+struct dhcp;
+
+struct netif
+  {
+  struct dhcp* dhcp;
+  };
+
+extern struct netif* netif_default;
+
+#endif
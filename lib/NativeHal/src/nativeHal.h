@@ -0,0 +1,50 @@
+// The controls a test or benchmark uses to drive the firmware on the host: move
+// time on, set the sensor pins, type serial commands, and bring the network and
+// broker up or down.  See Arduino.h for how the stand-ins behave.
+
+#ifndef NATIVE_HAL_H
+#define NATIVE_HAL_H
+
+#include <Arduino.h>
+
+// Time
+void halAdvanceMicros(uint64_t us);
+void halAdvanceMillis(unsigned long ms);
+void halRealTime(bool on);            //follow the host's clock instead, for running interactively
+
+// GPIO
+void halSetPin(uint8_t pin, uint8_t level);  //as the sensor would, firing its interrupt
+int halOutputLevel(uint8_t pin);             //last level written to an output, -1 if none
+void halSetAnalog(int value);                //what analogRead(A0) returns, 0 to 1023
+
+// The serial port
+void halSerialInput(const char* text);       //queued for Serial.read(), up to HAL_SERIAL_SIZE bytes
+size_t halSerialOutput(char* buf, size_t size); //take what's been printed since last time
+void halSerialEcho(bool on);                 //copy serial output to stdout as well
+#define HAL_SERIAL_SIZE 4096
+
+// The network.  Scans find one access point, HAL_SSID.  Any broker name resolves
+// and the broker accepts any client while it is up.
+#define HAL_SSID "native"
+void halSetWifi(bool up);
+void halSetBroker(bool up);
+bool halMqttConnected();
+void halMqttDeliver(const char* topic, const char* payload); //handed to the callback on the next loop()
+unsigned long halMqttPublishCount();
+const char* halMqttLastTopic();
+const char* halMqttLastPayload();
+
+// The file system is kept in memory.  Given a host directory it takes the files in
+// it, and writes every change back, so a LittleFS image unpacked with mklittlefs
+// can be read and changed.  NULL stops writing back.
+bool halFilesDirectory(const char* dir);
+
+// Restarts and deep sleep only set these
+bool halRestartRequested();
+uint64_t halDeepSleepRequested();            //microseconds, 0 if not asked
+void halClearRequests();
+
+// Bytes of heap in use right now
+size_t halHeapInUse();
+
+#endif
@@ -1,806 +1,3963 @@
 #include <Arduino.h>
+#include <limits.h>
 #include <PubSubClient.h> 
 #include <ESP8266WiFi.h>
+#include <lwip/dhcp.h>
 #include <EEPROM.h>
 #include <ArduinoOTA.h>
+#include <LittleFS.h>
 #include "tankReporter.h"
+#include "debounce.h"
+#include "jsonWriter.h"
+#include "lineReader.h"
+#include "metrics.h"
+#include "sessionClient.h"
 
-#define VERSION "21.1.28.1"  //remember to update this after every change! YY.MM.DD.REV
+#define VERSION "26.10.17.42"  //remember to update this after every change! YY.MM.DD.REV
 
 //PubSubClient callback function header.  This must appear before the PubSubClient constructor.
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length);
 
-WiFiClient wifiClient;
-PubSubClient mqttClient(wifiClient);
+// The broker connection goes over one of these, plain or TLS, depending on settings.tlsMode
+SessionClient<WiFiClient> plainClient;
+SessionClient<BearSSL::WiFiClientSecure> tlsClient;
+WiFiClient* netClient=&plainClient;       //the one in use
+ConnackFlags* netSession=&plainClient;    //the same one
+PubSubClient mqttClient(plainClient);
 
-// These are the settings that get stored in EEPROM.  They are all in one struct which
-// makes it easier to store and retrieve from EEPROM.
+// The string settings are kept end to end in settings.strings, in this order and
+// each with its null, so that they take up the space they need rather than the
+// most they could.  Get at them with settingString() and setSettingString().
+enum {STRING_SSID, STRING_WIFI_PASSWORD, STRING_BROKER, STRING_USERNAME, STRING_PASSWORD,
+      STRING_TOPIC_ROOT, STRING_CLIENT_ID, STRING_STATIC_IP, STRING_NETMASK, STRING_GATEWAY,
+      STRING_DNS, STRING_ANALOG_CALIBRATION, STRING_TLS_FINGERPRINT, STRING_BACKUP_BROKERS,
+      STRING_COUNT};
+
+// These are the settings that get stored in flash.  They are written field by field
+// (see storedSettings) so this struct can change without losing what's been saved.
 typedef struct 
   {
   unsigned int validConfig=0; 
-  char ssid[SSID_SIZE] = "";
-  char wifiPassword[PASSWORD_SIZE] = "";
-  char mqttBrokerAddress[ADDRESS_SIZE]=""; //default
+  char strings[SETTINGS_STRINGS_SIZE]=""; //the string settings, all empty to start with
+  uint8_t stringLength[STRING_COUNT]={};  //of each one, without the null
   int mqttBrokerPort=1883;
-  char mqttUsername[USERNAME_SIZE]="";
-  char mqttPassword[PASSWORD_SIZE]="";
-  char mqttTopicRoot[MQTT_TOPIC_SIZE]="";
-  char mqttClientId[MQTT_CLIENTID_SIZE]=""; //will be the same across reboots
   bool debug=false;
   unsigned long reportPeriod=0;
-  char staticIP[ADDRESS_SIZE]="";
-  char netmask[ADDRESS_SIZE]="";
-  char gateway[ADDRESS_SIZE]="";
-  char dns[ADDRESS_SIZE]="";
+  unsigned long sleepTime=0; //seconds of deep sleep between reports, 0 to stay awake
+  uint8_t reportMode=REPORT_MODE_PERIODIC; //report every reportPeriod, or only on change plus heartbeat
+  unsigned long heartbeatPeriod=DEFAULT_HEARTBEAT_PERIOD; //seconds between reports when nothing changes
+  uint8_t debounceFilter=DEFAULT_DEBOUNCE_FILTER; //which of the debounce filters to use
+  uint8_t queueDropPolicy=QUEUE_DROP_OLDEST; //what to lose when the offline queue is full
+  uint16_t queueDepth=DEFAULT_QUEUE_DEPTH; //readings kept in the queue file when offline
+  unsigned long metricsPeriod=0; //seconds between metrics reports, 0 for none
+  uint8_t sensorCount=DEFAULT_SENSOR_COUNT; //level sensors connected, on the first sensorCount of SENSOR_PORTS
+  bool analogEnabled=false; //a level sender is connected to A0
+  uint8_t pulsePin=0; //GPIO the flow meter is connected to, 0 for none
+  unsigned long pulsesPerUnit=DEFAULT_PULSES_PER_UNIT; //flow meter pulses per litre, or whatever unit
+  uint64_t pulseTotal=0; //flow meter pulses counted, as of the last time it was saved
+  bool persistentSession=false; //ask the broker to keep our session and subscription between connections
+  uint8_t tlsMode=TLS_OFF; //how to check the broker's certificate, or not to use TLS
   } conf;
 
-conf settings; //all settings in one struct makes it easier to store in EEPROM
+conf settings; //all settings in one struct makes it easier to store and show
+
+/*
+ * One of the string settings.  It moves when an earlier one changes, so don't keep it.
+ */
+const char* settingString(uint8_t id)
+  {
+  const char* s=settings.strings;
+  for (uint8_t i=0;i<id;i++)
+    s+=settings.stringLength[i]+1;
+  return s;
+  }
+
+/*
+ * Change a string setting, moving the ones after it up or down.  Returns false if
+ * there isn't room for it.  The new value mustn't be one of the settings itself.
+ */
+boolean setSettingString(uint8_t id, const char* value)
+  {
+  char* at=(char*)settingString(id);
+  char* end=(char*)settingString(STRING_COUNT);
+  size_t oldLength=settings.stringLength[id];
+  size_t length=strlen(value);
+  if (length>UINT8_MAX || end-settings.strings-oldLength+length>sizeof(settings.strings))
+    return false;
+  memmove(at+length+1,at+oldLength+1,end-(at+oldLength+1));
+  memcpy(at,value,length+1);
+  if (length<oldLength) //keep the unused space clear so the settings CRC stays the same
+    memset(end-(oldLength-length),0,oldLength-length);
+  settings.stringLength[id]=length;
+  return true;
+  }
+
+/*
+ * Start the settings over from their defaults
+ */
+void defaultSettings()
+  {
+  settings=conf();
+  setSettingString(STRING_ANALOG_CALIBRATION,DEFAULT_ANALOG_CALIBRATION);
+  }
+
+// The settings struct exactly as older versions saved it whole to EEPROM and to the
+// first settings journal, with the ESP8266's 32 bit longs.  Only used to move those
+// settings forward.  Don't change it.
+typedef struct 
+  {
+  unsigned int validConfig; 
+  char ssid[100];
+  char wifiPassword[50];
+  char mqttBrokerAddress[30];
+  int mqttBrokerPort;
+  char mqttUsername[50];
+  char mqttPassword[50];
+  char mqttTopicRoot[150];
+  char mqttClientId[25];
+  bool debug;
+  uint32_t reportPeriod;
+  char staticIP[30];
+  char netmask[30];
+  char gateway[30];
+  char dns[30];
+  uint32_t sleepTime;
+  uint8_t reportMode;
+  uint32_t heartbeatPeriod;
+  uint8_t debounceFilter;
+  uint8_t queueDropPolicy;
+  uint16_t queueDepth;
+  } legacyConf;
 boolean settingsAreValid=false;
 
-String commandString = "";     // a String to hold incoming commands from serial
-bool commandComplete = false;  // goes true when enter is pressed
+// The full names of the MQTT topics we use.  These are built from the topic root
+// whenever the settings are loaded or saved, instead of for every message.
+typedef struct
+  {
+  char name[MQTT_TOPIC_SIZE+MQTT_TOPIC_SUFFIX_SIZE];
+  uint16_t length;
+  } mqttTopic;
+
+enum {TOPIC_READING, TOPIC_LEVEL, TOPIC_COMMAND, TOPIC_HISTORY, 
+      TOPIC_SETTINGS_RESPONSE, TOPIC_VERSION_RESPONSE, TOPIC_STATUS_RESPONSE, TOPIC_REBOOT_RESPONSE, 
+      TOPIC_METRICS, TOPIC_FLOW, TOPIC_COUNT};
+const char* topicSuffixes[TOPIC_COUNT]=
+  {
+  MQTT_TOPIC_READING,
+  MQTT_TOPIC_LEVEL,
+  MQTT_TOPIC_COMMAND_REQUEST,
+  MQTT_TOPIC_HISTORY,
+  MQTT_PAYLOAD_SETTINGS_COMMAND, //command responses go to the topic root plus the command
+  MQTT_PAYLOAD_VERSION_COMMAND,
+  MQTT_PAYLOAD_STATUS_COMMAND,
+  MQTT_PAYLOAD_REBOOT_COMMAND,
+  MQTT_PAYLOAD_METRICS_COMMAND, //also where the periodic metrics reports go
+  MQTT_TOPIC_FLOW
+  };
+mqttTopic topics[TOPIC_COUNT];
+uint16_t topicRootLength=0;
+
+LineReader<SERIAL_COMMAND_SIZE> serialLine; //incoming commands from serial
+
+// The network connection is brought up by a state machine that is stepped by the
+// wifi task, so that sensing and command handling continue while it works.
+enum {WIFI_STATE_IDLE, WIFI_STATE_SCANNING, WIFI_STATE_ASSOCIATING, WIFI_STATE_ADDRESSING, WIFI_STATE_MQTT, WIFI_STATE_CONNECTED};
+const char* wifiStateNames[]={"idle","scanning","associating","addressing","mqtt","connected"};
+int wifiState=WIFI_STATE_IDLE;
+unsigned long wifiPhaseStart=0;   //millis() when the current phase began
+unsigned long wifiLastAttempt=0;  //millis() when the last scan was started
+boolean wifiFirstAttempt=true;
+boolean wifiFastConnect=false;  //true while trying the cached access point and lease
+volatile boolean wifiAssociated=false; //set by the WiFi event handlers
+WiFiEventHandler wifiAssociatedHandler;
+WiFiEventHandler wifiDisassociatedHandler;
 
-char* clientId = settings.mqttClientId;
-boolean wifiConnecting=false;
-boolean ssidAvailable=false;
-int connectTryCount=0;
+// How long each phase of the most recent connection took, in milliseconds
+typedef struct
+  {
+  unsigned long scanMillis;
+  unsigned long associateMillis;
+  unsigned long addressMillis;
+  unsigned long mqttMillis;
+  } connectTiming;
+connectTiming connectTimes={0,0,0,0};
+unsigned long lastRadioActivity=0; //millis() when we last sent anything
 
-unsigned long nextReport=0;
-unsigned long nextFlash=0;
-boolean warningLedOn=false;
 boolean failure=false;
 
-int lastReading=0;
+// The level sensors.  Readings are bitmasks with bit i for sensor i, set when it's
+// wet.  With one sensor that's just 0 or 1, the same as a single reading always was.
+const uint8_t sensorPins[SENSOR_MAX]=SENSOR_PORTS;
+const char* sensorNames[SENSOR_MAX]=SENSOR_NAMES;
+uint8_t lastReading=0;
+
+// Sensor transitions are captured by an interrupt handler and put into this ring
+// buffer along with the time they happened.  The handler takes all of the inputs
+// with one read of the GPIO input register, and they are sorted out later.  The 
+// interrupt handler only writes edgeHead and the sensor task only writes edgeTail, 
+// so no locking is needed.
+typedef struct
+  {
+  uint32_t micros;
+  uint16_t gpio;           //the GPIO input register, which has GPIO0 to GPIO15
+  } sensorEdge;
+
+volatile sensorEdge edgeBuffer[SENSOR_EDGE_BUFFER_SIZE];
+volatile uint16_t edgeHead=0;
+volatile uint16_t edgeTail=0;
+volatile uint32_t edgesDropped=0; //edges lost because the buffer was full
+uint32_t edgesSeen=0;
+uint32_t edgesDroppedSeen=0;
+uint8_t sensorLevels;             //most recent raw levels of the sensors
+
+static_assert((SENSOR_EDGE_BUFFER_SIZE & (SENSOR_EDGE_BUFFER_SIZE-1))==0, 
+              "SENSOR_EDGE_BUFFER_SIZE must be a power of 2");
+
+void IRAM_ATTR sensorEdgeISR()
+  {
+  uint16_t head=edgeHead;
+  uint16_t next=(head+1)&(SENSOR_EDGE_BUFFER_SIZE-1);
+  if (next==edgeTail)
+    {
+    edgesDropped++;
+    return;
+    }
+  edgeBuffer[head].micros=micros();
+  edgeBuffer[head].gpio=GPI;
+  edgeHead=next;
+  }
+
+/*
+ * Take the oldest edge out of the ring buffer. Returns false if it's empty.
+ */
+boolean popSensorEdge(sensorEdge* edge)
+  {
+  uint16_t tail=edgeTail;
+  if (tail==edgeHead)
+    return false;
+  edge->micros=edgeBuffer[tail].micros;
+  edge->gpio=edgeBuffer[tail].gpio;
+  edgeTail=(tail+1)&(SENSOR_EDGE_BUFFER_SIZE-1);
+  return true;
+  }
+
+IPAddress staticIP;
+IPAddress subnet;
+IPAddress gateway;
+IPAddress dns;
+
+// A reading that couldn't be sent, waiting in the offline queue
+typedef struct
+  {
+  uint32_t seconds;        //deviceSeconds() when the reading was taken
+  uint8_t reading;
+  uint8_t epoch;           //device clock epoch when the reading was taken
+  uint16_t analogLevel;    //tenths of a percent full, if the analog sensor is in use
+  } queuedReading;
+
+// State kept in the RTC user memory.  It survives a reset or deep sleep but not
+// a power cycle, so it is protected by a CRC and ignored if the CRC is wrong.
+typedef struct
+  {
+  uint32_t crc;            //CRC32 of everything after this field
+  uint8_t bssid[6];        //last access point we successfully connected to
+  uint8_t channel;
+  uint8_t wifiValid;       //nonzero if the access point and lease fields are good
+  uint32_t localIP;        //last address, gateway, mask and DNS server
+  uint32_t gatewayIP;
+  uint32_t subnetMask;
+  uint32_t dnsIP;
+  uint32_t leaseStart;     //device clock seconds when the address was leased
+  uint32_t leaseTime;      //seconds the address may be reused for, 0 if it isn't leased
+  uint8_t sensorValid;     //nonzero if the sensor fields are good
+  uint8_t lastReading;     //debounced sensor reading when we went to sleep
+  uint8_t lastReported;    //last reading sent to the broker
+  uint8_t unused;
+  uint32_t wakeCount;      //number of times we have woken from deep sleep
+  uint32_t reportCount;    //number of reports sent since power up
+  uint32_t secondsSinceReport; //time asleep and awake since the last report
+  uint32_t clockBase;      //device clock seconds at the start of this wake, see deviceSeconds()
+  uint8_t clockEpoch;      //changes every time the device clock starts over from zero
+  uint8_t queueHead;       //oldest reading in the RTC part of the offline queue
+  uint8_t queueCount;      //number of readings in the RTC part of the offline queue
+  uint8_t unused2;
+  uint32_t queuedCount;    //offline queue statistics since power up
+  uint32_t droppedCount;
+  uint32_t flushedCount;
+  uint16_t lastLevelReported; //last analog level sent to the broker, in tenths of a percent
+  uint16_t unused3;
+  uint32_t brokerIP;       //the broker's address, from looking up its name
+  uint32_t brokerLookedUp; //device clock seconds when it was looked up
+  uint32_t brokerNameCrc;  //of the name it's the address of, 0 if there is none
+  uint32_t unixOffset;     //Unix time less device clock seconds, 0 if we don't know the time
+  uint32_t subscriptionKey; //see commandSubscriptionKey(), 0 if we don't know of a subscription
+  uint32_t tlsBrokerKey;   //CRC of the broker name and port the TLS fields are for
+  uint8_t tlsSessionValid; //nonzero if tlsSession can be resumed
+  uint8_t tlsFragment;     //TLS_FRAGMENT_UNKNOWN, TLS_FRAGMENT_SMALL or TLS_FRAGMENT_FULL
+  uint8_t unused4[2];
+  uint8_t tlsSession[TLS_SESSION_SIZE]; //a BearSSL::Session
+  uint64_t pulseTotal;     //flow meter pulses, more up to date than the copy in the settings
+  queuedReading queue[RTC_QUEUE_SIZE]; //newest part of the offline queue
+  } rtcState;
+static_assert(sizeof(rtcState)%4==0, "RTC memory is accessed in 4 byte blocks");
+static_assert(sizeof(rtcState)<=512, "There are only 512 bytes of RTC user memory");
+rtcState rtc;
+
+// Execution time statistics for the main code paths, in microseconds.  These let us
+// see the cost of a change without a logic analyzer.  Use "timing=yes" to show them,
+// or the metrics command to get them over MQTT along with the latency histograms.
+typedef struct
+  {
+  const char* name;
+  unsigned long calls;
+  unsigned long totalMicros;
+  unsigned long worstMicros;
+  LogHistogram<HISTOGRAM_BUCKETS> histogram;
+  } timing;
+
+enum {TIMING_LOOP, TIMING_READ_SENSOR, TIMING_REPORT, TIMING_PROCESS_COMMAND, TIMING_MQTT_HANDLER, 
+      TIMING_SETTINGS_COMMIT, TIMING_PUBLISH, TIMING_CONNECT, TIMING_MQTT_TCP, TIMING_MQTT_CONNACK, 
+      TIMING_MQTT_SUBACK, TIMING_MQTT_TLS, TIMING_PUBLISH_WIRE, TIMING_PUBLISH_ACKED, TIMING_COUNT};
+timing timings[TIMING_COUNT]=
+  {
+  {"loop",0,0,0,{}},
+  {"readSensor",0,0,0,{}},
+  {"report",0,0,0,{}},
+  {"processCommand",0,0,0,{}},
+  {"incomingMqttHandler",0,0,0,{}},
+  {"commitSettings",0,0,0,{}},
+  {"publish",0,0,0,{}},
+  {"connect",0,0,0,{}}, //from the start of a WiFi attempt to being connected to the broker
+  {"mqttTcp",0,0,0,{}},     //broker name lookup and TCP connection
+  {"mqttConnack",0,0,0,{}}, //CONNECT sent to CONNACK received
+  {"mqttSuback",0,0,0,{}},  //SUBSCRIBE sent to SUBACK received
+  {"mqttTls",0,0,0,{}},     //TCP connection and TLS handshake, instead of mqttTcp
+  {"publishWire",0,0,0,{}}, //put in the publish pipeline to written to the socket
+  {"publishAcked",0,0,0,{}} //put in the publish pipeline to acknowledged by the broker's TCP stack
+  };
+
+/*
+ * Add one call's elapsed time to the statistics for a code path
+ */
+void recordElapsed(int which, unsigned long elapsed)
+  {
+  timing* t=&timings[which];
+  t->calls++;
+  t->totalMicros+=elapsed;
+  if (elapsed>t->worstMicros)
+    t->worstMicros=elapsed;
+  t->histogram.record(elapsed);
+  }
+
+void recordTiming(int which, unsigned long startMicros)
+  {
+  recordElapsed(which,micros()-startMicros); //unsigned math handles micros() wrap
+  }
+
+// Event counters for the metrics command.  They count from power up and are never
+// reset, so the difference between two dumps is the rate.
+enum {COUNTER_WIFI_CONNECTS, COUNTER_WIFI_FAILURES, COUNTER_MQTT_CONNECTS, COUNTER_MQTT_FAILURES, 
+      COUNTER_PUBLISHES, COUNTER_PUBLISH_FAILURES, COUNTER_ADC_DEFERRED, COUNTER_PUBLISH_DROPPED, 
+      COUNTER_PUBLISH_UNACKED, COUNTER_TLS_HANDSHAKES, COUNTER_TLS_RESUMED, COUNTER_BROKER_FAILOVERS,
+      COUNTER_BROKER_FAILBACKS, COUNTER_COUNT};
+const char* counterNames[COUNTER_COUNT]=
+  {
+  "wifiConnects",
+  "wifiFailures",
+  "mqttConnects",
+  "mqttFailures",
+  "publishes",
+  "publishFailures",
+  "adcDeferred",    //analog reads put off because the radio was busy
+  "publishDropped", //the publish pipeline was full
+  "publishUnacked", //gave up waiting for the broker to acknowledge a pipelined message
+  "tlsHandshakes",  //full TLS handshakes
+  "tlsResumed",     //TLS connections that resumed a saved session instead
+  "brokerFailovers", //moved to a different broker because the one in use was down
+  "brokerFailbacks"  //moved back to the primary broker once it answered again
+  };
+unsigned long counters[COUNTER_COUNT];
+
+uint32_t minFreeHeap=UINT32_MAX; //low water mark, sampled by the metrics task
+uint32_t tlsHeapUsed=0;          //heap taken by the last TLS connection
+uint32_t tlsHeapPeak=0;          //and the most any has taken
+
+// The metrics that change by themselves, read once for each report so that
+// counting it and sending it come out the same
+typedef struct
+  {
+  unsigned long uptime;            //seconds
+  uint32_t freeHeap;
+  uint16_t maxFreeBlock;
+  uint8_t heapFragmentation;       //percent
+  int32_t rssi;
+  } metricsSnapshot;
+
+// The cooperative task scheduler.  Each task runs when its interval has elapsed since
+// its last run.  All time comparisons are done as unsigned differences so they keep
+// working when millis() wraps after 49 days.  A task must never block.
+typedef struct
+  {
+  const char* name;
+  void (*run)();
+  unsigned long intervalMillis;
+  unsigned long lateLimitMillis;  //starting later than this counts as an overrun
+  boolean enabled;
+  unsigned long lastRun;
+  unsigned long runs;
+  unsigned long overruns;
+  unsigned long worstLateMillis;
+  } task;
+
+void sensorTask();
+void ledTask();
+void serialTask();
+void otaTask();
+void wifiTask();
+void mqttTask();
+void reportTask();
+void restartTask();
+void sleepTask();
+void queueTask();
+void settingsTask();
+void metricsTask();
+void adcTask();
+void pulseTask();
+void publishTask();
+void showQueue();
+void showSettingsJournal();
+uint32_t queueLength();
+void openQueueFile(boolean clockRestarted);
+
+enum {TASK_SENSOR, TASK_LED, TASK_SERIAL, TASK_OTA, TASK_WIFI, TASK_MQTT, TASK_REPORT, TASK_RESTART, TASK_SLEEP, TASK_QUEUE, TASK_SETTINGS, TASK_METRICS, TASK_ADC, TASK_PULSE, TASK_PUBLISH, TASK_COUNT};
+task tasks[TASK_COUNT]=
+  {
+  {"sensor", sensorTask, SENSOR_TASK_INTERVAL, SENSOR_TASK_LATE_LIMIT, true, 0,0,0,0},
+  {"led",    ledTask,    LED_TASK_INTERVAL,    LED_TASK_LATE_LIMIT,    true, 0,0,0,0},
+  {"serial", serialTask, SERIAL_TASK_INTERVAL, SERIAL_TASK_LATE_LIMIT, true, 0,0,0,0},
+  {"ota",    otaTask,    OTA_TASK_INTERVAL,    OTA_TASK_LATE_LIMIT,    true, 0,0,0,0},
+  {"wifi",   wifiTask,   WIFI_TASK_INTERVAL,   WIFI_TASK_LATE_LIMIT,   true, 0,0,0,0},
+  {"mqtt",   mqttTask,   MQTT_TASK_INTERVAL,   MQTT_TASK_LATE_LIMIT,   true, 0,0,0,0},
+  {"report", reportTask, 0,                    REPORT_TASK_LATE_LIMIT, true, 0,0,0,0}, //interval set from settings
+  {"restart",restartTask,0,                    0,                      false,0,0,0,0}, //one-shot, see scheduleRestart()
+  {"sleep",  sleepTask,  SLEEP_TASK_INTERVAL,  SLEEP_TASK_LATE_LIMIT,  false,0,0,0,0}, //only when sleepTime is set
+  {"queue",  queueTask,  QUEUE_TASK_INTERVAL,  QUEUE_TASK_LATE_LIMIT,  true, 0,0,0,0},
+  {"settings",settingsTask,SETTINGS_COMMIT_DELAY,SETTINGS_TASK_LATE_LIMIT,false,0,0,0,0}, //one-shot, see saveSettings()
+  {"metrics",metricsTask,METRICS_TASK_INTERVAL,METRICS_TASK_LATE_LIMIT,true, 0,0,0,0},
+  {"adc",    adcTask,    ADC_TASK_INTERVAL,    ADC_TASK_LATE_LIMIT,    false,0,0,0,0}, //only when analogEnabled is set
+  {"pulse",  pulseTask,  PULSE_TASK_INTERVAL,  PULSE_TASK_LATE_LIMIT,  false,0,0,0,0}, //only when there's a flow meter
+  {"publish",publishTask,PUBLISH_TASK_INTERVAL,PUBLISH_TASK_LATE_LIMIT,false,0,0,0,0}  //only while the publish pipeline has something in it
+  };
+
+/*
+ * Run every task that is due.  Called once per pass through loop().  Returns
+ * false if nothing was due.
+ */
+boolean runTasks()
+  {
+  boolean ranSomething=false;
+  for (int i=0;i<TASK_COUNT;i++)
+    {
+    task* t=&tasks[i];
+    unsigned long now=millis();
+    unsigned long elapsed=now-t->lastRun;
+    if (!t->enabled || elapsed<t->intervalMillis)
+      continue;
+
+    unsigned long late=elapsed-t->intervalMillis;
+    if (late>t->worstLateMillis)
+      t->worstLateMillis=late;
+    if (late>t->lateLimitMillis)
+      t->overruns++;
+
+    //Stay on the original cadence unless we have fallen a whole period behind
+    if (late<t->intervalMillis)
+      t->lastRun=now-late;
+    else
+      t->lastRun=now;
+    t->runs++;
+    t->run();
+    ranSomething=true;
+    }
+  return ranSomething;
+  }
+
+/*
+ * Change how often a task runs. Its next run will be one interval from now.
+ */
+void setTaskInterval(int which, unsigned long intervalMillis)
+  {
+  tasks[which].intervalMillis=intervalMillis;
+  tasks[which].lastRun=millis();
+  }
+
+/*
+ * Make a task run on the next pass through the scheduler
+ */
+void runTaskNow(int which)
+  {
+  tasks[which].lastRun=millis()-tasks[which].intervalMillis;
+  }
+
+/*
+ * Reboot after the given delay.  The scheduler keeps running in the meantime
+ * so that any pending MQTT and serial output gets sent.
+ */
+void scheduleRestart(unsigned long delayMillis)
+  {
+  setTaskInterval(TASK_RESTART,delayMillis);
+  tasks[TASK_RESTART].enabled=true;
+  }
+
+/*
+ * Print the per-task run counts and lateness statistics
+ */
+void showTasks()
+  {
+  Serial.println("Task\truns\toverruns\tworst late(ms)");
+  for (int i=0;i<TASK_COUNT;i++)
+    {
+    task* t=&tasks[i];
+    Serial.print(t->name);
+    Serial.print("\t");
+    Serial.print(t->runs);
+    Serial.print("\t");
+    Serial.print(t->overruns);
+    Serial.print("\t");
+    Serial.println(t->worstLateMillis);
+    }
+  }
+
+/*
+ * Print how long each phase of the last network connection took
+ */
+void showConnectTimes()
+  {
+  Serial.print("Network is ");
+  Serial.print(wifiStateNames[wifiState]);
+  Serial.print(", last connect took scan=");
+  Serial.print(connectTimes.scanMillis);
+  Serial.print("ms associate=");
+  Serial.print(connectTimes.associateMillis);
+  Serial.print("ms address=");
+  Serial.print(connectTimes.addressMillis);
+  Serial.print("ms mqtt=");
+  Serial.print(connectTimes.mqttMillis);
+  Serial.print("ms, connects=");
+  Serial.print(counters[COUNTER_WIFI_CONNECTS]);
+  Serial.print(" failures=");
+  Serial.println(counters[COUNTER_WIFI_FAILURES]);
+  }
+
+/*
+ * Print the average and worst case execution time of each code path.  These are
+ * the same figures the metrics report sends, so they're left as they are.
+ */
+void showTimings()
+  {
+  Serial.println("Path\tcalls\tavg(us)\tworst(us)");
+  for (int i=0;i<TIMING_COUNT;i++)
+    {
+    timing* t=&timings[i];
+    Serial.print(t->name);
+    Serial.print("\t");
+    Serial.print(t->calls);
+    Serial.print("\t");
+    Serial.print(t->calls>0?t->totalMicros/t->calls:0);
+    Serial.print("\t");
+    Serial.println(t->worstMicros);
+    }
+  showTasks();
+  showConnectTimes();
+  Serial.print("Sensor edges=");
+  Serial.print(edgesSeen);
+  Serial.print(" dropped=");
+  Serial.println(edgesDropped);
+  showQueue();
+  showSettingsJournal();
+  }
+
+// The LED patterns.  Each step sets the red and green LEDs and lasts for its time,
+// and then the next step starts, going back to the first after the last.  A step
+// with a time of 0 is held until the pattern changes.  Levels are analogWrite() 
+// values, where a higher number is dimmer, or LED_DARK for off.  The LEDs are only
+// written when a step changes, and the PWM hardware holds them in between, so a
+// long blocking network operation can only make a blink late.
+typedef struct
+  {
+  int16_t red;
+  int16_t green;
+  uint16_t millis;
+  } ledStep;
+
+typedef struct
+  {
+  const char* name;
+  const ledStep* steps;
+  uint8_t count;
+  } ledPattern;
+
+const ledStep ledSteadySteps[]=  //wet, all is well
+  {
+  {LED_DARK,WET_GREEN_BRIGHTNESS,0} //full on is too bright
+  };
+const ledStep ledBlinkSteps[]=   //the settings aren't complete yet
+  {
+  {LED_DARK,WET_GREEN_BRIGHTNESS,LED_BLINK_TIME},
+  {LED_DARK,LED_DARK,LED_BLINK_TIME}
+  };
+const ledStep ledYellowSteps[]=  //dry, time to fill the tank
+  {
+  {DRY_RED_BRIGHTNESS,DRY_GREEN_BRIGHTNESS,WARNING_LED_FLASH_RATE*1000},
+  {LED_DARK,LED_DARK,WARNING_LED_FLASH_RATE*1000}
+  };
+const ledStep ledFaultSteps[]=   //something has gone wrong
+  {
+  {DRY_RED_BRIGHTNESS,LED_DARK,WARNING_LED_FLASH_RATE*1000},
+  {LED_DARK,LED_DARK,WARNING_LED_FLASH_RATE*1000}
+  };
+
+#define LED_PATTERN(name,steps) {name,steps,sizeof(steps)/sizeof(steps[0])}
+enum {LED_PATTERN_STEADY, LED_PATTERN_BLINK, LED_PATTERN_YELLOW, LED_PATTERN_FAULT, LED_PATTERN_COUNT};
+const ledPattern ledPatterns[LED_PATTERN_COUNT]=
+  {
+  LED_PATTERN("steady",ledSteadySteps),
+  LED_PATTERN("blink",ledBlinkSteps),
+  LED_PATTERN("yellow",ledYellowSteps),
+  LED_PATTERN("fault",ledFaultSteps)
+  };
+
+int8_t ledPatternNow=-1;
+uint8_t ledStepNow=0;
+unsigned long ledStepStart=0;
+int16_t redLevel=LED_DARK;   //what the LEDs are showing now
+int16_t greenLevel=LED_DARK;
+
+/*
+ * Set an LED, if it isn't already showing that level
+ */
+void setLed(uint8_t pin, int16_t level, int16_t* current)
+  {
+  if (level==*current)
+    return;
+  if (level==LED_DARK)
+    digitalWrite(pin,LED_OFF);
+  else
+    analogWrite(pin,level);
+  *current=level;
+  }
+
+void showLedStep()
+  {
+  const ledStep* step=&ledPatterns[ledPatternNow].steps[ledStepNow];
+  setLed(WARNING_LED_PORT_RED,step->red,&redLevel);
+  setLed(OK_LED_PORT_GREEN,step->green,&greenLevel);
+  ledStepStart=millis();
+  }
+
+/*
+ * Which pattern the LEDs should be showing.  A failure trumps everything, and 
+ * otherwise the first sensor is the low level warning.
+ */
+uint8_t chooseLedPattern()
+  {
+  if (failure)
+    return LED_PATTERN_FAULT;
+  if (!settingsAreValid)
+    return LED_PATTERN_BLINK;
+  return (lastReading&1)?LED_PATTERN_STEADY:LED_PATTERN_YELLOW;
+  }
+
+/*
+ * Start a new pattern if it's changed, or move on to the next step when it's time
+ */
+void updateLeds()
+  {
+  uint8_t pattern=chooseLedPattern();
+  if (pattern!=ledPatternNow)
+    {
+    ledPatternNow=pattern;
+    ledStepNow=0;
+    if (settings.debug)
+      {
+      Serial.print("LED pattern ");
+      Serial.println(ledPatterns[pattern].name);
+      }
+    showLedStep();
+    return;
+    }
+  const ledPattern* p=&ledPatterns[ledPatternNow];
+  uint16_t length=p->steps[ledStepNow].millis;
+  if (length>0 && millis()-ledStepStart>=length)
+    {
+    ledStepNow=(ledStepNow+1)%p->count;
+    showLedStep();
+    }
+  }
+
+// The debounce filters.  Only the one selected by settings.debounceFilter is used,
+// but they are small so we keep one of each. Each one handles all of the sensors.
+// The debounced value is kept in RTC memory across deep sleep.
+HoldoffFilter<SENSOR_MAX,HYSTERESIS_DELAY> holdoffFilter;
+IntegratorFilter<SENSOR_MAX,INTEGRATOR_DELAY> integratorFilter;
+MajorityFilter<SENSOR_MAX,MAJORITY_SAMPLES,MAJORITY_SAMPLE_PERIOD> majorityFilter;
+ExponentialFilter<SENSOR_MAX,EXPONENTIAL_SHIFT,EXPONENTIAL_SAMPLE_PERIOD> exponentialFilter;
+const char* filterNames[]={"holdoff","integrator","majority","exponential"};
+boolean debounceStarted=false; //false until the first reading or a restore from RTC memory
+
+/*
+ * Start the filters off with a settled value.
+ */
+void resetDebounce(uint8_t reading)
+  {
+  uint32_t now=micros();
+  holdoffFilter.reset(reading,now);
+  integratorFilter.reset(reading,now);
+  majorityFilter.reset(reading,now);
+  exponentialFilter.reset(reading,now);
+  debounceStarted=true;
+  lastReading=reading;
+  }
+
+/*
+ * Run raw readings taken at time "now" (micros) through the selected filter
+ */
+uint8_t debounce(uint8_t reading, uint32_t now)
+  {
+  if (!debounceStarted)
+    resetDebounce(reading);
+
+  switch (settings.debounceFilter)
+    {
+    case FILTER_INTEGRATOR:
+      return integratorFilter.update(reading,now);
+    case FILTER_MAJORITY:
+      return majorityFilter.update(reading,now);
+    case FILTER_EXPONENTIAL:
+      return exponentialFilter.update(reading,now);
+    default:
+      return holdoffFilter.update(reading,now);
+    }
+  }
+
+/*
+ * Longest the selected filter takes to follow a lasting change, in milliseconds,
+ * counting the wait for the sensor task to read it
+ */
+unsigned long debounceSettleMillis()
+  {
+  switch (settings.debounceFilter)
+    {
+    case FILTER_INTEGRATOR:
+      return integratorFilter.SETTLE_MS+SENSOR_TASK_INTERVAL;
+    case FILTER_MAJORITY:
+      return majorityFilter.SETTLE_MS+SENSOR_TASK_INTERVAL;
+    case FILTER_EXPONENTIAL:
+      return exponentialFilter.SETTLE_MS+SENSOR_TASK_INTERVAL;
+    default:
+      return holdoffFilter.SETTLE_MS+SENSOR_TASK_INTERVAL;
+    }
+  }
+
+/*
+ * Milliseconds between scheduled reports.  In change mode the scheduled report is
+ * just a heartbeat, changes are reported as soon as they happen.
+ */
+unsigned long reportInterval()
+  {
+  if (settings.reportMode==REPORT_MODE_CHANGE)
+    return settings.heartbeatPeriod*1000;
+  else
+    return settings.reportPeriod*1000;
+  }
+
+/*
+ * True if the debounced reading is different from what the broker last heard
+ */
+boolean analogLevelChanged();
+
+boolean readingChanged()
+  {
+  return (debounceStarted && lastReading!=rtc.lastReported) || analogLevelChanged();
+  }
+
+/*
+ * Pick the sensor levels out of the GPIO input register
+ */
+uint8_t sensorBits(uint32_t gpio)
+  {
+  uint8_t bits=0;
+  for (uint8_t i=0;i<settings.sensorCount;i++)
+    if (gpio&(1UL<<sensorPins[i]))
+      bits|=1<<i;
+  return bits;
+  }
+
+/*
+ * Set up the pins and interrupts for the sensors in use, and stop listening to
+ * the rest
+ */
+void attachSensors()
+  {
+  for (uint8_t i=0;i<SENSOR_MAX;i++)
+    {
+    if (i<settings.sensorCount)
+      {
+      pinMode(sensorPins[i],INPUT_PULLUP); //The liquid level sensors have open collector outputs
+      attachInterrupt(digitalPinToInterrupt(sensorPins[i]),sensorEdgeISR,CHANGE);
+      }
+    else
+      detachInterrupt(digitalPinToInterrupt(sensorPins[i]));
+    }
+  sensorLevels=sensorBits(GPI);
+  }
+
+/*
+ * The analog level sensor.  A resistive or pressure level sender on A0 is read 
+ * once per run of the adc task, and every ANALOG_OVERSAMPLE reads are added up 
+ * into one sample with two more bits of resolution.  Samples go through a median 
+ * of three, to throw out spikes, and then a fixed point IIR filter.  The filtered 
+ * value is turned into tenths of a percent full by straight lines between the 
+ * points of the calibration table.  Transmitting disturbs the ESP8266 ADC, so 
+ * reads are put off while the network is connecting and for a little while after
+ * anything is sent.
+ */
+typedef struct
+  {
+  uint16_t raw;            //oversampled counts, 0 to 1023*ANALOG_OVERSAMPLE
+  uint16_t level;          //tenths of a percent
+  } calibrationPoint;
+
+calibrationPoint calibration[ANALOG_CALIBRATION_POINTS];
+uint8_t calibrationPoints=0;
+uint32_t adcSum=0;
+uint8_t adcReads=0;
+uint16_t adcRecent[3];     //the last three samples, for the median
+uint8_t adcRecentNext=0;
+int32_t adcFiltered=0;     //oversampled counts << ANALOG_IIR_FRACTION
+uint16_t analogLevel=0;    //tenths of a percent full
+boolean analogValid=false;
+
+boolean mqttConnecting();
+
+/*
+ * Parse a calibration table like "120:0,480:50,900:100", raw ADC counts (0 to 1023)
+ * and the percent full at that reading.  The raw counts must go up.  Returns false 
+ * and leaves the table alone if it isn't valid.
+ */
+boolean parseCalibration(const char* text)
+  {
+  calibrationPoint points[ANALOG_CALIBRATION_POINTS];
+  uint8_t n=0;
+  const char* p=text;
+  while (*p)
+    {
+    char* end;
+    long raw=strtol(p,&end,10);
+    if (end==p || *end!=':' || raw<0 || raw>1023 || n==ANALOG_CALIBRATION_POINTS)
+      return false;
+    p=end+1;
+    long percent=strtol(p,&end,10);
+    if (end==p || percent<0 || percent>100 || (*end!=',' && *end!='\0'))
+      return false;
+    if (n>0 && raw*ANALOG_OVERSAMPLE<=points[n-1].raw)
+      return false;
+    points[n].raw=raw*ANALOG_OVERSAMPLE;
+    points[n].level=percent*10;
+    n++;
+    p=*end==','?end+1:end;
+    }
+  if (n<2)
+    return false;
+  memcpy(calibration,points,n*sizeof(points[0]));
+  calibrationPoints=n;
+  return true;
+  }
+
+/*
+ * Tenths of a percent full for an oversampled reading, from the calibration table
+ */
+uint16_t calibrate(uint16_t raw)
+  {
+  if (raw<=calibration[0].raw)
+    return calibration[0].level;
+  for (uint8_t i=1;i<calibrationPoints;i++)
+    {
+    const calibrationPoint* a=&calibration[i-1];
+    const calibrationPoint* b=&calibration[i];
+    if (raw<=b->raw)
+      return a->level+((int32_t)(raw-a->raw)*((int32_t)b->level-a->level))/(int32_t)(b->raw-a->raw);
+    }
+  return calibration[calibrationPoints-1].level;
+  }
+
+/*
+ * Put one oversampled reading through the median and IIR filters
+ */
+void addAnalogSample(uint16_t raw)
+  {
+  if (!analogValid)
+    {
+    adcRecent[0]=adcRecent[1]=adcRecent[2]=raw;
+    adcFiltered=(int32_t)raw<<ANALOG_IIR_FRACTION;
+    analogValid=true;
+    }
+  adcRecent[adcRecentNext]=raw;
+  adcRecentNext=(adcRecentNext+1)%3;
+
+  uint16_t a=adcRecent[0], b=adcRecent[1], c=adcRecent[2];
+  uint16_t median=a>b?(b>c?b:(a>c?c:a)):(a>c?a:(b>c?c:b));
+  // arithmetic shift of a negative difference is fine with gcc
+  adcFiltered+=(((int32_t)median<<ANALOG_IIR_FRACTION)-adcFiltered)>>ANALOG_IIR_SHIFT;
+  analogLevel=calibrate(adcFiltered>>ANALOG_IIR_FRACTION);
+  }
+
+/*
+ * Take a whole oversampled reading right now, to start the filter off.  Only for
+ * before the network is started.
+ */
+void primeAnalog()
+  {
+  uint32_t sum=0;
+  for (uint8_t i=0;i<ANALOG_OVERSAMPLE;i++)
+    sum+=analogRead(A0);
+  analogValid=false;
+  adcSum=0;
+  adcReads=0;
+  addAnalogSample(sum);
+  }
+
+/*
+ * True if the radio may be transmitting, which upsets the ADC
+ */
+boolean radioBusy()
+  {
+  return (wifiState!=WIFI_STATE_IDLE && wifiState!=WIFI_STATE_CONNECTED)
+      || mqttConnecting()
+      || millis()-lastRadioActivity < ANALOG_RADIO_QUIET;
+  }
+
+/*
+ * True if the analog level has moved far enough from what the broker last heard
+ */
+boolean analogLevelChanged()
+  {
+  if (!settings.analogEnabled || !analogValid)
+    return false;
+  int32_t moved=(int32_t)analogLevel-rtc.lastLevelReported;
+  return moved>=ANALOG_REPORT_CHANGE || moved<=-ANALOG_REPORT_CHANGE;
+  }
+
+//Take a measurement
+void readSensor()
+  {
+  // Taken first, so an edge that comes in after the queue is empty can't be older
+  // than this pass's last update
+  uint32_t now=micros();
+  sensorEdge edge;
+  while (popSensorEdge(&edge))
+    {
+    edgesSeen++;
+    sensorLevels=sensorBits(edge.gpio);
+    debounce(sensorLevels,(int32_t)(now-edge.micros)<0?now:edge.micros);
+    }
+
+  if (edgesDropped!=edgesDroppedSeen) //we missed some, so resynchronize with the pins
+    {
+    edgesDroppedSeen=edgesDropped;
+    sensorLevels=sensorBits(GPI);
+    }
+
+  // The levels may have settled while changes were being ignored
+  lastReading=debounce(sensorLevels,now);
+  }
+
+void showSub(const char* topic)
+  {
+  if (settings.debug)
+    {
+    Serial.print("++++++Subscribing to ");
+    Serial.print(topic);
+    Serial.print(":\t");
+    Serial.println();
+    }
+  }
+
+void forgetWifiConnection();
+
+/*
+ * The client ID is made from the chip ID, so it stays the same even after a
+ * factory reset and the broker can recognize us to keep our session.
+ */
+void defaultClientId()
+  {
+  char id[MQTT_CLIENTID_SIZE];
+  snprintf(id,sizeof(id),"%s%06x",MQTT_CLIENT_ID_ROOT,ESP.getChipId());
+  setSettingString(STRING_CLIENT_ID,id);
+  }
+uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc=0);
+boolean parseBrokers(const char* text);
+boolean readSettingsJournal();
+boolean readLegacySettings();
+boolean flushSettings();
+void saveRtc();
+uint32_t deviceSeconds();
+void showSettings();
+void report();
+void showTimings();
+void buildSettingsJson(JsonWriter& json);
+metricsSnapshot takeMetricsSnapshot();
+void buildMetricsJson(JsonWriter& json, const metricsSnapshot& now);
+boolean publishMetrics();
+template <typename Builder> boolean publishJson(const char* topic, Builder build, bool retain);
+
+/*
+ * Build the topic table from the topic root
+ */
+void buildTopics()
+  {
+  const char* root=settingString(STRING_TOPIC_ROOT);
+  topicRootLength=strnlen(root,MQTT_TOPIC_SIZE-1);
+  for (int i=0;i<TOPIC_COUNT;i++)
+    {
+    size_t suffixLength=strlen(topicSuffixes[i]);
+    if (suffixLength>=MQTT_TOPIC_SUFFIX_SIZE) //can't happen unless someone adds a long one
+      suffixLength=MQTT_TOPIC_SUFFIX_SIZE-1;
+    memcpy(topics[i].name,root,topicRootLength);
+    memcpy(topics[i].name+topicRootLength,topicSuffixes[i],suffixLength);
+    topics[i].length=topicRootLength+suffixLength;
+    topics[i].name[topics[i].length]='\0';
+    }
+  }
+
+/*
+ * True if a received topic is the given one from the table
+ */
+boolean topicIs(const char* topic, size_t length, int which)
+  {
+  return length==topics[which].length && memcmp(topic,topics[which].name,length)==0;
+  }
+
+/*
+ * Start a group of settings changes that should be written together.  Calls to
+ * saveSettings() in between only note that something changed.
+ */
+uint8_t settingsTransactions=0; //nesting depth of beginSettings()
+boolean settingsDirty=false;    //changed since they were last written to flash
+
+void beginSettings()
+  {
+  settingsTransactions++;
+  }
+
+/*
+ * Called when the settings have changed. Set the valid flag if everything is 
+ * filled in.  Writing them to flash is put off for SETTINGS_COMMIT_DELAY so that
+ * a burst of commands is written once, and flushSettings() writes them sooner if
+ * we are about to restart or sleep.
+ */
+boolean saveSettings()
+  {
+  settingsDirty=true;
+  if (settingsTransactions>0)
+    return true;
+
+  if (strlen(settingString(STRING_SSID))>0 &&
+    strlen(settingString(STRING_WIFI_PASSWORD))>0 &&
+    strlen(settingString(STRING_BROKER))>0 &&
+    settings.mqttBrokerPort!=0 &&
+    strlen(settingString(STRING_TOPIC_ROOT))>0 &&
+    strlen(settingString(STRING_CLIENT_ID))>0 &&
+    settings.reportPeriod > 0 &&
+      (strlen(settingString(STRING_STATIC_IP))==0 || //if staticIP set then all network stuff
+        (strlen(settingString(STRING_NETMASK))>0 && //except DNS must be too
+        strlen(settingString(STRING_GATEWAY))>0))
+    )
+    {
+    Serial.println("Settings deemed complete");
+    settings.validConfig=VALID_SETTINGS_FLAG;
+    settingsAreValid=true;
+    }
+  else
+    {
+    Serial.println("Settings still incomplete");
+    settings.validConfig=0;
+    settingsAreValid=false;
+    }
+    
+  //The mqttClientId is not set by the user, but we need to make sure it's set  
+  if (strlen(settingString(STRING_CLIENT_ID))==0)
+    defaultClientId();
+    
+    
+  buildTopics(); //the topic root may have changed
+
+  setTaskInterval(TASK_SETTINGS,SETTINGS_COMMIT_DELAY); //start the wait over
+  tasks[TASK_SETTINGS].enabled=true;
+  return true;
+  }
+
+/*
+ * Finish a group of settings changes started with beginSettings() and write them
+ * to flash right away.  Returns false if they couldn't be written.
+ */
+boolean commitSettings()
+  {
+  if (settingsTransactions>0)
+    settingsTransactions--;
+  if (settingsTransactions>0 || !settingsDirty)
+    return true;
+  saveSettings();
+  return flushSettings();
+  }
+
+void initializeSettings()
+  {
+  settings.validConfig=0; 
+  memset(settings.strings,0,sizeof(settings.strings)); //all of the strings empty
+  memset(settings.stringLength,0,sizeof(settings.stringLength));
+  settings.mqttBrokerPort=1883;
+  defaultClientId();
+  settings.reportPeriod=0;
+  settings.sleepTime=0;
+  settings.reportMode=REPORT_MODE_PERIODIC;
+  settings.heartbeatPeriod=DEFAULT_HEARTBEAT_PERIOD;
+  settings.debounceFilter=DEFAULT_DEBOUNCE_FILTER;
+  settings.queueDropPolicy=QUEUE_DROP_OLDEST;
+  settings.queueDepth=DEFAULT_QUEUE_DEPTH;
+  settings.metricsPeriod=0;
+  settings.sensorCount=DEFAULT_SENSOR_COUNT;
+  settings.analogEnabled=false;
+  setSettingString(STRING_ANALOG_CALIBRATION,DEFAULT_ANALOG_CALIBRATION);
+  settings.pulsePin=0;
+  settings.pulsesPerUnit=DEFAULT_PULSES_PER_UNIT;
+  settings.pulseTotal=0;
+  settings.persistentSession=false;
+  settings.tlsMode=TLS_OFF;
+  parseBrokers(""); //the backup brokers went with the strings
+  settingsDirty=true; //so commitSettings() writes them
+  }
+
+/*
+ * The flow meter.  Its pulses are counted by an interrupt handler that does nothing
+ * but increment pulseCount, so it keeps up with meters running at several kHz
+ * whatever the WiFi stack is doing.  Only the handler writes pulseCount, and the
+ * processor reads a 32 bit word in one go, so a snapshot needs no locking.  The
+ * pulse task adds the change since its last snapshot to the 64 bit total, which
+ * comes out right across pulseCount wrapping as long as the task runs at least 
+ * once per 2^32 pulses.  Resetting only zeros the total, so the interrupt is never
+ * turned off and no pulse is lost.  The total is kept in RTC memory on every run 
+ * of the task, to survive restarts and deep sleep (pulses aren't counted while
+ * asleep), and in the settings every PULSE_SAVE_INTERVAL, to survive a power cycle.
+ */
+volatile uint32_t pulseCount=0;
+uint8_t pulsePinAttached=0;
+uint32_t pulseSnapshot=0;   //pulseCount when it was last added to the total
+uint64_t pulseTotal=0;
+unsigned long pulseSavedAt=0; //millis() when the total was last put in the settings
+
+// The flow rate is worked out over the last PULSE_WINDOW_SAMPLES runs of the pulse task
+typedef struct
+  {
+  uint32_t millis;
+  uint32_t count;          //pulseCount
+  } pulseSample;
+pulseSample pulseWindow[PULSE_WINDOW_SAMPLES];
+uint8_t pulseWindowNext=0;
+uint8_t pulseWindowCount=0;
+uint32_t pulseRate=0;      //thousandths of a pulse per second
+
+void IRAM_ATTR pulseISR()
+  {
+  pulseCount++;
+  }
+
+/*
+ * True if the pin can take the flow meter.  It must have an interrupt and not be
+ * the serial port, the flash chip, a LED or a level sensor.
+ */
+boolean pulsePinUsable(uint8_t pin)
+  {
+  if (pin==0) //none
+    return true;
+  if (pin==1 || pin==3 || (pin>=6 && pin<=11) || pin>15)
+    return false;
+  if (pin==WARNING_LED_PORT_RED || pin==OK_LED_PORT_GREEN || pin==WIFI_LED_PORT)
+    return false;
+  for (uint8_t i=0;i<settings.sensorCount;i++)
+    if (pin==sensorPins[i])
+      return false;
+  return true;
+  }
+
+/*
+ * Start counting on the pin in the settings, and stop on the old one
+ */
+void attachPulseCounter()
+  {
+  if (pulsePinAttached!=0)
+    detachInterrupt(digitalPinToInterrupt(pulsePinAttached));
+  if (!pulsePinUsable(settings.pulsePin))
+    {
+    Serial.print("The flow meter can't use GPIO");
+    Serial.println(settings.pulsePin);
+    settings.pulsePin=0;
+    }
+  pulsePinAttached=settings.pulsePin;
+  pulseWindowNext=0;
+  pulseWindowCount=0;
+  pulseRate=0;
+  if (pulsePinAttached!=0)
+    {
+    pinMode(pulsePinAttached,INPUT_PULLUP); //flow meters have open collector outputs too
+    attachInterrupt(digitalPinToInterrupt(pulsePinAttached),pulseISR,FALLING);
+    }
+  tasks[TASK_PULSE].enabled=pulsePinAttached!=0;
+  }
+
+/*
+ * Add the pulses since last time to the total and update the flow rate
+ */
+void samplePulses()
+  {
+  uint32_t now=millis();
+  uint32_t count=pulseCount;
+  if (count!=pulseSnapshot)
+    {
+    pulseTotal+=count-pulseSnapshot; //unsigned, so pulseCount wrapping doesn't matter
+    pulseSnapshot=count;
+    rtc.pulseTotal=pulseTotal;
+    saveRtc();
+    }
+
+  pulseWindow[pulseWindowNext].millis=now;
+  pulseWindow[pulseWindowNext].count=count;
+  pulseWindowNext=(pulseWindowNext+1)%PULSE_WINDOW_SAMPLES;
+  if (pulseWindowCount<PULSE_WINDOW_SAMPLES)
+    pulseWindowCount++;
+  const pulseSample* oldest=&pulseWindow[pulseWindowCount<PULSE_WINDOW_SAMPLES?0:pulseWindowNext];
+  uint32_t elapsed=now-oldest->millis;
+  pulseRate=elapsed==0?0:(uint64_t)(count-oldest->count)*1000000/elapsed;
+  }
+
+/*
+ * Put the total in the settings to be written to flash.  Unlike saveSettings() this
+ * doesn't touch anything else, and it doesn't put off a write that's already due.
+ */
+void savePulseTotal()
+  {
+  pulseSavedAt=millis();
+  if (settings.pulseTotal==pulseTotal)
+    return;
+  settings.pulseTotal=pulseTotal;
+  settingsDirty=true;
+  if (!tasks[TASK_SETTINGS].enabled)
+    {
+    setTaskInterval(TASK_SETTINGS,SETTINGS_COMMIT_DELAY);
+    tasks[TASK_SETTINGS].enabled=true;
+    }
+  }
+
+/*
+ * Pick up the total where it was left, from RTC memory if that survived
+ */
+void restorePulseTotal(boolean rtcValid)
+  {
+  pulseTotal=rtcValid?rtc.pulseTotal:settings.pulseTotal;
+  rtc.pulseTotal=pulseTotal;
+  pulseSnapshot=pulseCount;
+  }
+
+/*
+ * The total, flow rate and flow in units per minute, in thousandths
+ */
+void buildFlowJson(JsonWriter& json)
+  {
+  json.beginObject();
+  json.addUnsigned64("total",pulseTotal);
+  json.addDecimal("rate",pulseRate,3);
+  json.addDecimal("flow",(uint64_t)pulseRate*60/settings.pulsesPerUnit,3);
+  json.endObject();
+  }
+
+/*
+ * What to do after some of the settings change.  Each returns the response text.
+ */
+const char* afterNetworkChange(const char* val, boolean fromMqtt)
+  {
+  forgetWifiConnection(); //join with the new setting on the next wake
+  return "OK";
+  }
+
+const char* afterReportChange(const char* val, boolean fromMqtt)
+  {
+  setTaskInterval(TASK_REPORT,reportInterval());
+  return "OK";
+  }
+
+void forgetTrustAnchors();
+
+const char* afterMqttChange(const char* val, boolean fromMqtt)
+  {
+  forgetTrustAnchors(); //in case the CA file has been replaced too
+  if (mqttClient.connected())
+    mqttClient.disconnect(); //reconnect with the new setting
+  return "OK";
+  }
+
+const char* afterTopicRoot(const char* val, boolean fromMqtt)
+  {
+  const char* root=settingString(STRING_TOPIC_ROOT);
+  size_t len=strlen(root);
+  if (len>0 && root[len-1]!='/' && len<MQTT_TOPIC_SIZE-1)
+    {
+    char withSlash[MQTT_TOPIC_SIZE];
+    snprintf(withSlash,sizeof(withSlash),"%s/",root);
+    if (!setSettingString(STRING_TOPIC_ROOT,withSlash))
+      {
+      afterMqttChange(val,fromMqtt);
+      return "No room to add a / to the topic root";
+      }
+    }
+  return afterMqttChange(val,fromMqtt); //subscribe to the new command topic
+  }
+
+boolean parseBrokers(const char* text);
+
+const char* afterBackupBrokers(const char* val, boolean fromMqtt)
+  {
+  if (parseBrokers(settingString(STRING_BACKUP_BROKERS)))
+    return afterMqttChange(val,fromMqtt);
+  setSettingString(STRING_BACKUP_BROKERS,"");
+  parseBrokers("");
+  return "Bad broker list, there are no backup brokers now";
+  }
+
+const char* afterSleepTime(const char* val, boolean fromMqtt)
+  {
+  // As in setup(), only sleep once there's a network to report to.  The sleep task
+  // does the reporting then.
+  boolean sleeping=settings.sleepTime>0 && settingsAreValid;
+  tasks[TASK_SLEEP].enabled=sleeping;
+  tasks[TASK_REPORT].enabled=!sleeping;
+  return "OK";
+  }
+
+const char* afterFilter(const char* val, boolean fromMqtt)
+  {
+  resetDebounce(lastReading); //no spurious change when switching
+  return "OK";
+  }
+
+const char* afterSensors(const char* val, boolean fromMqtt)
+  {
+  attachSensors();
+  resetDebounce(sensorLevels); //start the new sensors off settled
+  if (!pulsePinUsable(settings.pulsePin))
+    attachPulseCounter(); //turns it off
+  return "OK";
+  }
+
+const char* afterAnalog(const char* val, boolean fromMqtt)
+  {
+  tasks[TASK_ADC].enabled=settings.analogEnabled;
+  analogValid=false; //start the filter over
+  adcSum=0;
+  adcReads=0;
+  return "OK";
+  }
+
+const char* afterCalibration(const char* val, boolean fromMqtt)
+  {
+  if (parseCalibration(settingString(STRING_ANALOG_CALIBRATION)))
+    return "OK";
+  setSettingString(STRING_ANALOG_CALIBRATION,DEFAULT_ANALOG_CALIBRATION);
+  parseCalibration(DEFAULT_ANALOG_CALIBRATION);
+  return "Bad calibration table, using " DEFAULT_ANALOG_CALIBRATION;
+  }
+
+const char* afterPulsePin(const char* val, boolean fromMqtt)
+  {
+  if (!pulsePinUsable(settings.pulsePin))
+    {
+    settings.pulsePin=pulsePinAttached;
+    return "That pin is in use or can't interrupt";
+    }
+  attachPulseCounter();
+  return "OK";
+  }
+
+const char* afterQueueDepth(const char* val, boolean fromMqtt)
+  {
+  openQueueFile(false); //this empties the queue file
+  return "OK";
+  }
+
+/*
+ * The commands that aren't settings.  Each returns the response text, NULL if the
+ * command wasn't valid, or "" if the response has already been sent.
+ */
+const char* settingsCommand(const char* val, boolean fromMqtt)
+  {
+  if (!fromMqtt)
+    {
+    showSettings();
+    return "";
+    }
+  if (!publishJson(topics[TOPIC_SETTINGS_RESPONSE].name,buildSettingsJson,false)) //do not retain
+    Serial.println("************ Failure when publishing settings!");
+  return "";
+  }
+
+const char* metricsCommand(const char* val, boolean fromMqtt)
+  {
+  if (!fromMqtt)
+    {
+    JsonWriter json(&Serial);
+    buildMetricsJson(json,takeMetricsSnapshot());
+    json.end();
+    Serial.println();
+    return "";
+    }
+  if (!publishMetrics())
+    Serial.println("************ Failure when publishing metrics!");
+  return "";
+  }
+
+const char* versionCommand(const char* val, boolean fromMqtt)
+  {
+  return VERSION;
+  }
+
+const char* statusCommand(const char* val, boolean fromMqtt)
+  {
+  report();
+  return "Status report complete";
+  }
+
+const char* resetPulseCommand(const char* val, boolean fromMqtt)
+  {
+  samplePulses(); //the pulses so far are the ones being thrown away
+  pulseTotal=0;
+  rtc.pulseTotal=0;
+  saveRtc();
+  savePulseTotal();
+  return "OK";
+  }
+
+const char* rebootCommand(const char* val, boolean fromMqtt)
+  {
+  scheduleRestart(0); //the restart task waits for the response to be sent
+  return "REBOOTING";
+  }
+
+const char* factoryDefaultsCommand(const char* val, boolean fromMqtt)
+  {
+  if (val==NULL || strcmp(val,"yes")!=0)
+    return NULL;
+  Serial.println("\n*********************** Resetting Saved Values ************************");
+  beginSettings();
+  initializeSettings();
+  commitSettings();
+  forgetWifiConnection();
+  scheduleRestart(0);
+  return "OK";
+  }
+
+const char* timingCommand(const char* val, boolean fromMqtt)
+  {
+  if (val==NULL || strcmp(val,"yes")!=0)
+    return NULL;
+  showTimings();
+  return "OK";
+  }
+
+// The command table.  Every command from the serial port or MQTT is looked up here.
+// Settings are set, shown by showSettings() and sent by the settings command all
+// from this table. It must be kept sorted by name so that it can be searched quickly.
+enum {SETTING_NONE, SETTING_STRING, SETTING_INT, SETTING_ULONG, SETTING_UINT16, SETTING_UINT8, SETTING_BOOL, SETTING_CHOICE};
+
+typedef const char* (*commandHandler)(const char* val, boolean fromMqtt);
+
+typedef struct command
+  {
+  const char* name;
+  const char* help;           //shown by showSettings()
+  uint8_t type;               //SETTING_NONE for commands that aren't settings
+  uint16_t offset;            //where the setting is in the conf struct, or which string it is
+  uint16_t size;              //size of a string setting, including the null
+  long minValue;              //valid range for a number setting
+  long maxValue;
+  const char* const* choices; //value names for a choice setting
+  uint8_t choiceCount;
+  commandHandler handler;     //the command, or what to do after a setting is changed
+  const char* jsonName;       //name in the settings JSON if it's not the same
+  int8_t responseTopic;       //entry in the topic table for the MQTT response, -1 to build it
+  } command;
+
+const char* const reportModeNames[]={"periodic","change"};
+const char* const queueDropNames[]={"oldest","newest"};
+const char* const tlsModeNames[]={"off","fingerprint","ca"};
+
+#define STRING_SETTING(name,string,size,help,after) \
+  {name,help,SETTING_STRING,string,size,0,0,NULL,0,after,NULL,-1}
+#define NUMBER_SETTING(name,type,field,min,max,help,after,jsonName) \
+  {name,help,type,offsetof(conf,field),0,min,max,NULL,0,after,jsonName,-1}
+#define CHOICE_SETTING(name,field,names,help,after) \
+  {name,help,SETTING_CHOICE,offsetof(conf,field),0,0,0,names,sizeof(names)/sizeof(names[0]),after,NULL,-1}
+#define ACTION(name,handler,responseTopic) \
+  {name,NULL,SETTING_NONE,0,0,0,0,NULL,0,handler,NULL,responseTopic}
+
+constexpr command commands[]=
+  {
+  {"analog","1|0",SETTING_BOOL,offsetof(conf,analogEnabled),0,0,1,NULL,0,afterAnalog,NULL,-1},
+  STRING_SETTING("backupbrokers",STRING_BACKUP_BROKERS,MQTT_BACKUP_BROKERS_SIZE,"host[:port],... to use in order when the broker is down",afterBackupBrokers),
+  STRING_SETTING("broker",STRING_BROKER,ADDRESS_SIZE,"MQTT broker host name or address",NULL),
+  STRING_SETTING("calibration",STRING_ANALOG_CALIBRATION,ANALOG_CALIBRATION_SIZE,"raw:percent,raw:percent... for the analog sensor",afterCalibration),
+  {"debug","1|0",SETTING_BOOL,offsetof(conf,debug),0,0,1,NULL,0,NULL,NULL,-1},
+  STRING_SETTING("dns",STRING_DNS,ADDRESS_SIZE,"DNS IP address",afterNetworkChange),
+  ACTION("factorydefaults",factoryDefaultsCommand,-1),
+  CHOICE_SETTING("filter",debounceFilter,filterNames,"holdoff|integrator|majority|exponential",afterFilter),
+  STRING_SETTING("fingerprint",STRING_TLS_FINGERPRINT,TLS_FINGERPRINT_SIZE,"SHA1 fingerprint of the broker's certificate",afterMqttChange),
+  STRING_SETTING("gateway",STRING_GATEWAY,ADDRESS_SIZE,"gateway IP address",afterNetworkChange),
+  NUMBER_SETTING("heartbeat",SETTING_ULONG,heartbeatPeriod,1,MAX_PERIOD,"seconds between reports in change mode",afterReportChange,NULL),
+  ACTION(MQTT_PAYLOAD_METRICS_COMMAND,metricsCommand,TOPIC_METRICS),
+  NUMBER_SETTING("metricsperiod",SETTING_ULONG,metricsPeriod,0,MAX_PERIOD,"seconds between metrics reports, 0 for none",NULL,"metricsPeriod"),
+  STRING_SETTING("netmask",STRING_NETMASK,ADDRESS_SIZE,"network IP mask",afterNetworkChange),
+  STRING_SETTING("pass",STRING_PASSWORD,PASSWORD_SIZE,"mqtt password",NULL),
+  {"persistentsession","1|0",SETTING_BOOL,offsetof(conf,persistentSession),0,0,1,NULL,0,afterMqttChange,NULL,-1},
+  NUMBER_SETTING("port",SETTING_INT,mqttBrokerPort,0,65535,"port number",NULL,NULL),
+  NUMBER_SETTING("pulsepin",SETTING_UINT8,pulsePin,0,15,"GPIO of the flow meter, 0 for none",afterPulsePin,NULL),
+  NUMBER_SETTING("pulsesperunit",SETTING_ULONG,pulsesPerUnit,1,LONG_MAX,"flow meter pulses per litre (or other unit)",NULL,NULL),
+  NUMBER_SETTING("queuedepth",SETTING_UINT16,queueDepth,1,MAX_QUEUE_DEPTH,"readings kept in flash while offline",afterQueueDepth,NULL),
+  CHOICE_SETTING("queuedrop",queueDropPolicy,queueDropNames,"oldest|newest",NULL),
+  ACTION(MQTT_PAYLOAD_REBOOT_COMMAND,rebootCommand,TOPIC_REBOOT_RESPONSE),
+  CHOICE_SETTING("reportmode",reportMode,reportModeNames,"periodic|change",afterReportChange),
+  NUMBER_SETTING("reportperiod",SETTING_ULONG,reportPeriod,0,MAX_PERIOD,"seconds between reports",afterReportChange,"reportPeriod"),
+  ACTION(MQTT_PAYLOAD_RESET_PULSE_COMMAND,resetPulseCommand,-1),
+  NUMBER_SETTING("sensors",SETTING_UINT8,sensorCount,1,SENSOR_MAX,"number of level sensors",afterSensors,NULL),
+  ACTION(MQTT_PAYLOAD_SETTINGS_COMMAND,settingsCommand,TOPIC_SETTINGS_RESPONSE),
+  NUMBER_SETTING("sleeptime",SETTING_ULONG,sleepTime,0,MAX_SLEEP_TIME,"seconds of deep sleep between reports, 0 to stay awake",afterSleepTime,NULL),
+  STRING_SETTING("ssid",STRING_SSID,SSID_SIZE,"wifi ssid",afterNetworkChange),
+  STRING_SETTING("staticaddress",STRING_STATIC_IP,ADDRESS_SIZE,"IP address",afterNetworkChange),
+  ACTION(MQTT_PAYLOAD_STATUS_COMMAND,statusCommand,TOPIC_STATUS_RESPONSE),
+  ACTION("timing",timingCommand,-1),
+  CHOICE_SETTING("tls",tlsMode,tlsModeNames,"off|fingerprint|ca, ca checks against " TLS_CA_FILE,afterMqttChange),
+  STRING_SETTING("topicroot",STRING_TOPIC_ROOT,MQTT_TOPIC_SIZE,"topic root",afterTopicRoot),
+  STRING_SETTING("user",STRING_USERNAME,USERNAME_SIZE,"mqtt user",NULL),
+  ACTION(MQTT_PAYLOAD_VERSION_COMMAND,versionCommand,TOPIC_VERSION_RESPONSE),
+  STRING_SETTING("wifipass",STRING_WIFI_PASSWORD,PASSWORD_SIZE,"wifi password",afterNetworkChange)
+  };
+#define COMMAND_COUNT ((int)(sizeof(commands)/sizeof(commands[0])))
+
+constexpr int constStrcmp(const char* a, const char* b)
+  {
+  return (*a!=*b || *a=='\0')?(*a-*b):constStrcmp(a+1,b+1);
+  }
+
+constexpr bool commandsSorted(int i)
+  {
+  return i>=COMMAND_COUNT-1 
+    || (constStrcmp(commands[i].name,commands[i+1].name)<0 && commandsSorted(i+1));
+  }
+static_assert(commandsSorted(0),"The command table must be sorted by name");
+
+/*
+ * Binary search the command table. Returns NULL if there's no such command.
+ */
+const command* findCommand(const char* name)
+  {
+  int low=0;
+  int high=COMMAND_COUNT-1;
+  while (low<=high)
+    {
+    int mid=(low+high)/2;
+    int cmp=strcmp(name,commands[mid].name);
+    if (cmp==0)
+      return &commands[mid];
+    else if (cmp<0)
+      high=mid-1;
+    else
+      low=mid+1;
+    }
+  return NULL;
+  }
+
+/*
+ * Put the current value of a setting into buf as text
+ */
+const char* formatSetting(const command* c, char* buf, size_t size)
+  {
+  void* field=(uint8_t*)&settings+c->offset;
+  switch (c->type)
+    {
+    case SETTING_STRING:
+      return settingString(c->offset);
+    case SETTING_INT:
+      snprintf(buf,size,"%d",*(int*)field);
+      break;
+    case SETTING_ULONG:
+      snprintf(buf,size,"%lu",*(unsigned long*)field);
+      break;
+    case SETTING_UINT16:
+      snprintf(buf,size,"%u",*(uint16_t*)field);
+      break;
+    case SETTING_UINT8:
+      snprintf(buf,size,"%u",*(uint8_t*)field);
+      break;
+    case SETTING_BOOL:
+      return *(bool*)field?"true":"false";
+    case SETTING_CHOICE:
+      return c->choices[*(uint8_t*)field];
+    default:
+      buf[0]='\0';
+    }
+  return buf;
+  }
+
+/*
+ * Check a new value for a setting and store it if it's good
+ */
+boolean applySetting(const command* c, const char* val)
+  {
+  void* field=(uint8_t*)&settings+c->offset;
+  char* end;
+  long number=strtol(val,&end,10);
+  boolean isNumber=(*end=='\0' || *end=='\r') && number>=c->minValue && number<=c->maxValue;
+
+  switch (c->type)
+    {
+    case SETTING_STRING:
+      if (strlen(val)>=c->size)
+        return false;
+      return setSettingString(c->offset,val);
+    case SETTING_INT:
+      if (!isNumber)
+        return false;
+      *(int*)field=number;
+      return true;
+    case SETTING_ULONG:
+      if (!isNumber)
+        return false;
+      *(unsigned long*)field=number;
+      return true;
+    case SETTING_UINT16:
+      if (!isNumber)
+        return false;
+      *(uint16_t*)field=number;
+      return true;
+    case SETTING_UINT8:
+      if (!isNumber)
+        return false;
+      *(uint8_t*)field=number;
+      return true;
+    case SETTING_BOOL:
+      if (!isNumber)
+        return false;
+      *(bool*)field=number==1;
+      return true;
+    case SETTING_CHOICE:
+      for (int i=0;i<c->choiceCount;i++)
+        {
+        if (strcmp(val,c->choices[i])==0)
+          {
+          *(uint8_t*)field=i;
+          return true;
+          }
+        }
+      return false;
+    }
+  return false;
+  }
+
+void showSettings()
+  {
+  char buf[12];
+  try
+    {  
+    for (int i=0;i<COMMAND_COUNT;i++)
+      {
+      const command* c=&commands[i];
+      if (c->type==SETTING_NONE)
+        continue;
+      Serial.print(c->name);
+      Serial.print("=<");
+      Serial.print(c->help);
+      Serial.print("> (");
+      Serial.print(formatSetting(c,buf,sizeof(buf)));
+      Serial.println(")");
+      }
+    Serial.print("MQTT Client ID is ");
+    Serial.println(settingString(STRING_CLIENT_ID));
+    Serial.print("Settings are");
+    Serial.print(settingsAreValid?"":" not");
+    Serial.println(" valid.");
+    Serial.println("\n*** Use \"factorydefaults=yes\" to reset all settings ***");
+    Serial.println("*** Use \"timing=yes\" to show execution time statistics ***\n");
+    }
+  catch(const std::exception& e)
+    {
+    failure=true;
+    Serial.println("******************* ERROR ************");
+    Serial.println(e.what());
+    }
+
+  }
+
+/*
+ * Carry out a command from the serial port or MQTT.  A command is either a bare name
+ * like "status" or name=value.  The command is modified in place.  Returns the 
+ * response text, NULL if the command wasn't valid, or "" if there's nothing more to 
+ * send.  If matched isn't NULL it's set to the command table entry.
+ */
+const char* processCommand(char* cmd, boolean fromMqtt, const command** matched=NULL)
+  {
+  //Get rid of the carriage return
+  size_t len=strlen(cmd);
+  if (len>0 && cmd[len-1]==13)
+    cmd[len-1]=0; 
+
+  const char* val=NULL;
+  char* eq=strchr(cmd,'=');
+  if (eq!=NULL)
+    {
+    *eq='\0';
+    val=eq+1;
+    }
+
+  const command* c=findCommand(cmd);
+  if (matched!=NULL)
+    *matched=c;
+  if (c==NULL) //invalid command
+    {
+    if (!fromMqtt)
+      showSettings();
+    return NULL;
+    }
+
+  if (c->type==SETTING_NONE)
+    return c->handler(val,fromMqtt);
+
+  if (val==NULL || strlen(val)==0)
+    {
+    if (!fromMqtt)
+      showSettings();
+    return NULL;   //bad or missing value
+    }
+  if (strcmp(val,"null")==0) //they want to reset a value
+    val="";
+
+  if (!applySetting(c,val))
+    {
+    if (!fromMqtt)
+      showSettings();
+    return NULL;
+    }
+  const char* response=c->handler!=NULL?c->handler(val,fromMqtt):"OK";
+  saveSettings();
+  return response;
+  }
+  
+/*
+ * Check for configuration input via the serial port and carry out the command
+ * when a complete line has arrived.
+ */
+void checkForCommand()
+  {
+  char* cmd=serialLine.poll(Serial);
+  if (serialLine.overflowed())
+    {
+    Serial.print("Command too long, the limit is ");
+    Serial.print(SERIAL_COMMAND_SIZE-1);
+    Serial.println(" characters");
+    }
+  if (cmd!=NULL)
+    {
+    Serial.println(cmd);
+    unsigned long start=micros();
+    const char* response=processCommand(cmd,false);
+    recordTiming(TIMING_PROCESS_COMMAND,start);
+    if (response!=NULL && strlen(response)>0)
+      Serial.println(response);
+    serialLine.next();
+    }
+  }
+
+/*
+ * The broker connection is made by a state machine stepped by the mqtt task, one 
+ * phase per step: TCP connection, then CONNECT/CONNACK, then SUBSCRIBE/SUBACK.  
+ * Each phase has its own short timeout so the loop is never held up for long.  
+ * After a failure, or losing the connection, we wait before trying again.  The 
+ * wait doubles with each failure up to MQTT_BACKOFF_MAX, and is then spread over 
+ * its upper half by a random number seeded from the client ID, so a fleet of 
+ * devices doesn't all come back at the same moment after the broker restarts.
+ */
+enum {MQTT_STATE_IDLE, MQTT_STATE_TCP, MQTT_STATE_CONNECT, MQTT_STATE_SUBSCRIBING, MQTT_STATE_CONNECTED, MQTT_STATE_BACKOFF};
+const char* mqttStateNames[]={"idle","tcp","connect","subscribing","connected","backoff"};
+int mqttState=MQTT_STATE_IDLE;
+unsigned long mqttPhaseStart=0;   //millis() when the current phase began
+unsigned long mqttBackoffMillis=0;
+uint8_t mqttFailures=0;           //in a row
+uint32_t mqttJitterSeed=0;
+unsigned long subscribeStart=0;   //micros() when the SUBSCRIBE was sent
+
+void setMqttState(int newState)
+  {
+  if (settings.debug)
+    {
+    Serial.print("MQTT state ");
+    Serial.print(mqttStateNames[mqttState]);
+    Serial.print(" -> ");
+    Serial.println(mqttStateNames[newState]);
+    }
+  mqttState=newState;
+  mqttPhaseStart=millis();
+  }
+
+/*
+ * A random number that's different on each device, from a xorshift generator
+ * seeded with the CRC of the client ID.
+ */
+uint32_t mqttJitter()
+  {
+  if (mqttJitterSeed==0)
+    mqttJitterSeed=crc32((const uint8_t*)settingString(STRING_CLIENT_ID),settings.stringLength[STRING_CLIENT_ID])|1;
+  mqttJitterSeed^=mqttJitterSeed<<13;
+  mqttJitterSeed^=mqttJitterSeed>>17;
+  mqttJitterSeed^=mqttJitterSeed<<5;
+  return mqttJitterSeed;
+  }
+
+/*
+ * The broker and its backups, each with a health score.  The score is the time
+ * it takes to connect plus a penalty for the share of recent connection attempts
+ * and publishes that failed, both smoothed so that one slow connection doesn't
+ * move it much.  The primary broker is used whenever it's up.  When it has
+ * failed MQTT_BROKER_DOWN_AFTER times in a row we move to the backup with the
+ * best score, and while connected to a backup we check every MQTT_FAILBACK_PROBE
+ * seconds whether the primary will take a TCP connection again.
+ */
+typedef struct
+  {
+  uint8_t hostAt;           //where the backup's name starts in backupBrokerNames
+  uint16_t port;            //0 for the primary's port
+  uint32_t latency;         //milliseconds to connect, smoothed, 0 until it's been measured
+  uint16_t errors;          //per mille of attempts and publishes that failed, smoothed
+  uint8_t failures;         //connection attempts in a row that failed
+  unsigned long lastFailure; //millis()
+  } mqttBroker;
+
+mqttBroker brokers[MQTT_BROKER_MAX];
+uint8_t brokerCount=1;
+uint8_t currentBroker=0;
+char backupBrokerNames[MQTT_BACKUP_BROKERS_SIZE];
+unsigned long brokerConnectStart=0; //millis() when the connection attempt began
+unsigned long lastFailbackProbe=0;
+boolean failbackProbeNext=false; //carry on with the probe on the next step
+IPAddress failbackAddress;       //the primary's, looked up for that step
+
+/*
+ * Split the backup broker list into names and ports.  Returns false, leaving the
+ * list as it was, if it's not valid.
+ */
+boolean parseBrokers(const char* text)
+  {
+  char names[MQTT_BACKUP_BROKERS_SIZE];
+  mqttBroker list[MQTT_BROKER_MAX];
+  uint8_t n=1; //the primary is first
+  strncpy(names,text,sizeof(names)-1);
+  names[sizeof(names)-1]='\0';
+  memset(list,0,sizeof(list));
+  char* p=names;
+  while (*p)
+    {
+    char* end=strchr(p,',');
+    if (end!=NULL)
+      *end='\0';
+    char* colon=strchr(p,':');
+    if (colon==p || *p=='\0' || n==MQTT_BROKER_MAX)
+      return false;
+    if (colon!=NULL)
+      {
+      char* portEnd;
+      long port=strtol(colon+1,&portEnd,10);
+      if (*portEnd!='\0' || port<1 || port>65535)
+        return false;
+      *colon='\0';
+      list[n].port=port;
+      }
+    list[n].hostAt=p-names;
+    n++;
+    p=end!=NULL?end+1:p+strlen(p);
+    }
+  memcpy(backupBrokerNames,names,sizeof(names));
+  memcpy(brokers,list,sizeof(list));
+  brokerCount=n;
+  currentBroker=0;
+  return true;
+  }
+
+const char* brokerHost(uint8_t i=currentBroker)
+  {
+  return i==0?settingString(STRING_BROKER):backupBrokerNames+brokers[i].hostAt;
+  }
+
+uint16_t brokerPort(uint8_t i=currentBroker)
+  {
+  return brokers[i].port!=0?brokers[i].port:settings.mqttBrokerPort;
+  }
+
+uint32_t brokerScore(uint8_t i)
+  {
+  return brokers[i].latency+(uint32_t)brokers[i].errors*MQTT_ERROR_PENALTY/1000;
+  }
+
+boolean brokerHealthy(uint8_t i)
+  {
+  return brokers[i].failures<MQTT_BROKER_DOWN_AFTER;
+  }
+
+/*
+ * The primary if it's up, otherwise the healthy backup with the best score.  If
+ * they're all down, the one that failed longest ago, so each gets its turn.
+ */
+uint8_t chooseBroker()
+  {
+  if (brokerHealthy(0))
+    return 0;
+  int best=-1;
+  for (uint8_t i=1;i<brokerCount;i++)
+    if (brokerHealthy(i) && (best<0 || brokerScore(i)<brokerScore(best)))
+      best=i;
+  if (best>=0)
+    return best;
+  best=0;
+  for (uint8_t i=1;i<brokerCount;i++)
+    if (millis()-brokers[i].lastFailure > millis()-brokers[best].lastFailure)
+      best=i;
+  return best;
+  }
+
+void selectBroker()
+  {
+  uint8_t choice=chooseBroker();
+  if (choice!=currentBroker)
+    {
+    Serial.print("Moving to MQTT broker ");
+    Serial.println(brokerHost(choice));
+    counters[COUNTER_BROKER_FAILOVERS]++;
+    currentBroker=choice;
+    lastFailbackProbe=millis();
+    failbackProbeNext=false;
+    }
+  brokerConnectStart=millis();
+  }
+
+/*
+ * Fold a failed (1000) or successful (0) outcome into the broker's error rate
+ */
+void brokerOutcome(uint8_t i, uint16_t failed)
+  {
+  brokers[i].errors=brokers[i].errors-(brokers[i].errors>>MQTT_HEALTH_SHIFT)+(failed>>MQTT_HEALTH_SHIFT);
+  }
+
+void brokerFailed()
+  {
+  mqttBroker* b=&brokers[currentBroker];
+  if (b->failures<255)
+    b->failures++;
+  b->lastFailure=millis();
+  brokerOutcome(currentBroker,1000);
+  }
+
+void brokerConnected()
+  {
+  mqttBroker* b=&brokers[currentBroker];
+  long took=millis()-brokerConnectStart;
+  if (b->latency==0)
+    b->latency=took>0?took:1;
+  else
+    b->latency+=(took-(long)b->latency)>>MQTT_HEALTH_SHIFT;
+  b->failures=0;
+  brokerOutcome(currentBroker,0);
+  }
+
+/*
+ * Only publishes that the broker was connected for count against it
+ */
+void brokerPublished(boolean ok)
+  {
+  brokerOutcome(currentBroker,ok?0:1000);
+  }
+
+/*
+ * See if the primary broker will take a TCP connection.  That doesn't prove it
+ * will take an MQTT connection, but if it won't we move to a backup again after
+ * MQTT_BROKER_DOWN_AFTER tries.  This runs on the mqtt task while connected to a
+ * backup, so each step waits MQTT_PROBE_TIMEOUT at most.  If the primary's name
+ * has to be looked up, this step looks it up and the next one tries the connection.
+ * The address isn't cached, since RTC memory holds the backup's while it's in use.
+ */
+boolean primaryIsBack()
+  {
+  IPAddress address;
+  if (failbackProbeNext)
+    {
+    failbackProbeNext=false;
+    address=failbackAddress;
+    }
+  else if (!address.fromString(brokerHost(0)))
+    {
+    failbackProbeNext=WiFi.hostByName(brokerHost(0),failbackAddress,MQTT_PROBE_TIMEOUT)==1;
+    return false;
+    }
+  WiFiClient probe;
+  probe.setTimeout(MQTT_PROBE_TIMEOUT);
+  boolean up=probe.connect(address,brokerPort(0));
+  probe.stop();
+  return up;
+  }
+
+/*
+ * Drop what's left of a connection attempt and wait before the next one
+ */
+void mqttBackoff(const char* why)
+  {
+  if (why!=NULL)
+    {
+    counters[COUNTER_MQTT_FAILURES]++;
+    if (mqttFailures<255)
+      mqttFailures++;
+    brokerFailed();
+    Serial.print(why);
+    Serial.print(" rc=");
+    Serial.println(mqttClient.state());
+    }
+  netClient->stop();
+  unsigned long wait=MQTT_BACKOFF_MAX;
+  if (chooseBroker()!=currentBroker)
+    wait=MQTT_BACKOFF_MIN; //a different broker is next, no need to wait for this one
+  else if (mqttFailures<16 && (MQTT_BACKOFF_MIN<<mqttFailures)<MQTT_BACKOFF_MAX)
+    wait=MQTT_BACKOFF_MIN<<mqttFailures;
+  mqttBackoffMillis=wait/2+mqttJitter()%(wait/2+1);
+  if (settings.debug)
+    {
+    Serial.print("Next MQTT attempt in ");
+    Serial.print(mqttBackoffMillis);
+    Serial.println("ms");
+    }
+  setMqttState(MQTT_STATE_BACKOFF);
+  }
+
+/*
+ * The broker's address from the last time its name was looked up, if that isn't
+ * older than MQTT_DNS_TTL.  It's kept in RTC memory so that waking from deep sleep
+ * doesn't need a lookup.
+ */
+uint32_t brokerNameCrc()
+  {
+  return crc32((const uint8_t*)brokerHost(),strlen(brokerHost()))|1;
+  }
+
+boolean cachedBrokerAddress(IPAddress& address)
+  {
+  if (rtc.brokerNameCrc!=brokerNameCrc() || deviceSeconds()-rtc.brokerLookedUp >= MQTT_DNS_TTL)
+    return false;
+  address=rtc.brokerIP;
+  return true;
+  }
+
+void cacheBrokerAddress(IPAddress address)
+  {
+  rtc.brokerIP=address;
+  rtc.brokerLookedUp=deviceSeconds();
+  rtc.brokerNameCrc=brokerNameCrc();
+  saveRtc();
+  }
+
+/*
+ * Look the name up again next time, in case the broker has moved
+ */
+void forgetBrokerAddress()
+  {
+  if (rtc.brokerNameCrc!=0)
+    {
+    rtc.brokerNameCrc=0;
+    saveRtc();
+    }
+  }
+
+/*
+ * Seconds of keepalive.  We send something at least once per report interval, so
+ * there's no need for the client to ping more often than that.
+ */
+uint16_t mqttKeepAlive()
+  {
+  unsigned long seconds=reportInterval()/1000+MQTT_KEEPALIVE_MARGIN;
+  if (seconds<MQTT_KEEPALIVE_MIN)
+    return MQTT_KEEPALIVE_MIN;
+  if (seconds>MQTT_KEEPALIVE_MAX)
+    return MQTT_KEEPALIVE_MAX;
+  return seconds;
+  }
+
+/*
+ * MQTT over TLS, with BearSSL.  The broker's certificate is checked either against
+ * a SHA1 fingerprint in the settings or against the CA certificates in TLS_CA_FILE.
+ * A full handshake takes seconds of CPU, so the TLS session is kept in RTC memory
+ * and resumed on the next connection, even after deep sleep.  BearSSL's receive 
+ * buffer has to hold a whole TLS record, 16k unless the broker agrees to smaller
+ * ones.  Whether it does is found out once for each broker and remembered in RTC
+ * memory too, since finding out takes a handshake of its own.  The handshake runs
+ * inside the mqtt task and can't be split up, so the other tasks wait for it, a
+ * second or two for a full one and much less for a resumed one, plus the broker's
+ * answers.  Sensor edges are still caught by the interrupt meanwhile.
+ * Checking a certificate against a CA needs the time of day, which comes from SNTP
+ * and is then kept as an offset from the device clock.
+ */
+BearSSL::Session tlsSession;
+BearSSL::X509List* tlsTrustAnchors=NULL;
+boolean tlsJustProbed=false; //the record size was found out for this connection attempt
+boolean sntpStarted=false;
+
+static_assert(sizeof(BearSSL::Session)<=TLS_SESSION_SIZE, "TLS_SESSION_SIZE is too small for a BearSSL::Session");
+
+/*
+ * Unix time, or 0 if we don't know it yet
+ */
+time_t tlsTime()
+  {
+  if (!sntpStarted)
+    {
+    configTime(0,0,TLS_NTP_SERVER);
+    sntpStarted=true;
+    }
+  time_t now=time(NULL);
+  if (now>TLS_MIN_TIME)
+    {
+    uint32_t offset=now-deviceSeconds();
+    if (offset-rtc.unixOffset+TLS_CLOCK_DRIFT > 2*TLS_CLOCK_DRIFT) //only save it if it's moved much
+      {
+      rtc.unixOffset=offset;
+      saveRtc();
+      }
+    return now;
+    }
+  if (rtc.unixOffset!=0)
+    return rtc.unixOffset+deviceSeconds();
+  return 0;
+  }
+
+void forgetTrustAnchors()
+  {
+  delete tlsTrustAnchors;
+  tlsTrustAnchors=NULL;
+  }
+
+/*
+ * Read the CA certificates, once
+ */
+boolean loadTrustAnchors()
+  {
+  if (tlsTrustAnchors!=NULL)
+    return true;
+  File f=LittleFS.open(TLS_CA_FILE,"r");
+  if (!f)
+    {
+    Serial.println("No " TLS_CA_FILE " to check the broker's certificate with.");
+    return false;
+    }
+  size_t size=f.size();
+  char* pem=(char*)malloc(size+1);
+  if (pem==NULL)
+    return false;
+  pem[f.read((uint8_t*)pem,size)]='\0';
+  f.close();
+  tlsTrustAnchors=new BearSSL::X509List(pem);
+  free(pem);
+  return true;
+  }
+
+uint32_t tlsBrokerKey()
+  {
+  uint16_t port=brokerPort();
+  return crc32((const uint8_t*)&port,sizeof(port),brokerNameCrc())|1;
+  }
+
+/*
+ * Get the client for the broker connection ready, plain or TLS.  Returns false if
+ * TLS can't be set up.
+ */
+boolean useTransport(IPAddress brokerIP)
+  {
+  if (settings.tlsMode==TLS_OFF)
+    {
+    netClient=&plainClient;
+    netSession=&plainClient;
+    mqttClient.setClient(plainClient);
+    plainClient.setTimeout(MQTT_TCP_TIMEOUT);
+    return true;
+    }
+  netClient=&tlsClient;
+  netSession=&tlsClient;
+  mqttClient.setClient(tlsClient);
+  tlsClient.setTimeout(TLS_HANDSHAKE_TIMEOUT);
+
+  if (settings.tlsMode==TLS_FINGERPRINT)
+    {
+    if (!tlsClient.setFingerprint(settingString(STRING_TLS_FINGERPRINT)))
+      {
+      Serial.println("The TLS fingerprint isn't valid.");
+      return false;
+      }
+    }
+  else
+    {
+    if (!loadTrustAnchors())
+      return false;
+    tlsClient.setTrustAnchors(tlsTrustAnchors);
+    tlsClient.setX509Time(tlsTime());
+    }
+
+  uint32_t key=tlsBrokerKey();
+  if (rtc.tlsBrokerKey!=key)
+    {
+    rtc.tlsBrokerKey=key;
+    rtc.tlsSessionValid=0;
+    rtc.tlsFragment=TLS_FRAGMENT_UNKNOWN;
+    }
+  tlsJustProbed=rtc.tlsFragment==TLS_FRAGMENT_UNKNOWN;
+  if (tlsJustProbed)
+    {
+    boolean small=BearSSL::WiFiClientSecure::probeMaxFragmentLength(brokerIP,brokerPort(),TLS_RX_BUFFER_SIZE);
+    rtc.tlsFragment=small?TLS_FRAGMENT_SMALL:TLS_FRAGMENT_FULL;
+    if (settings.debug && !small)
+      Serial.println("The broker won't use small TLS records, so it needs a 16k buffer.");
+    saveRtc();
+    }
+  tlsClient.setBufferSizes(rtc.tlsFragment==TLS_FRAGMENT_SMALL?TLS_RX_BUFFER_SIZE:TLS_FULL_RX_BUFFER_SIZE,
+                           TLS_TX_BUFFER_SIZE);
+
+  if (rtc.tlsSessionValid)
+    memcpy((void*)&tlsSession,rtc.tlsSession,sizeof(tlsSession));
+  else
+    tlsSession=BearSSL::Session();
+  tlsClient.setSession(&tlsSession);
+  return true;
+  }
+
+/*
+ * Note how the handshake went, and keep the session for next time
+ */
+void tlsConnected(uint32_t heapBefore)
+  {
+  uint32_t heap=ESP.getFreeHeap();
+  if (heap<minFreeHeap)
+    minFreeHeap=heap;
+  tlsHeapUsed=heapBefore>heap?heapBefore-heap:0;
+  if (tlsHeapUsed>tlsHeapPeak)
+    tlsHeapPeak=tlsHeapUsed;
+
+  // A resumed session keeps its ID and master secret, a new one doesn't
+  if (rtc.tlsSessionValid && memcmp(rtc.tlsSession,(const void*)&tlsSession,sizeof(tlsSession))==0)
+    counters[COUNTER_TLS_RESUMED]++;
+  else
+    {
+    counters[COUNTER_TLS_HANDSHAKES]++;
+    memcpy(rtc.tlsSession,(const void*)&tlsSession,sizeof(tlsSession));
+    rtc.tlsSessionValid=1;
+    saveRtc();
+    }
+  }
+
+/*
+ * Start over with a full handshake.  What the broker said about record sizes is
+ * kept, unless it was asked on this attempt and may not have been there to answer.
+ */
+void tlsConnectFailed()
+  {
+  rtc.tlsSessionValid=0;
+  if (tlsJustProbed)
+    rtc.tlsFragment=TLS_FRAGMENT_UNKNOWN;
+  saveRtc();
+  }
+
+/*
+ * Identifies the command topic on this broker, so we know whether the session the
+ * broker resumes is subscribed to it or to one from before the topic root changed
+ */
+uint32_t commandSubscriptionKey()
+  {
+  const char* topic=topics[TOPIC_COMMAND].name;
+  return crc32((const uint8_t*)topic,topics[TOPIC_COMMAND].length,tlsBrokerKey())|1;
+  }
+
+/*
+ * True while a connection attempt is under way
+ */
+boolean mqttConnecting()
+  {
+  return mqttState==MQTT_STATE_TCP || mqttState==MQTT_STATE_CONNECT || mqttState==MQTT_STATE_SUBSCRIBING;
+  }
+
+/*
+ * Take the next step towards being connected to the broker
+ */
+void stepMqttConnection()
+  {
+  if (!settingsAreValid || WiFi.status()!=WL_CONNECTED) //don't bother
+    {
+    if (mqttState!=MQTT_STATE_IDLE)
+      {
+      netClient->stop();
+      setMqttState(MQTT_STATE_IDLE); //start right away when the network is back
+      }
+    return;
+    }
+
+  switch (mqttState)
+    {
+    case MQTT_STATE_BACKOFF:
+      if (millis()-mqttPhaseStart < mqttBackoffMillis)
+        break;
+      // fall through
+
+    case MQTT_STATE_IDLE:
+      selectBroker();
+      setMqttState(MQTT_STATE_TCP);
+      break;
+
+    case MQTT_STATE_TCP:
+      {
+      if (settings.tlsMode==TLS_CA && tlsTime()==0)
+        {
+        if (millis()-mqttPhaseStart < TLS_TIME_WAIT)
+          break; //look again on the next step
+        mqttBackoff("Don't know the time, so can't check the broker's certificate.");
+        break;
+        }
+      if (settings.debug)
+        Serial.println("\nAttempting MQTT connection...");
+      unsigned long start=micros();
+      IPAddress brokerIP;
+      if (!brokerIP.fromString(brokerHost()) && !cachedBrokerAddress(brokerIP))
+        {
+        if (WiFi.hostByName(brokerHost(),brokerIP,MQTT_DNS_TIMEOUT)!=1)
+          {
+          mqttBackoff("Unable to look up the MQTT broker.");
+          break;
+          }
+        cacheBrokerAddress(brokerIP);
+        }
+      if (!useTransport(brokerIP))
+        {
+        mqttBackoff("Unable to set up TLS.");
+        break;
+        }
+      uint32_t heapBefore=ESP.getFreeHeap();
+      if (!netClient->connect(brokerIP,brokerPort()))
+        {
+        forgetBrokerAddress();
+        if (settings.tlsMode!=TLS_OFF)
+          tlsConnectFailed();
+        mqttBackoff("Unable to reach the MQTT broker.");
+        break;
+        }
+      if (settings.tlsMode!=TLS_OFF)
+        {
+        recordTiming(TIMING_MQTT_TLS,start);
+        tlsConnected(heapBefore);
+        }
+      else
+        recordTiming(TIMING_MQTT_TCP,start);
+      mqttClient.setServer(brokerIP,brokerPort());
+      setMqttState(MQTT_STATE_CONNECT);
+      break;
+      }
+
+    case MQTT_STATE_CONNECT:
+      {
+      mqttClient.setBufferSize(JSON_STATUS_SIZE);
+      mqttClient.setCallback(incomingMqttHandler);
+      mqttClient.setSocketTimeout(MQTT_CONNACK_TIMEOUT);
+      mqttClient.setKeepAlive(mqttKeepAlive());
+
+      // The TCP connection is already up, so this just sends CONNECT and waits for CONNACK
+      unsigned long start=micros();
+      netSession->expectConnack();
+      if (!mqttClient.connect(settingString(STRING_CLIENT_ID),settingString(STRING_USERNAME),settingString(STRING_PASSWORD),
+                              NULL,0,false,NULL, //no will
+                              !settings.persistentSession))
+        {
+        forgetBrokerAddress();
+        mqttBackoff("MQTT connection refused or timed out.");
+        break;
+        }
+      recordTiming(TIMING_MQTT_CONNACK,start);
+      brokerConnected();
+      counters[COUNTER_MQTT_CONNECTS]++;
+      if (settings.debug)
+        Serial.println("connected to MQTT broker.");
+
+      // The broker still has our subscription from last time
+      if (settings.persistentSession && netSession->sessionPresent()
+          && rtc.subscriptionKey==commandSubscriptionKey())
+        {
+        if (settings.debug)
+          Serial.println("Resuming the MQTT session.");
+        mqttFailures=0;
+        setMqttState(MQTT_STATE_CONNECTED);
+        break;
+        }
+
+      // Subscribe to the incoming message topics.  At QoS 1 in a persistent session
+      // the broker holds commands for us while we are away.
+      subscribeStart=micros();
+      if (!mqttClient.subscribe(topics[TOPIC_COMMAND].name,settings.persistentSession?1:0))
+        {
+        Serial.print("Unable to subscribe to ");
+        Serial.println(topics[TOPIC_COMMAND].name);
+        mqttClient.disconnect();
+        mqttBackoff("Subscribe failed.");
+        break;
+        }
+      showSub(topics[TOPIC_COMMAND].name);
+      setMqttState(MQTT_STATE_SUBSCRIBING);
+      break;
+      }
+
+    case MQTT_STATE_SUBSCRIBING:
+      // PubSubClient doesn't tell us about the SUBACK, but mqttClient.loop() always
+      // reads whole packets, so the next unread byte is the start of a packet.
+      if (!mqttClient.connected())
+        mqttBackoff("Lost the MQTT connection while subscribing.");
+      else if (netClient->available()>0 && netClient->peek()==MQTT_SUBACK_HEADER)
+        {
+        recordTiming(TIMING_MQTT_SUBACK,subscribeStart);
+        if (rtc.subscriptionKey!=commandSubscriptionKey())
+          {
+          rtc.subscriptionKey=commandSubscriptionKey();
+          saveRtc();
+          }
+        mqttFailures=0;
+        setMqttState(MQTT_STATE_CONNECTED);
+        }
+      else if (millis()-mqttPhaseStart > MQTT_CONNACK_TIMEOUT*1000UL)
+        {
+        Serial.println("No SUBACK from the MQTT broker, carrying on anyway.");
+        mqttFailures=0;
+        setMqttState(MQTT_STATE_CONNECTED);
+        }
+      break;
+
+    case MQTT_STATE_CONNECTED:
+      if (!mqttClient.connected())
+        {
+        if (settings.debug)
+          Serial.println("Lost the MQTT connection.");
+        mqttBackoff(NULL); //the broker may be restarting, so don't all rush back
+        }
+      else if (currentBroker!=0 
+          && (failbackProbeNext || millis()-lastFailbackProbe >= MQTT_FAILBACK_PROBE*1000UL))
+        {
+        lastFailbackProbe=millis();
+        if (primaryIsBack())
+          {
+          Serial.println("The primary MQTT broker is back, moving to it.");
+          brokers[0].failures=0;
+          counters[COUNTER_BROKER_FAILBACKS]++;
+          mqttClient.disconnect();
+          netClient->stop();
+          setMqttState(MQTT_STATE_IDLE);
+          }
+        }
+      break;
+    }
+  }
+
+boolean publish(const char* topic, const char* reading, bool retain)
+  {
+  Serial.print(topic);
+  Serial.print(" ");
+  Serial.println(reading);
+  boolean ok=false;
+  if (mqttClient.connected())
+    {
+    unsigned long start=micros();
+    ok=mqttClient.publish(topic,reading,retain);
+    recordTiming(TIMING_PUBLISH,start);
+    brokerPublished(ok);
+    lastRadioActivity=millis();
+    }
+  counters[ok?COUNTER_PUBLISHES:COUNTER_PUBLISH_FAILURES]++;
+  return ok;
+  }
+
+/*
+ * Publish a JSON payload without building it in memory first.  The build function
+ * is run once to measure the payload, then again to stream it straight into the 
+ * MQTT client.  It must write the same thing both times.
+ */
+template <typename Builder>
+boolean publishJson(const char* topic, Builder build, bool retain)
+  {
+  JsonWriter counter;
+  build(counter);
+
+  Serial.print(topic);
+  Serial.print(" ");
+  JsonWriter echo(&Serial);
+  build(echo);
+  echo.end();
+  Serial.println();
+
+  unsigned long start=micros();
+  if (!mqttClient.connected() || !mqttClient.beginPublish(topic,counter.length(),retain))
+    {
+    counters[COUNTER_PUBLISH_FAILURES]++;
+    return false;
+    }
+  JsonWriter out(&mqttClient);
+  build(out);
+  out.end();
+  boolean ok=mqttClient.endPublish()==1 && out.length()==counter.length();
+  recordTiming(TIMING_PUBLISH,start);
+  brokerPublished(ok);
+  lastRadioActivity=millis();
+  counters[ok?COUNTER_PUBLISHES:COUNTER_PUBLISH_FAILURES]++;
+  return ok;
+  }
+
+/*
+ * The publish pipeline.  Messages that don't have to go out this instant, command
+ * responses mostly, are put here and sent from the publish task one at a time, so
+ * the MQTT client keeps being serviced in between.  A message is finished when the
+ * broker's TCP stack has acknowledged it, found by polling flush() with a wait of
+ * PUBLISH_ACK_POLL, rather than by sleeping for long enough.  The topic and the 
+ * payload are kept together in a fixed size slot, each null terminated.
+ */
+typedef struct
+  {
+  uint32_t queuedMicros;   //when it was put in the pipeline
+  uint32_t sentMicros;     //when it was written to the socket, 0 until then
+  uint16_t topicLength;
+  boolean retain;
+  char text[PUBLISH_SLOT_SIZE];
+  } pendingPublish;
+
+pendingPublish publishPipeline[PUBLISH_PIPELINE_DEPTH];
+uint8_t publishHead=0;     //the oldest message
+uint8_t publishCount=0;
+
+/*
+ * Put a message in the pipeline.  One that is too big for a slot is sent right 
+ * away instead.  Returns false if it couldn't be sent or queued.
+ */
+boolean queuePublish(const char* topic, const char* payload, bool retain)
+  {
+  size_t topicLength=strlen(topic);
+  size_t payloadLength=strlen(payload);
+  if (topicLength+payloadLength+2>PUBLISH_SLOT_SIZE)
+    return publish(topic,payload,retain);
+  if (publishCount==PUBLISH_PIPELINE_DEPTH)
+    {
+    counters[COUNTER_PUBLISH_DROPPED]++;
+    return false;
+    }
+  pendingPublish* m=&publishPipeline[(publishHead+publishCount)%PUBLISH_PIPELINE_DEPTH];
+  m->queuedMicros=micros();
+  m->sentMicros=0;
+  m->topicLength=topicLength;
+  m->retain=retain;
+  memcpy(m->text,topic,topicLength+1);
+  memcpy(m->text+topicLength+1,payload,payloadLength+1);
+  publishCount++;
+  tasks[TASK_PUBLISH].enabled=true;
+  return true;
+  }
+
+void finishPublish()
+  {
+  publishHead=(publishHead+1)%PUBLISH_PIPELINE_DEPTH;
+  publishCount--;
+  }
+
+/*
+ * Send the oldest message, or see whether it has been acknowledged yet
+ */
+void stepPublishPipeline()
+  {
+  if (publishCount==0)
+    {
+    tasks[TASK_PUBLISH].enabled=false;
+    return;
+    }
+  pendingPublish* m=&publishPipeline[publishHead];
+  if (!mqttClient.connected()) //they're only responses, so don't keep them for later
+    {
+    counters[COUNTER_PUBLISH_FAILURES]++;
+    finishPublish();
+    return;
+    }
+
+  if (m->sentMicros==0)
+    {
+    if (!publish(m->text,m->text+m->topicLength+1,m->retain))
+      {
+      finishPublish();
+      return;
+      }
+    m->sentMicros=micros()|1; //never 0
+    recordElapsed(TIMING_PUBLISH_WIRE,m->sentMicros-m->queuedMicros);
+    }
+
+  if (netClient->flush(PUBLISH_ACK_POLL))
+    recordElapsed(TIMING_PUBLISH_ACKED,micros()-m->queuedMicros);
+  else if (micros()-m->sentMicros < PUBLISH_ACK_TIMEOUT*1000UL)
+    return; //try again next time
+  else
+    counters[COUNTER_PUBLISH_UNACKED]++;
+  finishPublish();
+  }
+
+/*
+ * Write an IP address into a buffer without using String
+ */
+char* ipToString(IPAddress ip, char* buf, size_t size)
+  {
+  snprintf(buf,size,"%u.%u.%u.%u",ip[0],ip[1],ip[2],ip[3]);
+  return buf;
+  }
+
+/*
+ * All of the user settings, for the "settings" command
+ */
+void buildSettingsJson(JsonWriter& json)
+  {
+  char buf[16];
+  json.beginObject();
+  for (int i=0;i<COMMAND_COUNT;i++)
+    {
+    const command* c=&commands[i];
+    const char* name=c->jsonName!=NULL?c->jsonName:c->name;
+    if (c->type==SETTING_NONE)
+      continue;
+    else if (c->type==SETTING_INT) //the port has always been sent as a number, the rest as strings
+      json.addLong(name,*(int*)((uint8_t*)&settings+c->offset));
+    else
+      json.addString(name,formatSetting(c,buf,sizeof(buf)));
+    }
+  json.addString("mqttClientId",settingString(STRING_CLIENT_ID));
+  json.addString("localIP",ipToString(WiFi.localIP(),buf,sizeof(buf)));
+  json.endObject();
+  }
+
+metricsSnapshot takeMetricsSnapshot()
+  {
+  metricsSnapshot now;
+  now.uptime=millis()/1000;
+  now.freeHeap=ESP.getFreeHeap();
+  now.maxFreeBlock=ESP.getMaxFreeBlockSize();
+  now.heapFragmentation=ESP.getHeapFragmentation();
+  now.rssi=WiFi.RSSI();
+  return now;
+  }
+
+/*
+ * Everything in the metrics registry, for the metrics command.  Times are in 
+ * microseconds and each histogram bucket b counts times from 2^(b-1) to 2^b-1.
+ */
+void buildMetricsJson(JsonWriter& json, const metricsSnapshot& now)
+  {
+  json.beginObject();
+  json.addUnsigned("uptime",now.uptime);
+  json.addUnsigned("freeHeap",now.freeHeap);
+  json.addUnsigned("minFreeHeap",minFreeHeap);
+  json.addUnsigned("maxFreeBlock",now.maxFreeBlock);
+  json.addUnsigned("heapFragmentation",now.heapFragmentation);
+  if (settings.tlsMode!=TLS_OFF)
+    {
+    json.addUnsigned("tlsHeapUsed",tlsHeapUsed);
+    json.addUnsigned("tlsHeapPeak",tlsHeapPeak);
+    }
+  json.addLong("rssi",now.rssi);
+  json.addUnsigned("queued",queueLength());
+  for (int i=0;i<COUNTER_COUNT;i++)
+    json.addUnsigned(counterNames[i],counters[i]);
+  if (brokerCount>1)
+    {
+    json.beginObject("brokers");
+    for (uint8_t i=0;i<brokerCount;i++)
+      {
+      json.beginObject(brokerHost(i));
+      json.addUnsigned("latency",brokers[i].latency);
+      json.addUnsigned("errors",brokers[i].errors);
+      json.addUnsigned("failures",brokers[i].failures);
+      json.addUnsigned("current",i==currentBroker);
+      json.endObject();
+      }
+    json.endObject();
+    }
+  for (int i=0;i<TIMING_COUNT;i++)
+    {
+    timing* t=&timings[i];
+    json.beginObject(t->name);
+    json.addUnsigned("n",t->calls);
+    json.addUnsigned("avg",t->calls>0?t->totalMicros/t->calls:0);
+    json.addUnsigned("max",t->worstMicros);
+    json.beginArray("log2");
+    for (uint8_t b=0;b<t->histogram.used();b++)
+      json.addElement(t->histogram.bucket(b));
+    json.endArray();
+    json.endObject();
+    }
+  json.endObject();
+  }
+
+/*
+ * Send the metrics report.  publishJson() builds it more than once, so the
+ * readings are all taken first.
+ */
+boolean publishMetrics()
+  {
+  metricsSnapshot now=takeMetricsSnapshot();
+  return publishJson(topics[TOPIC_METRICS].name,[&now](JsonWriter& json)
+    {
+    buildMetricsJson(json,now);
+    },false); //do not retain
+  }
+
+void queueReading(uint8_t reading);
+
+/*
+ * The state of each sensor by name, and the analog level if there is one, for
+ * when there is more than one thing to report.  Given a name, it's nested in
+ * an object already begun.
+ */
+void buildLevelsJson(JsonWriter& json, uint8_t reading, uint16_t level, const char* name=NULL)
+  {
+  if (name)
+    json.beginObject(name);
+  else
+    json.beginObject();
+  for (uint8_t i=0;i<settings.sensorCount;i++)
+    json.addString(sensorNames[i],(reading>>i)&1?MQTT_PAYLOAD_SENSOR_WET:MQTT_PAYLOAD_SENSOR_DRY);
+  if (settings.analogEnabled)
+    json.addDecimal("percent",level,1);
+  json.endObject();
+  }
+
+/************************
+ * Do the MQTT thing.  If we can't, queue the reading to be sent later.
+ ************************/
+void report()
+  {  
+  char value[18];
+  boolean success=false;
+
+  rtc.lastReported=lastReading;
+  rtc.lastLevelReported=analogLevel;
+  rtc.reportCount++;
+  rtc.secondsSinceReport=0;
+
+  if (!mqttClient.connected())
+    {
+    queueReading(lastReading);
+    return;
+    }
+
+  //publish the last reading value
+  sprintf(value,"%d",lastReading); 
+  success=publish(topics[TOPIC_READING].name,value,true); //retain
+  if (!success)
+    {
+    Serial.println("************ Failed publishing sensor reading!");
+    queueReading(lastReading);
+    return;
+    }
+
+  //publish the fuel reading, all of the sensors in one message
+  if (settings.sensorCount==1 && !settings.analogEnabled)
+    success=publish(topics[TOPIC_LEVEL].name,
+                    lastReading?MQTT_PAYLOAD_SENSOR_WET:MQTT_PAYLOAD_SENSOR_DRY, //item within range window
+                    true); //retain
+  else
+    success=publishJson(topics[TOPIC_LEVEL].name,[](JsonWriter& json)
+      {
+      buildLevelsJson(json,lastReading,analogLevel);
+      },true); //retain
+  if (!success)
+    Serial.println("************ Failed publishing moisture value!");
+
+  if (pulsePinAttached!=0 && !publishJson(topics[TOPIC_FLOW].name,buildFlowJson,true)) //retain
+    Serial.println("************ Failed publishing flow values!");
+  }
+
+  
+/*
+*  Initialize the settings from flash and determine if they are valid
+*/
+void loadSettings()
+  {
+  if (readSettingsJournal())
+    {
+    if (settingsDirty) //moved forward from an older format
+      tasks[TASK_SETTINGS].enabled=true;
+    }
+  else if (readLegacySettings())
+    {
+    Serial.println("Moving the settings from EEPROM to the settings journal.");
+    tasks[TASK_SETTINGS].enabled=true;
+    }
+  else //then this must be the first powerup
+    {
+    Serial.println("\n*********************** Resetting All Saved Values ************************");
+    beginSettings();
+    initializeSettings();
+    commitSettings();
+    }
+  if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
+    {
+    settingsAreValid=true;
+    if (settings.debug)
+      {
+      Serial.println("Loaded configuration values from flash");
+      }
+//    showSettings();
+    }
+  else
+    {
+    Serial.println("Skipping load from flash, device not configured.");    
+    settingsAreValid=false;
+    }
+
+  buildTopics();
+
+  // Fix up settings saved by a version that didn't have them
+  if (settings.sleepTime>MAX_SLEEP_TIME)
+    settings.sleepTime=0;
+  if (settings.reportMode>REPORT_MODE_CHANGE)
+    {
+    settings.reportMode=REPORT_MODE_PERIODIC;
+    settings.heartbeatPeriod=DEFAULT_HEARTBEAT_PERIOD;
+    }
+  if (settings.debounceFilter>=FILTER_COUNT)
+    settings.debounceFilter=DEFAULT_DEBOUNCE_FILTER;
+  if (settings.queueDropPolicy>QUEUE_DROP_NEWEST || settings.queueDepth<1 || settings.queueDepth>MAX_QUEUE_DEPTH)
+    {
+    settings.queueDropPolicy=QUEUE_DROP_OLDEST;
+    settings.queueDepth=DEFAULT_QUEUE_DEPTH;
+    }
+  if (settings.sensorCount<1 || settings.sensorCount>SENSOR_MAX)
+    settings.sensorCount=DEFAULT_SENSOR_COUNT;
+  }
+
+/**
+ * Handler for incoming MQTT messages.  The payload is the command to perform. 
+ * The MQTT message topic sent is the topic root plus the command.
+ * Implemented commands are: 
+ * MQTT_PAYLOAD_SETTINGS_COMMAND: sends a JSON payload of all user-specified settings
+ * MQTT_PAYLOAD_REBOOT_COMMAND: Reboot the controller
+ * MQTT_PAYLOAD_VERSION_COMMAND Show the version number
+ * MQTT_PAYLOAD_STATUS_COMMAND Show the most recent flow values
+ * MQTT_PAYLOAD_RESET_PULSE_COMMAND Reset the flow meter total to zero
+ * 
+ * Note that unless sleeptime is zero, any MQTT command must be sent in the short time
+ * between connecting to the MQTT server and going to sleep.  In this case it is best
+ * to send the command with the "retain" flag on. Be sure to remove the retained message
+ * after it has been received by sending a new empty message with the retained flag set.
+ */
+void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+  {
+  unsigned long start=micros();
+  if (settings.debug)
+    {
+    Serial.print("*************************** Received topic ");
+    Serial.println(reqTopic);
+    }
+  char charbuf[100];
+
+  //General command?
+  if (topicIs(reqTopic,strlen(reqTopic),TOPIC_COMMAND)) //then we have received a command
+    {
+    // The payload isn't null terminated, so copy it to somewhere that can be
+    size_t n=length<sizeof(charbuf)-1?length:sizeof(charbuf)-1;
+    memcpy(charbuf,payload,n);
+    charbuf[n]='\0';
+
+    // Build the response topic for setting commands now, before the command is taken apart
+    char topic[MQTT_TOPIC_SIZE+sizeof(charbuf)];
+    memcpy(topic,topics[TOPIC_COMMAND].name,topicRootLength);
+    strcpy(topic+topicRootLength,charbuf); //the incoming command becomes the topic suffix
+
+    const command* c;
+    const char* response=processCommand(charbuf,true,&c);
+    if (response==NULL)
+      response="(empty)";
+    if (c!=NULL && c->responseTopic>=0)
+      strcpy(topic,topics[c->responseTopic].name);
+  
+    if (strlen(response)>0 && !queuePublish(topic,response,false)) //do not retain
+      {
+      int code=mqttClient.state();
+      Serial.print("************ Failure ");
+      Serial.print(code);
+      Serial.println(" when publishing command response!");
+      }
+    }
+
+  recordTiming(TIMING_MQTT_HANDLER,start);
+  }
+
+/*
+ * Save the settings object to EEPROM and publish a "show settings" command.
+ */
+void saveAndShow()
+  {
+  saveSettings();
+
+  //Send ourself the command to display settings
+  if (!queuePublish(topics[TOPIC_COMMAND].name,MQTT_PAYLOAD_SETTINGS_COMMAND,false)) //do not retain
+    Serial.println("************ Failure when publishing show settings response!");
+  }
+
+/*
+ * Standard CRC32 (the one used by zip and ethernet)
+ */
+uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc)
+  {
+  crc=~crc;
+  while (length--)
+    {
+    crc^=*data++;
+    for (int i=0;i<8;i++)
+      crc=(crc>>1)^(0xEDB88320 & (0-(crc&1)));
+    }
+  return ~crc;
+  }
+
+/*
+ * The settings journal.  Rather than erasing and rewriting the same flash sector 
+ * whenever a setting changes, each commit appends a complete copy of the settings
+ * to the current segment file.  When a segment is full the next one is started
+ * over, so the writes go round all the segments in turn.  At boot the newest record
+ * that passes its CRC is used, so a commit cut short by a reset just leaves the
+ * previous settings in place.
+ */
+typedef struct
+  {
+  uint32_t magic;
+  uint32_t sequence;       //one more than the record before
+  uint32_t erases;         //segments started over since the journal was created
+  uint16_t length;         //bytes of settings after the header
+  uint16_t version;        //of the format of the settings, see storedSettings
+  uint32_t crc;            //of everything above plus the settings
+  } journalRecord;
+
+// How each setting is saved.  A record is a list of fields, each one an id byte, a 
+// length byte and then the value: a string without its null, or a number with its 
+// low byte first.  Fields this version doesn't know about are skipped and fields 
+// that are missing keep their defaults, so settings can be added without a 
+// migration step.  Never change or reuse an id.
+enum {STORED_NUMBER, STORED_STRING};
+
+typedef struct
+  {
+  uint8_t id;
+  uint8_t type;
+  uint16_t offset;         //in conf, or which string setting it is
+  uint16_t size;           //of a string, the most it can be including the null
+  uint16_t legacyOffset;   //in legacyConf
+  uint16_t legacySize;
+  } storedSetting;
+
+#define STORED(id,type,field) \
+  {id,type,offsetof(conf,field),sizeof(conf::field),offsetof(legacyConf,field),sizeof(legacyConf::field)}
+#define STORED_NEW(id,type,field) /*added since legacyConf*/ \
+  {id,type,offsetof(conf,field),sizeof(conf::field),0,0}
+#define STORED_TEXT(id,string,size,field) \
+  {id,STORED_STRING,string,size,offsetof(legacyConf,field),sizeof(legacyConf::field)}
+#define STORED_NEW_TEXT(id,string,size) \
+  {id,STORED_STRING,string,size,0,0}
+
+const storedSetting storedSettings[]=
+  {
+  STORED(1,STORED_NUMBER,validConfig),
+  STORED_TEXT(2,STRING_SSID,SSID_SIZE,ssid),
+  STORED_TEXT(3,STRING_WIFI_PASSWORD,PASSWORD_SIZE,wifiPassword),
+  STORED_TEXT(4,STRING_BROKER,ADDRESS_SIZE,mqttBrokerAddress),
+  STORED(5,STORED_NUMBER,mqttBrokerPort),
+  STORED_TEXT(6,STRING_USERNAME,USERNAME_SIZE,mqttUsername),
+  STORED_TEXT(7,STRING_PASSWORD,PASSWORD_SIZE,mqttPassword),
+  STORED_TEXT(8,STRING_TOPIC_ROOT,MQTT_TOPIC_SIZE,mqttTopicRoot),
+  STORED_TEXT(9,STRING_CLIENT_ID,MQTT_CLIENTID_SIZE,mqttClientId),
+  STORED(10,STORED_NUMBER,debug),
+  STORED(11,STORED_NUMBER,reportPeriod),
+  STORED_TEXT(12,STRING_STATIC_IP,ADDRESS_SIZE,staticIP),
+  STORED_TEXT(13,STRING_NETMASK,ADDRESS_SIZE,netmask),
+  STORED_TEXT(14,STRING_GATEWAY,ADDRESS_SIZE,gateway),
+  STORED_TEXT(15,STRING_DNS,ADDRESS_SIZE,dns),
+  STORED(16,STORED_NUMBER,sleepTime),
+  STORED(17,STORED_NUMBER,reportMode),
+  STORED(18,STORED_NUMBER,heartbeatPeriod),
+  STORED(19,STORED_NUMBER,debounceFilter),
+  STORED(20,STORED_NUMBER,queueDropPolicy),
+  STORED(21,STORED_NUMBER,queueDepth),
+  STORED_NEW(22,STORED_NUMBER,metricsPeriod),
+  STORED_NEW(23,STORED_NUMBER,sensorCount),
+  STORED_NEW(24,STORED_NUMBER,analogEnabled),
+  STORED_NEW_TEXT(25,STRING_ANALOG_CALIBRATION,ANALOG_CALIBRATION_SIZE),
+  STORED_NEW(26,STORED_NUMBER,pulsePin),
+  STORED_NEW(27,STORED_NUMBER,pulsesPerUnit),
+  STORED_NEW(28,STORED_NUMBER,pulseTotal),
+  STORED_NEW(29,STORED_NUMBER,persistentSession),
+  STORED_NEW(30,STORED_NUMBER,tlsMode),
+  STORED_NEW_TEXT(31,STRING_TLS_FINGERPRINT,TLS_FINGERPRINT_SIZE),
+  STORED_NEW_TEXT(32,STRING_BACKUP_BROKERS,MQTT_BACKUP_BROKERS_SIZE)
+  };
+#define STORED_COUNT (sizeof(storedSettings)/sizeof(storedSettings[0]))
+
+uint8_t journalSegment=0;    //the segment being appended to
+boolean journalSegmentFull=false; //start on the next segment with the next commit
+uint32_t journalSequence=0;  //of the newest record
+uint32_t journalErases=0;
+uint32_t savedSettingsCrc=0; //of the settings in the journal, so unchanged settings aren't written again
+unsigned long settingsCommits=0;
+unsigned long settingsUnchanged=0;
+
+void journalName(uint8_t segment, char* buf, size_t size)
+  {
+  snprintf(buf,size,SETTINGS_JOURNAL_NAME,segment);
+  }
+
+uint32_t journalHeaderCrc(const journalRecord* r)
+  {
+  return crc32((const uint8_t*)r,offsetof(journalRecord,crc));
+  }
+
+/*
+ * Pass the settings, in the saved format, to out a field at a time.  This is run 
+ * once to measure them, once for the CRC and once to write them, instead of 
+ * building a copy.
+ */
+template <typename Output>
+void encodeSettings(Output out)
+  {
+  for (size_t i=0;i<STORED_COUNT;i++)
+    {
+    const storedSetting* s=&storedSettings[i];
+    const uint8_t* field=s->type==STORED_STRING?(const uint8_t*)settingString(s->offset)
+                                                :(const uint8_t*)&settings+s->offset;
+    uint8_t head[2];
+    head[0]=s->id;
+    head[1]=s->type==STORED_STRING?settings.stringLength[s->offset]:s->size;
+    out(head,sizeof(head));
+    out(field,head[1]);
+    }
+  }
 
-IPAddress staticIP;
-IPAddress subnet;
-IPAddress gateway;
-IPAddress dns;
+const storedSetting* findStoredSetting(uint8_t id)
+  {
+  for (size_t i=0;i<STORED_COUNT;i++)
+    if (storedSettings[i].id==id)
+      return &storedSettings[i];
+  return NULL;
+  }
 
-void flashWarning(boolean val)
+/*
+ * Read length bytes of saved fields from the file into the settings, which start
+ * out with their defaults.  Returns false if the fields don't add up.
+ */
+boolean decodeSettings(File& f, uint16_t length)
   {
-  // Serial.print("val is ");
-  // Serial.println(val);
-  if (millis()>=nextFlash && (val==DRY || failure))
+  defaultSettings();
+  while (length>0)
     {
-    if (warningLedOn) //make it yellow
+    uint8_t head[2];
+    if (length<sizeof(head) || f.read(head,sizeof(head))!=sizeof(head) || head[1]>length-sizeof(head))
+      return false;
+    length-=sizeof(head)+head[1];
+
+    const storedSetting* s=findStoredSetting(head[0]);
+    uint8_t* field=s!=NULL?(uint8_t*)&settings+s->offset:NULL;
+    if (s!=NULL && s->type==STORED_STRING && head[1]<s->size)
       {
-      if (!failure) //but failure is red only
-        analogWrite(OK_LED_PORT_GREEN,DRY_GREEN_BRIGHTNESS); 
-      analogWrite(WARNING_LED_PORT_RED,DRY_RED_BRIGHTNESS);
+      char value[UINT8_MAX+1];
+      if (f.read((uint8_t*)value,head[1])!=head[1])
+        return false;
+      value[head[1]]='\0';
+      if (!setSettingString(s->offset,value))
+        return false;
       }
-    else
+    else if (s!=NULL && s->type==STORED_NUMBER && head[1]<=sizeof(uint64_t))
       {
-      digitalWrite(OK_LED_PORT_GREEN,LED_OFF);
-      digitalWrite(WARNING_LED_PORT_RED,LED_OFF);
+      uint64_t value=0;
+      if (f.read((uint8_t*)&value,head[1])!=head[1])
+        return false;
+      memcpy(field,&value,s->size<sizeof(value)?s->size:sizeof(value));
       }
-    warningLedOn=!warningLedOn;
-    nextFlash=millis()+WARNING_LED_FLASH_RATE*1000;
-    }
-  else if (val==WET)
-    {
-//    Serial.println("WET");
-    digitalWrite(WARNING_LED_PORT_RED,LED_OFF);
-    analogWrite(OK_LED_PORT_GREEN,WET_GREEN_BRIGHTNESS); //full on is too bright
+    else if (!f.seek(f.position()+head[1])) //from a newer version, or too long for us
+      return false;
     }
+  return true;
   }
 
-boolean hysteresis(boolean reading)
+/*
+ * Copy the settings out of an image of legacyConf, leaving the defaults for 
+ * anything that doesn't fit.
+ */
+void decodeLegacySettings(const uint8_t* old)
   {
-  static boolean oldReading=reading;
-  static ulong oldTime=millis();
-
-  if (millis()-oldTime < HYSTERESIS_DELAY)
+  defaultSettings();
+  for (size_t i=0;i<STORED_COUNT;i++)
     {
-    reading=oldReading; //ignore changes during HYSTERESIS_DELAY
+    const storedSetting* s=&storedSettings[i];
+    uint8_t* field=(uint8_t*)&settings+s->offset;
+    const uint8_t* from=old+s->legacyOffset;
+    if (s->type==STORED_STRING)
+      {
+      char value[UINT8_MAX+1];
+      size_t len=strnlen((const char*)from,s->legacySize);
+      if (s->legacySize>0 && len<s->size)
+        {
+        memcpy(value,from,len);
+        value[len]='\0';
+        setSettingString(s->offset,value);
+        }
+      }
+    else if (s->legacySize>0 && s->legacySize<=s->size) //low byte first, so longer is fine
+      {
+      memset(field,0,s->size);
+      memcpy(field,from,s->legacySize);
+      }
     }
-  else if (oldReading!=reading) //if it is changed, restart the timer and save the value
+  }
+
+/*
+ * Check the CRC of a record from the file a piece at a time, without needing a
+ * copy of it.  The file must be positioned just after the header.
+ */
+boolean journalRecordValid(File& f, const journalRecord* r)
+  {
+  uint8_t buf[64];
+  uint32_t crc=journalHeaderCrc(r);
+  uint16_t left=r->length;
+  while (left>0)
     {
-    oldTime=millis();
-    oldReading=reading;
+    size_t n=left<sizeof(buf)?left:sizeof(buf);
+    if (f.read(buf,n)!=n)
+      return false;
+    crc=crc32(buf,n,crc);
+    left-=n;
     }
-  return reading;
+  return crc==r->crc;
   }
 
-//Take a measurement
-void readSensor()
+/*
+ * Load the settings from a journal record that has passed its CRC, moving them 
+ * forward from an older format if need be.
+ */
+boolean loadJournalRecord(File& f, const journalRecord* r, uint32_t offset)
   {
-  int val=digitalRead(SENSOR_PORT);
-  boolean hys=hysteresis((boolean)val);
-  flashWarning(hys);
-  lastReading=hys;
+  if (!f.seek(offset+sizeof(journalRecord)))
+    return false;
+  if (r->version==SETTINGS_SCHEMA_VERSION)
+    return decodeSettings(f,r->length);
+  if (r->version==0 && r->length==sizeof(legacyConf)) //written whole by the first journal
+    {
+    uint8_t* old=(uint8_t*)malloc(sizeof(legacyConf)); //only ever once
+    boolean ok=old!=NULL && f.read(old,sizeof(legacyConf))==sizeof(legacyConf);
+    if (ok)
+      {
+      decodeLegacySettings(old);
+      settingsDirty=true; //rewrite them in the current format
+      Serial.println("Moved the settings to the current format.");
+      }
+    free(old);
+    return ok;
+    }
+  return false; //written by a newer version
   }
 
-void showSettings()
+/*
+ * Find the newest good record in the journal and load the settings from it.
+ * Returns false if there isn't one.  Only the record headers are read to find the
+ * newest, so just that one record has its CRC checked unless it turns out to be 
+ * bad, in which case we go back for the one before.
+ */
+boolean readSettingsJournal()
   {
-  try
-    {  
-    Serial.print("broker=<MQTT broker host name or address> (");
-    Serial.print(settings.mqttBrokerAddress);
-    Serial.println(")");
-    Serial.print("port=<port number>   (");
-    Serial.print(settings.mqttBrokerPort);
-    Serial.println(")");
-    Serial.print("topicroot=<topic root> (");
-    Serial.print(settings.mqttTopicRoot);
-    Serial.println(")");  
-    Serial.print("user=<mqtt user> (");
-    Serial.print(settings.mqttUsername);
-    Serial.println(")");
-    Serial.print("pass=<mqtt password> (");
-    Serial.print(settings.mqttPassword);
-    Serial.println(")");
-    Serial.print("ssid=<wifi ssid> (");
-    Serial.print(settings.ssid);
-    Serial.println(")");
-    Serial.print("wifipass=<wifi password> (");
-    Serial.print(settings.wifiPassword);
-    Serial.println(")");
-    Serial.print("debug=<1|0> (");
-    Serial.print(settings.debug);
-    Serial.println(")");
-    Serial.print("MQTT Client ID is ");
-    Serial.println(settings.mqttClientId);
-    Serial.print("reportperiod=<seconds between reports> (");
-    Serial.print(settings.reportPeriod);
-    Serial.println(")");
-    Serial.print("staticaddress=<IP address> (");
-    Serial.print(settings.staticIP);
-    Serial.println(")");
-    Serial.print("netmask=<network IP mask> (");
-    Serial.print(settings.netmask);
-    Serial.println(")");
-    Serial.print("gateway=<gateway IP address> (");
-    Serial.print(settings.gateway);
-    Serial.println(")");
-    Serial.print("dns=<DNS IP address> (");
-    Serial.print(settings.dns);
-    Serial.println(")");
-    Serial.print("Settings are");
-    Serial.print(settingsAreValid?"":" not");
-    Serial.println(" valid.");
-    Serial.println("\n*** Use \"factorydefaults=yes\" to reset all settings ***\n");
-    }
-  catch(const std::exception& e)
+  char name[SETTINGS_JOURNAL_NAME_SIZE];
+  boolean limited=false;
+  uint32_t limit=0;  //only look at records older than this
+  while (true)
     {
-    failure=true;
-    Serial.println("******************* ERROR ************");
-    Serial.println(e.what());
-    }
+    boolean found=false;
+    journalRecord best;
+    uint32_t bestOffset=0;
+    for (uint8_t segment=0;segment<SETTINGS_JOURNAL_SEGMENTS;segment++)
+      {
+      journalName(segment,name,sizeof(name));
+      File f=LittleFS.open(name,"r");
+      if (!f)
+        continue;
+      uint32_t size=f.size();
+      uint32_t offset=0;
+      journalRecord r;
+      while (offset+sizeof(r)<=size 
+          && f.seek(offset) 
+          && f.read((uint8_t*)&r,sizeof(r))==sizeof(r)
+          && r.magic==SETTINGS_JOURNAL_MAGIC
+          && offset+sizeof(r)+r.length<=size)
+        {
+        if ((!limited || (int32_t)(limit-r.sequence)>0)
+            && (!found || (int32_t)(r.sequence-best.sequence)>0))
+          {
+          found=true;
+          best=r;
+          bestOffset=offset;
+          journalSegment=segment;
+          }
+        offset+=sizeof(r)+r.length;
+        }
+      // A torn record at the end would hide anything appended after it
+      if (found && journalSegment==segment && !limited)
+        journalSegmentFull=offset!=size;
+      f.close();
+      }
+    if (!found)
+      return false;
 
+    journalName(journalSegment,name,sizeof(name));
+    File f=LittleFS.open(name,"r");
+    boolean ok=f && f.seek(bestOffset+sizeof(journalRecord))
+        && journalRecordValid(f,&best)
+        && loadJournalRecord(f,&best,bestOffset);
+    f.close();
+    // Carry on from the newest record even if it is bad, so sequence numbers aren't reused
+    if (!limited)
+      {
+      journalSequence=best.sequence;
+      journalErases=best.erases;
+      }
+    if (ok)
+      {
+      if (!settingsDirty)
+        savedSettingsCrc=crc32((const uint8_t*)&settings,sizeof(settings));
+      return true;
+      }
+    Serial.println("Skipping a bad settings record.");
+    limited=true;
+    limit=best.sequence;
+    journalSegmentFull=true;
+    }
   }
 
-void showSub(char* topic)
+/*
+ * Take the settings an older version saved whole to EEPROM, so they can be moved
+ * to the journal.  Returns false if there aren't any.
+ */
+boolean readLegacySettings()
   {
-  if (settings.debug)
+  EEPROM.begin(sizeof(legacyConf));
+  const legacyConf* old=(const legacyConf*)EEPROM.getConstDataPtr();
+  // Erased flash reads as all ones.  A configuration that was never completed
+  // still has a real port number.
+  boolean present=old->validConfig==VALID_SETTINGS_FLAG 
+      || (old->validConfig==0 && old->mqttBrokerPort>0 && old->mqttBrokerPort<=65535);
+  if (present)
     {
-    Serial.print("++++++Subscribing to ");
-    Serial.print(topic);
-    Serial.print(":\t");
-    Serial.println();
+    decodeLegacySettings((const uint8_t*)old);
+    settingsDirty=true;
     }
+  EEPROM.end();
+  return present;
   }
 
 /*
- * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ * Append the settings to the journal, moving on to the next segment if this one
+ * is full.
  */
-boolean saveSettings()
+boolean appendSettingsRecord()
   {
-  if (strlen(settings.ssid)>0 &&
-    strlen(settings.wifiPassword)>0 &&
-    strlen(settings.mqttBrokerAddress)>0 &&
-    settings.mqttBrokerPort!=0 &&
-    strlen(settings.mqttTopicRoot)>0 &&
-    strlen(settings.mqttClientId)>0 &&
-    settings.reportPeriod > 0 &&
-      (strlen(settings.staticIP)==0 || //if staticIP set then all network stuff
-        (strlen(settings.netmask)>0 && //except DNS must be too
-        strlen(settings.gateway)>0))
-    )
+  journalRecord r;
+  r.magic=SETTINGS_JOURNAL_MAGIC;
+  r.sequence=journalSequence+1;
+  r.length=0;
+  r.version=SETTINGS_SCHEMA_VERSION;
+  encodeSettings([&](const uint8_t* data, size_t n)
     {
-    Serial.println("Settings deemed complete");
-    settings.validConfig=VALID_SETTINGS_FLAG;
-    settingsAreValid=true;
+    r.length+=n;
+    });
+
+  char name[SETTINGS_JOURNAL_NAME_SIZE];
+  journalName(journalSegment,name,sizeof(name));
+  File f=LittleFS.open(name,"a");
+  if (journalSegmentFull || (f && f.size()+sizeof(r)+r.length>SETTINGS_SEGMENT_SIZE))
+    {
+    f.close();
+    journalSegment=(journalSegment+1)%SETTINGS_JOURNAL_SEGMENTS;
+    journalSegmentFull=false;
+    journalErases++;
+    journalName(journalSegment,name,sizeof(name));
+    f=LittleFS.open(name,"w"); //throws away the oldest records
     }
+  if (!f)
+    return false;
+
+  r.erases=journalErases;
+  uint32_t crc=journalHeaderCrc(&r);
+  encodeSettings([&](const uint8_t* data, size_t n)
+    {
+    crc=crc32(data,n,crc);
+    });
+  r.crc=crc;
+  boolean ok=f.write((uint8_t*)&r,sizeof(r))==sizeof(r);
+  encodeSettings([&](const uint8_t* data, size_t n)
+    {
+    ok=ok && f.write(data,n)==n;
+    });
+  f.close();
+  if (ok)
+    journalSequence=r.sequence;
   else
+    journalSegmentFull=true; //don't append after a partial record
+  return ok;
+  }
+
+/*
+ * Write the settings to flash now if they have changed.  Returns false if they
+ * couldn't be written.
+ */
+boolean flushSettings()
+  {
+  if (!settingsDirty)
+    return true;
+  settingsDirty=false;
+  tasks[TASK_SETTINGS].enabled=false;
+
+  uint32_t crc=crc32((const uint8_t*)&settings,sizeof(settings));
+  if (crc==savedSettingsCrc)
     {
-    Serial.println("Settings still incomplete");
-    settings.validConfig=0;
-    settingsAreValid=false;
+    settingsUnchanged++;
+    return true;
     }
-    
-  //The mqttClientId is not set by the user, but we need to make sure it's set  
-  if (strlen(settings.mqttClientId)==0)
+
+  unsigned long start=micros();
+  boolean ok=appendSettingsRecord();
+  recordTiming(TIMING_SETTINGS_COMMIT,start);
+  if (!ok)
     {
-    strcpy(settings.mqttClientId,strcat((char*)MQTT_CLIENT_ID_ROOT,String(random(0xffff), HEX).c_str()));
+    Serial.println("************ Unable to save the settings!");
+    return false;
     }
-    
-    
-  EEPROM.put(0,settings);
-  return EEPROM.commit();
+  savedSettingsCrc=crc;
+  settingsCommits++;
+  return true;
   }
 
-void initializeSettings()
+/*
+ * Print the settings journal statistics.  The commit times are in the timing table.
+ */
+void showSettingsJournal()
   {
-  settings.validConfig=0; 
-  strcpy(settings.ssid,"");
-  strcpy(settings.wifiPassword,"");
-  strcpy(settings.mqttBrokerAddress,""); //default
-  settings.mqttBrokerPort=1883;
-  strcpy(settings.mqttUsername,"");
-  strcpy(settings.mqttPassword,"");
-  strcpy(settings.mqttTopicRoot,"");
-  strcpy(settings.mqttClientId,strcat((char*)MQTT_CLIENT_ID_ROOT,String(random(0xffff), HEX).c_str()));
-  settings.reportPeriod=0;
-  strcpy(settings.staticIP,"");
-  strcpy(settings.netmask,"");
-  strcpy(settings.gateway,"");
-  strcpy(settings.dns,"");
+  Serial.print("Settings commits=");
+  Serial.print(settingsCommits);
+  Serial.print(" unchanged=");
+  Serial.print(settingsUnchanged);
+  Serial.print(" sequence=");
+  Serial.print(journalSequence);
+  Serial.print(" segment=");
+  Serial.print(journalSegment);
+  Serial.print(" segment erases=");
+  Serial.println(journalErases);
   }
 
-bool processCommand(String cmd)
+uint32_t rtcCrc()
   {
-  const char *str=cmd.c_str();
-  char *val=NULL;
-  char *nme=strtok((char *)str,"=");
-  if (nme!=NULL)
-    val=strtok(NULL,"=");
-
-  //Get rid of the carriage return
-  if (val!=NULL && strlen(val)>0 && val[strlen(val)-1]==13)
-    val[strlen(val)-1]=0; 
+  return crc32((uint8_t*)&rtc+sizeof(rtc.crc),sizeof(rtc)-sizeof(rtc.crc));
+  }
 
-  if (nme==NULL || val==NULL || strlen(nme)==0 || strlen(val)==0)
-    {
-    showSettings();
-    return false;   //bad or missing command
-    }
-  if (strcmp(val,"null")==0) //they want to reset a value
-    {
-    strcpy(val,"");
-    }
-  if (strcmp(nme,"broker")==0)
-    {
-    strcpy(settings.mqttBrokerAddress,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"port")==0)
-    {
-    settings.mqttBrokerPort=atoi(val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"topicroot")==0)
-    {
-    strcpy(settings.mqttTopicRoot,val);
-    if (settings.mqttTopicRoot[strlen(settings.mqttTopicRoot)-1]!='/')
-      strcat(settings.mqttTopicRoot,"/");
-    saveSettings();
-    }
-  else if (strcmp(nme,"user")==0)
-    {
-    strcpy(settings.mqttUsername,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"pass")==0)
-    {
-    strcpy(settings.mqttPassword,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"ssid")==0)
-    {
-    strcpy(settings.ssid,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"wifipass")==0)
-    {
-    strcpy(settings.wifiPassword,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"debug")==0)
-    {
-    settings.debug=atoi(val)==1?true:false;
-    saveSettings();
-    }
-  else if (strcmp(nme,"reportperiod")==0)
-    {
-    settings.reportPeriod=atol(val);
-    nextReport=millis()+settings.reportPeriod;
-    saveSettings();
-    }
-  else if (strcmp(nme,"staticaddress")==0)
-    {
-    strcpy(settings.staticIP,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"netmask")==0)
-    {
-    strcpy(settings.netmask,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"gateway")==0)
-    {
-    strcpy(settings.gateway,val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"dns")==0)
-    {
-    strcpy(settings.dns,val);
-    saveSettings();
-    }
-  else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
-    {
-    Serial.println("\n*********************** Resetting EEPROM Values ************************");
-    initializeSettings();
-    saveSettings();
-    delay(2000);
-    ESP.restart();
-    }
-  else //invalid command
+/*
+ * Read the RTC memory state.  If it isn't valid (after a power cycle, for instance)
+ * then start with a clean slate and return false.
+ */
+boolean loadRtc()
+  {
+  if (!ESP.rtcUserMemoryRead(0,(uint32_t*)&rtc,sizeof(rtc)) || rtc.crc!=rtcCrc())
     {
-    showSettings();
+    memset(&rtc,0,sizeof(rtc));
+    if (settings.debug)
+      Serial.println("RTC memory not valid, starting fresh.");
     return false;
     }
   return true;
   }
-  
+
+void saveRtc()
+  {
+  rtc.crc=rtcCrc();
+  ESP.rtcUserMemoryWrite(0,(uint32_t*)&rtc,sizeof(rtc));
+  }
+
 /*
-  SerialEvent occurs whenever a new data comes in the hardware serial RX. This
-  routine is run between each time loop() runs, so using delay inside loop can
-  delay response. Multiple bytes of data may be available.
-*/
-void serialEvent() 
+ * How long the DHCP lease just obtained can be reused without asking for it again:
+ * until the server expects it to be renewed (T1), which is half the lease unless
+ * it said otherwise.  Zero if there is no lease to go by.
+ */
+uint32_t dhcpLeaseTime()
   {
-  while (Serial.available()) 
-    {
-    // get the new byte
-    char inChar = (char)Serial.read();
+  if (netif_default==NULL)
+    return 0;
+  const struct dhcp* lease=netif_dhcp_data(netif_default);
+  if (lease==NULL || lease->offered_t0_lease==0)
+    return 0;
+  if (lease->offered_t1_renew>0 && lease->offered_t1_renew<lease->offered_t0_lease)
+    return lease->offered_t1_renew;
+  return lease->offered_t0_lease/2;
+  }
 
-    // if the incoming character is a newline, set a flag so the main loop can
-    // do something about it 
-    if (inChar == '\n') 
-      {
-      commandComplete = true;
-      }
-    else
-      {
-      // add it to the inputString 
-      commandString += inChar;
-      }
-    }
+/*
+ * True if the cached address lease has run out.  Nothing renews a lease that we
+ * reused, so it must not be used past this.
+ */
+boolean leaseExpired()
+  {
+  return rtc.leaseTime!=0 && deviceSeconds()-rtc.leaseStart >= rtc.leaseTime;
   }
 
 /*
- * Check for configuration input via the serial port.  Return a null string 
- * if no input is available or return the complete line otherwise.
+ * Remember the access point and address lease so that the next connection can skip
+ * the scan and the DHCP exchange.  A reused lease keeps the time it was first given.
  */
-String getConfigCommand()
+void cacheWifiConnection()
   {
-  if (commandComplete) 
+  if (!wifiFastConnect)
     {
-    Serial.println(commandString);
-    String newCommand=commandString;
-
-    commandString = "";
-    commandComplete = false;
-    return newCommand;
+    rtc.leaseStart=deviceSeconds();
+    rtc.leaseTime=0; //a static address doesn't run out
+    if (!(staticIP && gateway && subnet))
+      {
+      rtc.leaseTime=dhcpLeaseTime();
+      if (rtc.leaseTime==0) //can't tell when it runs out, so don't reuse it
+        {
+        forgetWifiConnection();
+        return;
+        }
+      }
     }
-  else return "";
+  memcpy(rtc.bssid,WiFi.BSSID(),sizeof(rtc.bssid));
+  rtc.channel=WiFi.channel();
+  rtc.localIP=WiFi.localIP();
+  rtc.gatewayIP=WiFi.gatewayIP();
+  rtc.subnetMask=WiFi.subnetMask();
+  rtc.dnsIP=WiFi.dnsIP();
+  rtc.wifiValid=1;
+  saveRtc();
   }
 
-void checkForCommand()
+void forgetWifiConnection()
   {
-  if (Serial.available())
+  if (rtc.wifiValid)
     {
-    serialEvent();
-    String cmd=getConfigCommand();
-    if (cmd.length()>0)
-      {
-      processCommand(cmd);
-      }
+    rtc.wifiValid=0;
+    saveRtc();
     }
   }
 
-  /*
- * Reconnect to the MQTT broker
+/*
+ * Seconds on the device clock. This keeps counting through deep sleep and restarts,
+ * but starts over (with a new epoch) after a power cycle.
+ */
+uint32_t deviceSeconds()
+  {
+  return rtc.clockBase+millis()/1000;
+  }
+
+/*
+ * The offline queue.  Readings that can't be sent go into a ring buffer in RTC
+ * memory, which survives deep sleep.  When that fills up it is moved in one go to 
+ * the end of a ring buffer file in LittleFS, which holds settings.queueDepth 
+ * readings.  So the file always holds the oldest readings.  When we are connected 
+ * again the queue task sends them, oldest first, a batch at a time.
+ */
+typedef struct
+  {
+  uint32_t magic;
+  uint16_t depth;          //number of reading slots after the header
+  uint16_t head;           //oldest reading
+  uint16_t count;
+  uint8_t epoch;           //device clock epoch, advanced after every power cycle
+  uint8_t unused;
+  } queueFileHeader;
+
+queueFileHeader queueFile;
+boolean queueFileOk=false;
+
+boolean writeQueueHeader(File& f)
+  {
+  return f.seek(0) && f.write((uint8_t*)&queueFile,sizeof(queueFile))==sizeof(queueFile);
+  }
+
+boolean seekQueueSlot(File& f, uint16_t slot)
+  {
+  return f.seek(sizeof(queueFile)+(uint32_t)slot*sizeof(queuedReading));
+  }
+
+/*
+ * Mount the file system and open the queue file, creating it if needed.  If the RTC 
+ * memory was lost then the device clock has started over, so start a new epoch.
  */
-void mqttReconnect() 
+void openQueueFile(boolean clockRestarted)
   {
-  if (!settingsAreValid || WiFi.status() != WL_CONNECTED) //don't bother
+  queueFileOk=false;
+  if (!LittleFS.begin())
     {
+    Serial.println("Unable to mount the file system, offline queue is in RTC memory only.");
     return;
     }
 
-  mqttClient.loop(); //This has to happen every so often or we can't receive messages
-    
-  if (!mqttClient.connected()) // only if we aren't already connected
+  File f=LittleFS.open(QUEUE_FILE_NAME,"r+");
+  boolean valid=f 
+      && f.read((uint8_t*)&queueFile,sizeof(queueFile))==sizeof(queueFile)
+      && queueFile.magic==QUEUE_FILE_MAGIC
+      && queueFile.depth==settings.queueDepth
+      && f.size()==sizeof(queueFile)+(uint32_t)queueFile.depth*sizeof(queuedReading);
+  if (!valid)
     {
-    if (settings.debug)
-      {
-      Serial.print("\nAttempting MQTT connection...");
-      }
-    
-    // Attempt to connect
-    if (mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword))
-      {
-      if (settings.debug)
-        {
-        Serial.println("connected to MQTT broker.");
-        }
-      //subscribe to the incoming message topics
-      char topic[MQTT_TOPIC_SIZE];
-      strcpy(topic,settings.mqttTopicRoot);
-      strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
-      int subok=mqttClient.subscribe(topic);
-      if (subok!=1)
-        {
-        Serial.print("Unable to subscribe to ");
-        Serial.println(topic);
-        Serial.print("Return code: ");
-        Serial.println(subok);
-        }
-      else
-        showSub(topic);
-      }
-    else 
+    // New file, or the depth setting was changed. Either way, start empty.
+    if (f)
+      f.close();
+    f=LittleFS.open(QUEUE_FILE_NAME,"w+");
+    if (!f)
       {
-      Serial.print("failed, rc=");
-      Serial.println(mqttClient.state());
-//      Serial.println("Will try again in a second");
-      
-      // Wait a second before retrying
-      // In the meantime check for input in case something needs to be changed to make it work
-      checkForCommand(); 
-      
-//      delay(1000);
+      Serial.println("Unable to create the offline queue file.");
+      return;
       }
+    uint8_t epoch=queueFile.epoch;
+    memset(&queueFile,0,sizeof(queueFile));
+    queueFile.magic=QUEUE_FILE_MAGIC;
+    queueFile.depth=settings.queueDepth;
+    queueFile.epoch=epoch;
+    queuedReading empty;
+    memset(&empty,0,sizeof(empty));
+    writeQueueHeader(f);
+    for (int i=0;i<queueFile.depth;i++)
+      f.write((uint8_t*)&empty,sizeof(empty));
     }
+
+  if (clockRestarted)
+    queueFile.epoch++;
+  rtc.clockEpoch=queueFile.epoch;
+  queueFileOk=writeQueueHeader(f);
+  f.close();
   }
 
-boolean publish(char* topic, char* reading, bool retain)
+/*
+ * Move everything in the RTC part of the queue to the file.  Returns the number moved.
+ */
+int spillQueue()
   {
-  //digitalWrite(OK_LED_PORT_GREEN,LED_OFF); //the loop will turn it back on at normal brightness
-  Serial.print(topic);
-  Serial.print(" ");
-  Serial.println(reading);
-  boolean ok=false;
-  if (mqttClient.connected())
-    {
-    ok=mqttClient.publish(topic,reading,retain);
-    }
-  else
+  if (!queueFileOk)
+    return 0;
+  File f=LittleFS.open(QUEUE_FILE_NAME,"r+");
+  if (!f)
+    return 0;
+
+  int moved=0;
+  while (rtc.queueCount>0)
     {
-    ok=true;
+    if (queueFile.count==queueFile.depth)
+      {
+      if (settings.queueDropPolicy==QUEUE_DROP_NEWEST)
+        break;  //the RTC queue stays full and the next reading will be dropped
+      queueFile.head=(queueFile.head+1)%queueFile.depth; //lose the oldest
+      queueFile.count--;
+      rtc.droppedCount++;
+      }
+    uint16_t slot=(queueFile.head+queueFile.count)%queueFile.depth;
+    if (!seekQueueSlot(f,slot) 
+        || f.write((uint8_t*)&rtc.queue[rtc.queueHead],sizeof(queuedReading))!=sizeof(queuedReading))
+      break;
+    queueFile.count++;
+    rtc.queueHead=(rtc.queueHead+1)%RTC_QUEUE_SIZE;
+    rtc.queueCount--;
+    moved++;
     }
-  return ok;
-  }
-
-/************************
- * Do the MQTT thing
- ************************/
-void report()
-  {  
-  char topic[MQTT_TOPIC_SIZE];
-  char value[18];
-  boolean success=false;
-
-  //publish the last reading value
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_READING);
-  sprintf(value,"%d",lastReading); 
-  success=publish(topic,value,true); //retain
-  if (!success)
-    Serial.println("************ Failed publishing sensor reading!");
-
-  //publish the fuel reading
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_LEVEL);
-  sprintf(value,"%s",lastReading?MQTT_PAYLOAD_SENSOR_WET:MQTT_PAYLOAD_SENSOR_DRY); //item within range window
-  success=publish(topic,value,true); //retain
-  if (!success)
-    Serial.println("************ Failed publishing moisture value!");
+  writeQueueHeader(f);
+  f.close();
+  return moved;
   }
 
-  
 /*
-*  Initialize the settings from eeprom and determine if they are valid
-*/
-void loadSettings()
+ * Add a reading to the offline queue
+ */
+void queueReading(uint8_t reading)
   {
-  EEPROM.get(0,settings);
-  if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
-    {
-    settingsAreValid=true;
-    if (settings.debug)
+  if (rtc.queueCount==RTC_QUEUE_SIZE)
+    spillQueue();
+
+  if (rtc.queueCount==RTC_QUEUE_SIZE) //no room anywhere
+    {
+    rtc.droppedCount++;
+    if (settings.queueDropPolicy==QUEUE_DROP_NEWEST)
       {
-      Serial.println("Loaded configuration values from EEPROM");
+      saveRtc();
+      return;
       }
-//    showSettings();
+    rtc.queueHead=(rtc.queueHead+1)%RTC_QUEUE_SIZE; //lose the oldest
+    rtc.queueCount--;
     }
-  else
+
+  queuedReading* q=&rtc.queue[(rtc.queueHead+rtc.queueCount)%RTC_QUEUE_SIZE];
+  q->seconds=deviceSeconds();
+  q->reading=reading;
+  q->analogLevel=analogLevel;
+  q->epoch=rtc.clockEpoch;
+  rtc.queueCount++;
+  rtc.queuedCount++;
+  saveRtc();
+  if (settings.debug)
     {
-    Serial.println("Skipping load from EEPROM, device not configured.");    
-    settingsAreValid=false;
+    Serial.print("Queued reading, ");
+    Serial.print(queueLength());
+    Serial.println(" waiting.");
     }
   }
 
-/**
- * Handler for incoming MQTT messages.  The payload is the command to perform. 
- * The MQTT message topic sent is the topic root plus the command.
- * Implemented commands are: 
- * MQTT_PAYLOAD_SETTINGS_COMMAND: sends a JSON payload of all user-specified settings
- * MQTT_PAYLOAD_REBOOT_COMMAND: Reboot the controller
- * MQTT_PAYLOAD_VERSION_COMMAND Show the version number
- * MQTT_PAYLOAD_STATUS_COMMAND Show the most recent flow values
- * 
- * Note that unless sleeptime is zero, any MQTT command must be sent in the short time
- * between connecting to the MQTT server and going to sleep.  In this case it is best
- * to send the command with the "retain" flag on. Be sure to remove the retained message
- * after it has been received by sending a new empty message with the retained flag set.
+uint32_t queueLength()
+  {
+  return rtc.queueCount+(queueFileOk?queueFile.count:0);
+  }
+
+/*
+ * Send one queued reading to the history topic, with its age in seconds.  The age
+ * is -1 if it was taken before a power cycle, since we have no idea how long ago that was.
  */
-void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+boolean publishQueuedReading(queuedReading* q)
   {
-  if (settings.debug)
-    {
-    Serial.print("*************************** Received topic ");
-    Serial.println(reqTopic);
-    }
-  payload[length]='\0'; //this should have been done in the caller code, shouldn't have to do it here
-  boolean rebootScheduled=false; //so we can reboot after sending the reboot response
-  char charbuf[100];
-  sprintf(charbuf,"%s",reqTopic);
-  char* response;
-  char topic[MQTT_TOPIC_SIZE];
+  long age=(q->epoch==rtc.clockEpoch)?(long)(deviceSeconds()-q->seconds):-1;
 
-  //General command?
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
-  if (strcmp(charbuf,topic)==0) //then we have received a command
+  return publishJson(topics[TOPIC_HISTORY].name,[q,age](JsonWriter& json)
     {
-    sprintf(charbuf,"%s",payload);
-  
-    //if the command is MQTT_PAYLOAD_SETTINGS_COMMAND, send all of the settings
-    if (strcmp(charbuf,MQTT_PAYLOAD_SETTINGS_COMMAND)==0)
-      {
-      char tempbuf[35]; //for converting numbers to strings
-      char jsonStatus[JSON_STATUS_SIZE];
-      
-      strcpy(jsonStatus,"{");
-      strcat(jsonStatus,"\"broker\":\"");
-      strcat(jsonStatus,settings.mqttBrokerAddress);
-      strcat(jsonStatus,"\", \"port\":");
-      sprintf(tempbuf,"%d",settings.mqttBrokerPort);
-      strcat(jsonStatus,tempbuf);
-      strcat(jsonStatus,", \"topicroot\":\"");
-      strcat(jsonStatus,settings.mqttTopicRoot);
-      strcat(jsonStatus,"\", \"user\":\"");
-      strcat(jsonStatus,settings.mqttUsername);
-      strcat(jsonStatus,"\", \"pass\":\"");
-      strcat(jsonStatus,settings.mqttPassword);
-      strcat(jsonStatus,"\", \"ssid\":\"");
-      strcat(jsonStatus,settings.ssid);
-      strcat(jsonStatus,"\", \"wifipass\":\"");
-      strcat(jsonStatus,settings.wifiPassword);
-      strcat(jsonStatus,"\", \"mqttClientId\":\"");
-      strcat(jsonStatus,settings.mqttClientId);
-      strcat(jsonStatus,"\", \"reportPeriod\":\"");
-      sprintf(tempbuf,"%lu",settings.reportPeriod);
-      strcat(jsonStatus,tempbuf);
-      strcat(jsonStatus,"\", \"staticaddress\":\"");
-      strcat(jsonStatus,settings.staticIP);
-      strcat(jsonStatus,"\", \"netmask\":\"");
-      strcat(jsonStatus,settings.netmask);
-      strcat(jsonStatus,"\", \"gateway\":\"");
-      strcat(jsonStatus,settings.gateway);
-      strcat(jsonStatus,"\", \"dns\":\"");
-      strcat(jsonStatus,settings.dns);
-      strcat(jsonStatus,"\", \"debug\":\"");
-      strcat(jsonStatus,settings.debug?"true":"false");
-      strcat(jsonStatus,"\", \"localIP\":\"");
-      strcat(jsonStatus,WiFi.localIP().toString().c_str());
-
-      strcat(jsonStatus,"\"}");
-      response=jsonStatus;
-      }
-    else if (strcmp(charbuf,MQTT_PAYLOAD_VERSION_COMMAND)==0) //show the version number
-      {
-      char tmp[15];
-      strcpy(tmp,VERSION);
-      response=tmp;
-      }
-    else if (strcmp(charbuf,MQTT_PAYLOAD_STATUS_COMMAND)==0) //show the latest value
-      {
-      report();
-      
-      char tmp[25];
-      strcpy(tmp,"Status report complete");
-      response=tmp;
-      }
-    else if (strcmp(charbuf,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
-      {
-      char tmp[10];
-      strcpy(tmp,"REBOOTING");
-      response=tmp;
-      rebootScheduled=true;
-      }
-    else if (processCommand(charbuf))
-      {
-      char tmp[3];
-      strcpy(tmp,"OK");
-      response=tmp;
-      }
+    json.beginObject();
+    json.addLong("value",q->reading);
+    if (settings.sensorCount==1 && !settings.analogEnabled)
+      json.addString("level",q->reading?MQTT_PAYLOAD_SENSOR_WET:MQTT_PAYLOAD_SENSOR_DRY);
     else
+      buildLevelsJson(json,q->reading,q->analogLevel,"level");
+    json.addLong("age",age);
+    json.endObject();
+    },false);
+  }
+
+/*
+ * Send up to QUEUE_FLUSH_BATCH queued readings, oldest first
+ */
+void flushQueue()
+  {
+  int sent=0;
+  if (queueFileOk && queueFile.count>0)
+    {
+    File f=LittleFS.open(QUEUE_FILE_NAME,"r+");
+    if (f)
       {
-      char badCmd[18];
-      strcpy(badCmd,"(empty)");
-      response=badCmd;
-      }
-      
-    char topic[MQTT_TOPIC_SIZE];
-    strcpy(topic,settings.mqttTopicRoot);
-    strcat(topic,charbuf); //the incoming command becomes the topic suffix
-  
-    if (!publish(topic,response,false)) //do not retain
-      {
-      int code=mqttClient.state();
-      Serial.print("************ Failure ");
-      Serial.print(code);
-      Serial.println(" when publishing command response!");
+      queuedReading q;
+      while (sent<QUEUE_FLUSH_BATCH && queueFile.count>0)
+        {
+        if (!seekQueueSlot(f,queueFile.head)
+            || f.read((uint8_t*)&q,sizeof(q))!=sizeof(q)
+            || !publishQueuedReading(&q))
+          break;
+        queueFile.head=(queueFile.head+1)%queueFile.depth;
+        queueFile.count--;
+        rtc.flushedCount++;
+        sent++;
+        }
+      writeQueueHeader(f);
+      f.close();
       }
-
-    delay(2000); //give publish time to complete
     }
 
-  if (rebootScheduled)
+  while (sent<QUEUE_FLUSH_BATCH && rtc.queueCount>0)
     {
-    ESP.restart();
+    if (!publishQueuedReading(&rtc.queue[rtc.queueHead]))
+      break;
+    rtc.queueHead=(rtc.queueHead+1)%RTC_QUEUE_SIZE;
+    rtc.queueCount--;
+    rtc.flushedCount++;
+    sent++;
     }
+
+  if (sent>0)
+    saveRtc();
+  }
+
+void showQueue()
+  {
+  Serial.print("Offline queue has ");
+  Serial.print(queueLength());
+  Serial.print(" readings, queued=");
+  Serial.print(rtc.queuedCount);
+  Serial.print(" dropped=");
+  Serial.print(rtc.droppedCount);
+  Serial.print(" flushed=");
+  Serial.println(rtc.flushedCount);
   }
 
 /*
- * Save the settings object to EEPROM and publish a "show settings" command.
+ * Move the network state machine to a new phase and start timing it
  */
-void saveAndShow()
+void setWifiState(int newState)
   {
-  saveSettings();
-  char topic[MQTT_TOPIC_SIZE];
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,MQTT_TOPIC_COMMAND_REQUEST); //Send ourself the command to display settings
-
-  if (!publish(topic,(char*)MQTT_PAYLOAD_SETTINGS_COMMAND,false)) //do not retain
-    Serial.println("************ Failure when publishing show settings response!");
+  if (settings.debug)
+    {
+    Serial.print("WiFi state ");
+    Serial.print(wifiStateNames[wifiState]);
+    Serial.print(" -> ");
+    Serial.println(wifiStateNames[newState]);
+    }
+  wifiState=newState;
+  wifiPhaseStart=millis();
   }
 
-boolean inRange()
+/*
+ * Give up on the current connection attempt. We'll start over with a new scan
+ * after WIFI_RETRY_INTERVAL.
+ */
+void wifiFail(const char* why)
   {
-  if (ssidAvailable)
-    return(true); //already found it
+  if (settings.debug)
+    Serial.println(why);
+  counters[COUNTER_WIFI_FAILURES]++;
+  WiFi.disconnect();
+  if (wifiFastConnect)
+    {
+    // The cached access point didn't work. Forget it and do a full scan right away.
+    if (settings.debug)
+      Serial.println("Fast connect failed, falling back to a full scan.");
+    wifiFastConnect=false;
+    forgetWifiConnection();
+    wifiFirstAttempt=true;
+    }
+  setWifiState(WIFI_STATE_IDLE);
+  }
 
+/*
+ * Look through the completed scan results for our SSID
+ */
+boolean inRange(int n)
+  {
   boolean avail=false;  //temporary found flag
 
-  if (settings.debug)
-    Serial.println("scan start");
-  
-  int n = WiFi.scanNetworks();
   if (settings.debug)
     {
     Serial.println("scan done");
     if (n == 0)
       Serial.println("no networks found");
     else
+      {
       Serial.print("Found ");
       Serial.print(n);
       Serial.println(" WiFi access points:\n");
+      }
     }
-  if (n>0)
+  for (int i=0;i<n;++i)
     {
-    for (int i=0;i<n;++i)
+    if(WiFi.SSID(i) == settingString(STRING_SSID))
       {
-      if(WiFi.SSID(i) == settings.ssid)
-        {
-        avail=true;  //remember it, but don't quit looking
-        if (settings.debug)
-          {
-          Serial.print("Found target SSID: ");
-          }
-        }
+      avail=true;  //remember it, but don't quit looking
       if (settings.debug)
         {
-        Serial.println(WiFi.SSID(i));// Print SSID for each network found
+        Serial.print("Found target SSID: ");
         }
       }
     if (settings.debug)
       {
-      Serial.println();
+      Serial.println(WiFi.SSID(i));// Print SSID for each network found
       }
     }
-  ssidAvailable=avail?true:false;  //advertise if we found it or not
+  if (settings.debug)
+    {
+    Serial.println();
+    }
+  WiFi.scanDelete(); //free the scan results
   return avail;
   }
 
-void connectToWiFi()
+/*
+ * Start associating with the access point.  If we have a cached access point and
+ * lease then go straight to that one without scanning or asking for an address.
+ */
+void beginAssociation()
   {
-    if (wifiConnecting && WiFi.status() == WL_CONNECTED)
-      {
-      wifiConnecting=false;
-      if (settings.debug)
-        {
-        Serial.print("Connected to WiFi with address ");
-        Serial.println(WiFi.localIP());
-        }
-      }
-
-  if (WiFi.status()==WL_CONNECTED || !inRange())
-    return;  //don't bother
-
-  if (connectTryCount++ >= 100)  //give up after a while
+  if (settings.debug)
     {
-    ssidAvailable=false;
-    connectTryCount=0;
+    Serial.print("Attempting to connect to WPA SSID \"");
+    Serial.print(settingString(STRING_SSID));
+    Serial.print("\" using ");
+    Serial.println(strlen(settingString(STRING_STATIC_IP))>0?settingString(STRING_STATIC_IP):"DHCP");
+    }
+  WiFi.hostname(MY_HOSTNAME);
 
-    if (settings.debug)
-      Serial.println("Timeout trying to connect to wifi.");
-    
-    return;
+  //If a static IP address is specified then use it
+  if (staticIP && gateway && subnet && dns)
+    {
+    WiFi.disconnect();  //Prevent connecting to wifi based on previous configuration
+    Serial.print("...connecting with static address ");
+    Serial.println(settingString(STRING_STATIC_IP));
+    WiFi.config(staticIP, gateway, subnet, dns);
+    }
+  else if (staticIP && gateway && subnet)
+    {
+    WiFi.disconnect();  //Prevent connecting to wifi based on previous configuration
+    Serial.print("...connecting (no DNS) with static address ");
+    Serial.println(settingString(STRING_STATIC_IP));
+    WiFi.config(staticIP, gateway, subnet);
+    }
+  else if (wifiFastConnect)
+    {
+    WiFi.config(IPAddress(rtc.localIP), IPAddress(rtc.gatewayIP), IPAddress(rtc.subnetMask), IPAddress(rtc.dnsIP));
     }
   else
     {
-    delay(500); //delay only during connect process
+    WiFi.config(IPAddress(0,0,0,0), IPAddress(0,0,0,0), IPAddress(0,0,0,0)); //use DHCP
     }
-  // ********************* attempt to connect to Wifi network
 
-  if (!wifiConnecting)
+  wifiAssociated=false;
+  if (wifiFastConnect)
     {
     if (settings.debug)
       {
-      Serial.print("Attempting to connect to WPA SSID \"");
-      Serial.print(settings.ssid);
-      Serial.print("\" using ");
-      Serial.println(settings.staticIP?settings.staticIP:"DHCP");
+      Serial.print("...fast connecting on channel ");
+      Serial.println(rtc.channel);
       }
-    WiFi.hostname(MY_HOSTNAME);
+    WiFi.begin(settingString(STRING_SSID), settingString(STRING_WIFI_PASSWORD), rtc.channel, rtc.bssid);
+    }
+  else
+    WiFi.begin(settingString(STRING_SSID), settingString(STRING_WIFI_PASSWORD));
+  setWifiState(WIFI_STATE_ASSOCIATING);
+  }
 
-    //If a static IP address is specified then use it
-    if (staticIP && gateway && subnet && dns)
-      {
-      WiFi.disconnect();  //Prevent connecting to wifi based on previous configuration
-      Serial.print("...connecting with static address ");
-      Serial.println(settings.staticIP);
-      WiFi.config(staticIP, gateway, subnet, dns);
-      }
-    else if (staticIP && gateway && subnet)
-      {
-      WiFi.disconnect();  //Prevent connecting to wifi based on previous configuration
-      Serial.print("...connecting (no DNS) with static address ");
-      Serial.println(settings.staticIP);
-      WiFi.config(staticIP, gateway, subnet);
-      }
+/*
+ * Step the network connection state machine: scan, associate, get an address 
+ * (DHCP or static), then connect to the MQTT broker.  Never blocks.
+ */
+void connectToWiFi()
+  {
+  unsigned long phaseMillis=millis()-wifiPhaseStart;
 
-    WiFi.begin(settings.ssid, settings.wifiPassword);
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
-    wifiConnecting=true;
-    }
-  if (WiFi.status() != WL_CONNECTED && wifiConnecting) 
+  switch (wifiState)
     {
-    // not yet connected
-    if (settings.debug)
+    case WIFI_STATE_IDLE:
+      if (!wifiFirstAttempt && millis()-wifiLastAttempt < WIFI_RETRY_INTERVAL)
+        break; //wait a while before trying again
+      wifiFirstAttempt=false;
+      wifiLastAttempt=millis();
+      WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+      if (rtc.wifiValid && leaseExpired())
+        forgetWifiConnection();
+      wifiFastConnect=rtc.wifiValid;
+      if (wifiFastConnect)
+        {
+        connectTimes.scanMillis=0;
+        beginAssociation();
+        break;
+        }
+      if (settings.debug)
+        Serial.println("scan start");
+      WiFi.scanNetworks(true); //asynchronous, we'll poll for the result
+      setWifiState(WIFI_STATE_SCANNING);
+      break;
+
+    case WIFI_STATE_SCANNING:
       {
-      Serial.print(".");
+      int n=WiFi.scanComplete();
+      if (n==WIFI_SCAN_RUNNING)
+        {
+        if (phaseMillis > WIFI_SCAN_TIMEOUT)
+          wifiFail("Timeout waiting for WiFi scan.");
+        break;
+        }
+      connectTimes.scanMillis=phaseMillis;
+      if (n<0)
+        wifiFail("WiFi scan failed.");
+      else if (!inRange(n))
+        wifiFail("Target SSID not found.");
+      else
+        beginAssociation();
+      break;
       }
-//    checkForCommand(); // Check for input in case something needs to be changed to work
-    }
-  
-  
-  // ********************* Initialize the MQTT connection
-  mqttClient.setBufferSize(JSON_STATUS_SIZE);
-  mqttClient.setServer(settings.mqttBrokerAddress, settings.mqttBrokerPort);
-  mqttClient.setCallback(incomingMqttHandler);
-//    mqttReconnect();  // connect to the MQTT broker
 
+    case WIFI_STATE_ASSOCIATING:
+      if (wifiAssociated)
+        {
+        connectTimes.associateMillis=phaseMillis;
+        setWifiState(WIFI_STATE_ADDRESSING);
+        }
+      else if (phaseMillis > (wifiFastConnect?WIFI_FAST_CONNECT_TIMEOUT:WIFI_CONNECT_TIMEOUT))
+        wifiFail("Timeout trying to connect to wifi.");
+      else if (settings.debug)
+        Serial.print(".");
+      break;
+
+    case WIFI_STATE_ADDRESSING:
+      if (WiFi.status()==WL_CONNECTED)
+        {
+        connectTimes.addressMillis=phaseMillis;
+        if (settings.debug)
+          {
+          Serial.print("Connected to WiFi with address ");
+          Serial.println(WiFi.localIP());
+          }
+        cacheWifiConnection();
+        setWifiState(WIFI_STATE_MQTT);
+        }
+      else if (!wifiAssociated || phaseMillis > (wifiFastConnect?WIFI_FAST_CONNECT_TIMEOUT:WIFI_CONNECT_TIMEOUT))
+        wifiFail("Timeout getting an IP address.");
+      break;
+
+    case WIFI_STATE_MQTT:
+      // Wait for the first broker connection attempt. If that fails the mqtt task will keep trying.
+      if (mqttState!=MQTT_STATE_CONNECTED && mqttState!=MQTT_STATE_BACKOFF)
+        break;
+      if (mqttState==MQTT_STATE_CONNECTED)
+        {
+        connectTimes.mqttMillis=millis()-wifiPhaseStart;
+        recordElapsed(TIMING_CONNECT,(millis()-wifiLastAttempt)*1000);
+        }
+      else if (wifiFastConnect)
+        forgetWifiConnection(); //the cached lease may be stale, get a fresh one next time
+      counters[COUNTER_WIFI_CONNECTS]++;
+      setWifiState(WIFI_STATE_CONNECTED);
+      if (settings.debug)
+        showConnectTimes();
+      break;
+
+    case WIFI_STATE_CONNECTED:
+      if (WiFi.status()!=WL_CONNECTED)
+        {
+        if (settings.debug)
+          Serial.println("Lost WiFi connection.");
+        setWifiState(WIFI_STATE_IDLE);
+        }
+      else if (wifiFastConnect && leaseExpired())
+        {
+        // We've been using the cached address as if it were static, so nothing
+        // will renew it.  Connect again and get a fresh lease.
+        if (settings.debug)
+          Serial.println("The cached address lease has run out, connecting again.");
+        forgetWifiConnection();
+        WiFi.disconnect();
+        wifiFirstAttempt=true;
+        setWifiState(WIFI_STATE_IDLE);
+        }
+      break;
+    }
   }
 
 void setup() 
   {
-  pinMode(SENSOR_PORT,INPUT_PULLUP); //The liquid level sensor has an open collector output
   pinMode(WIFI_LED_PORT,OUTPUT);// The blue light on the board shows wifi activity
   digitalWrite(WIFI_LED_PORT,LED_OFF);// Turn it off
   pinMode(WARNING_LED_PORT_RED,OUTPUT);// The yellow light on the board shows low tank
@@ -814,38 +3971,55 @@ void setup()
   
   while (!Serial); // wait here for serial port to connect.
 
-  EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
-  if (settings.debug)
+  if (!LittleFS.begin()) //the settings journal and the offline queue live here
+    Serial.println("Unable to mount the file system.");
+  loadSettings(); //set the values from flash
+  attachSensors(); //now we know how many there are
+  if (!parseBrokers(settingString(STRING_BACKUP_BROKERS)))
+    parseBrokers("");
+  if (!parseCalibration(settingString(STRING_ANALOG_CALIBRATION)))
+    parseCalibration(DEFAULT_ANALOG_CALIBRATION);
+  if (settings.analogEnabled)
     {
-    Serial.print("Settings object size=");
-    Serial.println(sizeof(settings));
+    primeAnalog(); //before the radio starts up
+    tasks[TASK_ADC].enabled=true;
     }
-    
-  commandString.reserve(200); // reserve 200 bytes of serial buffer space for incoming command string
-
-  loadSettings(); //set the values from eeprom
-  if (settings.mqttBrokerPort < 0) //then this must be the first powerup
+  boolean rtcValid=loadRtc(); //and the fast connect data and offline queue from RTC memory
+  restorePulseTotal(rtcValid);
+  attachPulseCounter();
+  openQueueFile(!rtcValid);
+  setTaskInterval(TASK_REPORT,reportInterval());
+  runTaskNow(TASK_REPORT); //report as soon as we can after boot
+  if (settings.sleepTime>0 && settingsAreValid)
     {
-    Serial.println("\n*********************** Resetting All EEPROM Values ************************");
-    initializeSettings();
-    saveSettings();
-    delay(2000);
-    ESP.restart();
+    // In deep sleep mode we report once per wake, from the sleep task
+    tasks[TASK_REPORT].enabled=false;
+    tasks[TASK_SLEEP].enabled=true;
+    if (rtc.sensorValid)
+      {
+      rtc.wakeCount++;
+      resetDebounce(rtc.lastReading);
+      }
     }
-
   if (settingsAreValid)
     {
     showSettings();
     }
 
-  if (sizeof(settings.staticIP)>0)
-    staticIP.fromString(settings.staticIP);
-  if (sizeof(settings.netmask)>0)
-    subnet.fromString(settings.netmask);
-  if (sizeof(settings.gateway)>0)
-    gateway.fromString(settings.gateway);
-  if (sizeof(settings.dns)>0)
-    dns.fromString(settings.dns);
+  staticIP.fromString(settingString(STRING_STATIC_IP));
+  subnet.fromString(settingString(STRING_NETMASK));
+  gateway.fromString(settingString(STRING_GATEWAY));
+  dns.fromString(settingString(STRING_DNS));
+
+  WiFi.persistent(false); //we keep our own copy of the credentials, don't rewrite flash on every connect
+  wifiAssociatedHandler=WiFi.onStationModeConnected([](const WiFiEventStationModeConnected& event)
+    {
+    wifiAssociated=true;
+    });
+  wifiDisassociatedHandler=WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected& event)
+    {
+    wifiAssociated=false;
+    });
 
   ArduinoOTA.onStart([]() 
     {
@@ -860,6 +4034,7 @@ void setup()
       }
 
     // NOTE: if updating FS this would be the place to unmount FS using FS.end()
+    flushSettings(); //we restart when it's done
     Serial.println("Start updating " + type);
     });
   ArduinoOTA.onEnd([]() 
@@ -901,11 +4076,34 @@ void setup()
   }
 
 
-void loop() 
+/*
+ * The scheduled tasks.  Each one does a small piece of work and returns.
+ */
+void sensorTask()
   {
-  checkForCommand(); // Check for serial input in case something needs to be changed
+  unsigned long start=micros();
   readSensor();      // Take a reading
+  recordTiming(TIMING_READ_SENSOR,start);
+
+  if (settings.reportMode==REPORT_MODE_CHANGE 
+      && settingsAreValid 
+      && tasks[TASK_REPORT].enabled 
+      && readingChanged())
+    runTaskNow(TASK_REPORT); //report the change right away, this also restarts the heartbeat
+  }
+
+void ledTask()
+  {
+  updateLeds();
+  }
 
+void serialTask()
+  {
+  checkForCommand(); // Check for serial input in case something needs to be changed
+  }
+
+void otaTask()
+  {
   if (WiFi.status()==WL_CONNECTED)
     {
     digitalWrite(WIFI_LED_PORT,LED_ON);
@@ -913,19 +4111,209 @@ void loop()
     }
   else
     digitalWrite(WIFI_LED_PORT,LED_OFF);
-  
+  }
+
+void wifiTask()
+  {
+  if (settingsAreValid) 
+    connectToWiFi(); //try to connect if available
+  }
+
+void mqttTask()
+  {
+  if (!settingsAreValid)
+    return;
+  stepMqttConnection();
+  if (mqttClient.connected())
+    mqttClient.loop(); //This has to happen every so often or we can't receive messages
+  }
 
+void reportTask()
+  {
   if (settingsAreValid) 
     {
-    if (millis()>=nextReport)
-      {
-      connectToWiFi(); //try to connect if available
+    unsigned long start=micros();
+    report();    
+    recordTiming(TIMING_REPORT,start);
+
+    if (settings.debug)
+      showTimings();
+    }
+  }
+
+void restartTask()
+  {
+  if (publishCount>0 && mqttClient.connected())
+    return; //send the responses first, the publish task won't wait on them for long
+  samplePulses();
+  savePulseTotal();
+  flushSettings();
+  rtc.clockBase=deviceSeconds(); //keep the device clock going
+  saveRtc();
+  Serial.flush();
+  ESP.restart();
+  }
+
+void settingsTask()
+  {
+  tasks[TASK_SETTINGS].enabled=false;
+  flushSettings();
+  }
+
+/*
+ * Keep track of the heap low water mark, and send the metrics every metricsPeriod
+ * seconds if that's set
+ */
+unsigned long lastMetricsReport=0;
+
+void metricsTask()
+  {
+  uint32_t heap=ESP.getFreeHeap();
+  if (heap<minFreeHeap)
+    minFreeHeap=heap;
+
+  if (settings.metricsPeriod>0 
+      && mqttClient.connected()
+      && millis()-lastMetricsReport>=settings.metricsPeriod*1000)
+    {
+    lastMetricsReport=millis();
+    if (!publishMetrics())
+      Serial.println("************ Failure when publishing metrics!");
+    }
+  }
+
+/*
+ * One read of the analog sensor, when the radio is quiet
+ */
+void adcTask()
+  {
+  if (radioBusy())
+    {
+    counters[COUNTER_ADC_DEFERRED]++;
+    return;
+    }
+  adcSum+=analogRead(A0);
+  if (++adcReads<ANALOG_OVERSAMPLE)
+    return;
+  addAnalogSample(adcSum);
+  adcSum=0;
+  adcReads=0;
+  }
+
+void pulseTask()
+  {
+  samplePulses();
+  if (millis()-pulseSavedAt >= PULSE_SAVE_INTERVAL*1000UL)
+    savePulseTotal();
+  }
+
+void publishTask()
+  {
+  stepPublishPipeline();
+  }
+
+void queueTask()
+  {
+  if (queueLength()>0 && mqttClient.connected())
+    flushQueue();
+  }
+
+/*
+ * Save what we need to remember in RTC memory and go into deep sleep.  The RST pin
+ * must be wired to D0 (GPIO16) for the timer to wake us up again.
+ */
+void goToSleep()
+  {
+  rtc.lastReading=lastReading;
+  rtc.sensorValid=1;
+  rtc.secondsSinceReport+=settings.sleepTime+millis()/1000;
+  rtc.clockBase=deviceSeconds()+settings.sleepTime;
+  samplePulses();
+  savePulseTotal();
+  saveRtc();
+  flushSettings();
+  if (settings.debug)
+    {
+    Serial.print("Sleeping for ");
+    Serial.print(settings.sleepTime);
+    Serial.print(" seconds after ");
+    Serial.print(millis());
+    Serial.println("ms awake");
+    }
+  mqttClient.disconnect();
+  Serial.flush();
+  ESP.deepSleep((uint64_t)settings.sleepTime*1000000);
+  }
+
+/*
+ * The deep sleep duty cycle.  Once we are connected to the broker, send a report,
+ * then stay awake a little while longer to receive any retained commands.  Sleep
+ * when that's done, or if we can't connect at all.
+ */
+boolean reportedThisWake=false;
+unsigned long reportedAt=0;
+
+void sleepTask()
+  {
+  if (settings.sleepTime==0 || !settingsAreValid) //turned off by a command, revert to staying awake
+    {
+    tasks[TASK_SLEEP].enabled=false;
+    tasks[TASK_REPORT].enabled=true;
+    return;
+    }
+  if (tasks[TASK_RESTART].enabled)
+    return; //a restart is pending, let it happen
+
+  // In change mode, if nothing has changed and no heartbeat is due then there's
+  // no reason to turn on the radio.  Retained commands will be picked up on the
+  // next wake that does report.
+  if (!reportedThisWake 
+      && settings.reportMode==REPORT_MODE_CHANGE 
+      && rtc.reportCount>0 //always report after a power up
+      && !readingChanged()
+      && rtc.secondsSinceReport+millis()/1000 < settings.heartbeatPeriod)
+    {
+    // The filter was started off at the reading from before we slept.  If the
+    // sensors read differently now it may yet come round to them, so give it time.
+    if (sensorLevels!=lastReading && millis()<debounceSettleMillis())
+      return;
+    goToSleep();
+    return;
+    }
+
+  if (!reportedThisWake && mqttClient.connected())
+    {
+    unsigned long start=micros();
+    report();
+    recordTiming(TIMING_REPORT,start);
+    reportedThisWake=true;
+    reportedAt=millis();
+    }
 
-      // may need to reconnect to the MQTT broker. This is true even if the report is 
-      // already sent, because a MQTT command may come in
-      mqttReconnect();  
-      report();    
-      nextReport=millis()+settings.reportPeriod*1000;
+  if (reportedThisWake 
+      && millis()-reportedAt >= SLEEP_COMMAND_WINDOW
+      && ((queueLength()==0 && publishCount==0) || !mqttClient.connected()))
+    goToSleep();
+  else if (millis() >= SLEEP_MAX_AWAKE_TIME) //millis() can't wrap before then
+    {
+    if (!reportedThisWake)
+      {
+      if (settings.debug)
+        Serial.println("Unable to report, going back to sleep.");
+      report(); //this will queue it
       }
-    } 
-  }
\ No newline at end of file
+    goToSleep();
+    }
+  }
+
+void loop() 
+  {
+  unsigned long loopStart=micros();
+  boolean busy=runTasks();
+  recordTiming(TIMING_LOOP,loopStart);
+
+  // Nothing to do, so let the CPU idle for a moment. Sensor changes are caught
+  // by the interrupt handler in the meantime.
+  if (!busy)
+    delay(1);
+  }
@@ -0,0 +1,222 @@
+// Benchmarks for the main code paths, run on the host with
+// "pio test -e native -f test_benchmark -v".
+//
+// The firmware runs on the stand-ins in lib/NativeHal with simulated time, so the
+// figures are host CPU time for our own logic, without the radio or flash.  They
+// won't match a d1_mini, but they move when the code does, which is what they're
+// for.  Each path is called on its own for a per-call cost, then loop() is run
+// through ten simulated minutes of sloshing sensors, commands and a broker outage
+// for the worst single pass.  Worst cases include whatever else the host was
+// doing at the time, so compare them over a few runs.
+
+#include <Arduino.h>
+#include <chrono>
+#include <unity.h>
+#include "nativeHal.h"
+#include "tankReporter.h"
+
+// From src/main.cpp
+struct command;
+const char* processCommand(char* cmd, boolean fromMqtt, const command** matched);
+void readSensor();
+uint8_t debounce(uint8_t reading, uint32_t now);
+void report();
+void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length);
+
+#define BENCH_TOPIC_ROOT "tank/"
+#define BENCH_RESULTS 12
+
+typedef struct
+  {
+  const char* name;
+  unsigned long calls;
+  double totalMicros;
+  double worstMicros;
+  } benchResult;
+
+benchResult results[BENCH_RESULTS];
+int resultCount=0;
+
+/*
+ * Time each of calls calls of run, doing between (untimed) after each one
+ */
+template <typename Run, typename Between>
+benchResult* bench(const char* name, unsigned long calls, Run run, Between between)
+  {
+  TEST_ASSERT_LESS_THAN(BENCH_RESULTS,resultCount);
+  benchResult* r=&results[resultCount++];
+  *r={name,0,0,0};
+  for (unsigned long i=0;i<calls;i++)
+    {
+    std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+    run(i);
+    double us=std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now()-start).count();
+    r->calls++;
+    r->totalMicros+=us;
+    if (us>r->worstMicros)
+      r->worstMicros=us;
+    between(i);
+    }
+  return r;
+  }
+
+/*
+ * Run loop() for the given simulated time, a millisecond a pass
+ */
+void runFor(unsigned long ms)
+  {
+  for (unsigned long i=0;i<ms;i++)
+    {
+    loop();
+    halAdvanceMillis(1);
+    }
+  }
+
+void runCommand(const char* text)
+  {
+  char cmd[SERIAL_COMMAND_SIZE];
+  snprintf(cmd,sizeof(cmd),"%s",text);
+  processCommand(cmd,false,NULL);
+  }
+
+void setUp()
+  {
+  }
+
+void tearDown()
+  {
+  char discard[256];
+  while (halSerialOutput(discard,sizeof(discard))>0)
+    ; //nobody is reading it
+  }
+
+void test_connects()
+  {
+  setup();
+  runCommand("ssid=" HAL_SSID);
+  runCommand("wifipass=secret");
+  runCommand("broker=broker.local");
+  runCommand("topicroot=" BENCH_TOPIC_ROOT);
+  runCommand("reportperiod=60");
+  for (int i=0;i<30 && !halMqttConnected();i++)
+    runFor(1000);
+  TEST_ASSERT_TRUE(halMqttConnected());
+  }
+
+void test_readSensor()
+  {
+  bench("readSensor",20000,[](unsigned long i)
+    {
+    readSensor();
+    },[](unsigned long i)
+    {
+    halSetPin(SENSOR_PORT,(i/7)&1); //an edge every few calls
+    halAdvanceMillis(1);
+    });
+  }
+
+void test_debounce()
+  {
+  static const char* const filters[]={"filter=holdoff","filter=integrator","filter=majority","filter=exponential"};
+  for (int f=0;f<4;f++)
+    {
+    runCommand(filters[f]);
+    bench(filters[f]+strlen("filter="),100000,[](unsigned long i)
+      {
+      debounce((i/37)&1,micros());
+      },[](unsigned long i)
+      {
+      halAdvanceMicros(500);
+      });
+    }
+  runCommand("filter=holdoff");
+  }
+
+void test_processCommand()
+  {
+  static const char* const commands[]={"version","heartbeat=3600","debug=0","reportmode=periodic","nosuchcommand"};
+  bench("processCommand",10000,[](unsigned long i)
+    {
+    runCommand(commands[i%5]);
+    },[](unsigned long i)
+    {
+    });
+  runFor(10000); //let the settings be written
+  }
+
+void test_report()
+  {
+  unsigned long before=halMqttPublishCount();
+  bench("report",10000,[](unsigned long i)
+    {
+    report();
+    },[](unsigned long i)
+    {
+    });
+  TEST_ASSERT_GREATER_THAN(before,halMqttPublishCount());
+  }
+
+void test_incomingMqttHandler()
+  {
+  unsigned long before=halMqttPublishCount();
+  bench("incomingMqttHandler",2000,[](unsigned long i)
+    {
+    char topic[]=BENCH_TOPIC_ROOT MQTT_TOPIC_COMMAND_REQUEST;
+    char payload[]=MQTT_PAYLOAD_VERSION_COMMAND;
+    incomingMqttHandler(topic,(byte*)payload,strlen(payload));
+    },[](unsigned long i)
+    {
+    runFor(20); //send the response
+    });
+  TEST_ASSERT_GREATER_OR_EQUAL(before+2000,halMqttPublishCount());
+  }
+
+/*
+ * Ten simulated minutes: the tank sloshes for a minute at a time, a command comes
+ * in over MQTT every few seconds and over the serial port now and then, and the
+ * broker goes away for half a minute
+ */
+void test_loop()
+  {
+  bench("loop",600000,[](unsigned long ms)
+    {
+    loop();
+    },[](unsigned long ms)
+    {
+    unsigned long second=ms/1000;
+    if (second%120<60 && ms%40==0)
+      halSetPin(SENSOR_PORT,(ms/40)&1);
+    if (ms%3000==1500)
+      halMqttDeliver(BENCH_TOPIC_ROOT MQTT_TOPIC_COMMAND_REQUEST,MQTT_PAYLOAD_STATUS_COMMAND);
+    if (ms%20000==10000)
+      halSerialInput("version\r\n");
+    if (ms==200000)
+      halSetBroker(false);
+    if (ms==230000)
+      halSetBroker(true);
+    halAdvanceMillis(1);
+    });
+  TEST_ASSERT_TRUE(halMqttConnected()); //and came back after the outage
+  }
+
+void test_show_results()
+  {
+  printf("\n%-22s %10s %12s %12s\n","","calls","mean us","worst us");
+  for (int i=0;i<resultCount;i++)
+    printf("%-22s %10lu %12.3f %12.3f\n",results[i].name,results[i].calls,
+           results[i].totalMicros/results[i].calls,results[i].worstMicros);
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_connects);
+  RUN_TEST(test_readSensor);
+  RUN_TEST(test_debounce);
+  RUN_TEST(test_processCommand);
+  RUN_TEST(test_report);
+  RUN_TEST(test_incomingMqttHandler);
+  RUN_TEST(test_loop);
+  RUN_TEST(test_show_results);
+  return UNITY_END();
+  }
@@ -0,0 +1,255 @@
+// Replay tests and a benchmark for the debounce filters, on the host:
+// "pio test -e native -f test_debounce -v".
+//
+// Each trace in traces.h is fed to each filter the way the firmware feeds it: an
+// update at every edge, as the interrupt captures them, and one every
+// SENSOR_TASK_INTERVAL from the sensor task.  The filters are built with the
+// parameters from tankReporter.h, so these test what the firmware runs.
+
+#include <Arduino.h>
+#include <chrono>
+#include <unity.h>
+#include "debounce.h"
+#include "tankReporter.h"
+#include "traces.h"
+
+#define TRACE_COUNT ((int)(sizeof(traces)/sizeof(traces[0])))
+#define REPLAY_RUNS 200 //times each trace is replayed for the benchmark
+#define TRACE_RUNS 512  //longest trace
+
+typedef HoldoffFilter<1,HYSTERESIS_DELAY> holdoff;
+typedef IntegratorFilter<1,INTEGRATOR_DELAY> integrator;
+typedef MajorityFilter<1,MAJORITY_SAMPLES,MAJORITY_SAMPLE_PERIOD> majority;
+typedef ExponentialFilter<1,EXPONENTIAL_SHIFT,EXPONENTIAL_SAMPLE_PERIOD> exponential;
+
+typedef struct
+  {
+  unsigned long changes;     //times the output changed
+  unsigned long lastChange;  //milliseconds into the trace
+  unsigned long lastEdge;    //of the input
+  unsigned long updates;
+  uint8_t output;            //at the end
+  } replayResult;
+
+typedef struct
+  {
+  uint8_t level;
+  uint32_t length;           //milliseconds
+  } traceRun;
+
+/*
+ * Take a trace apart into its runs.  Returns how many there are.
+ */
+int parseTrace(const char* text, traceRun* runs)
+  {
+  unsigned int level;
+  unsigned long length;
+  int used;
+  int count=0;
+  while (count<TRACE_RUNS && sscanf(text," %u:%lu%n",&level,&length,&used)==2)
+    {
+    text+=used;
+    runs[count].level=level;
+    runs[count].length=length;
+    count++;
+    }
+  TEST_ASSERT_EQUAL_MESSAGE('\0',*text,"the trace is too long or isn't in level:milliseconds form");
+  return count;
+  }
+
+/*
+ * Feed a trace to a filter that starts off settled at the trace's first level
+ */
+template <class Filter>
+replayResult replay(Filter& filter, const traceRun* runs, int count)
+  {
+  replayResult r={0,0,0,0,runs[0].level};
+  filter.reset(runs[0].level,0);
+  unsigned long ms=0;
+  for (int run=0;run<count;run++)
+    {
+    uint8_t level=runs[run].level;
+    if (run>0)
+      r.lastEdge=ms;
+    for (unsigned long i=0;i<runs[run].length;i++,ms++)
+      {
+      if (i>0 && ms%SENSOR_TASK_INTERVAL!=0)
+        continue;
+      uint8_t out=filter.update(level,ms*1000);
+      r.updates++;
+      if (out!=r.output)
+        {
+        r.output=out;
+        r.changes++;
+        r.lastChange=ms;
+        }
+      }
+    }
+  return r;
+  }
+
+template <class Filter>
+replayResult replay(Filter& filter, const char* text)
+  {
+  traceRun runs[TRACE_RUNS];
+  int count=parseTrace(text,runs);
+  return replay(filter,runs,count);
+  }
+
+/*
+ * Every trace ends where it should, without more changes than it should, and
+ * the last change comes no later than SETTLE_MS after the input settled
+ */
+template <class Filter>
+void checkTraces(const char* filterName, boolean followsSlosh)
+  {
+  for (int i=0;i<TRACE_COUNT;i++)
+    {
+    Filter filter;
+    replayResult r=replay(filter,traces[i].runs);
+    char message[80];
+    snprintf(message,sizeof(message),"%s on %s: %lu changes, the last at %lu ms",
+             filterName,traces[i].name,r.changes,r.lastChange);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(traces[i].settled,r.output,message);
+    if (r.changes>0)
+      TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(r.lastEdge+Filter::SETTLE_MS+SENSOR_TASK_INTERVAL,r.lastChange,message);
+    if (!followsSlosh)
+      TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(traces[i].maxChanges,r.changes,message);
+    }
+  }
+
+/*
+ * Starting off at the reading from before a deep sleep, when the tank has
+ * changed in the meantime, the filter takes the new level within SETTLE_MS.
+ * The sleep task waits that long before deciding nothing has changed.
+ */
+template <class Filter>
+void checkWake(const char* filterName)
+  {
+  static const char* const wakes[]={"0:1 1:10000","1:1 0:10000"};
+  for (int i=0;i<2;i++)
+    {
+    Filter filter;
+    replayResult r=replay(filter,wakes[i]);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(1,r.changes,filterName);
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(Filter::SETTLE_MS+SENSOR_TASK_INTERVAL,r.lastChange,filterName);
+    }
+  }
+
+/*
+ * An edge captured while the sensor task was updating the filter reaches it
+ * after that update, with an older time.  It mustn't count as most of micros()'
+ * range going by, which would let the output through early or end a hold off.
+ * The times run across micros() wrapping.
+ */
+template <class Filter>
+void checkOutOfOrder(const char* filterName)
+  {
+  const uint32_t start=0-5000000UL;
+  Filter filter;
+  filter.reset(0,start);
+  uint32_t ms;
+  for (ms=0;ms<10000;ms+=SENSOR_TASK_INTERVAL)
+    filter.update(0,start+ms*1000);
+  uint32_t changed=filter.update(1,start+ms*1000);
+  TEST_ASSERT_EQUAL_UINT_MESSAGE(changed,filter.update(1,start+ms*1000-500),filterName);
+  TEST_ASSERT_EQUAL_UINT_MESSAGE(changed,filter.update(0,start+ms*1000+1000),filterName);
+  }
+
+/*
+ * Nanoseconds per update, over all the traces
+ */
+template <class Filter>
+void benchmark(const char* filterName)
+  {
+  static traceRun runs[TRACE_COUNT][TRACE_RUNS];
+  int counts[TRACE_COUNT];
+  for (int i=0;i<TRACE_COUNT;i++)
+    counts[i]=parseTrace(traces[i].runs,runs[i]);
+
+  unsigned long updates=0;
+  unsigned long changes=0;
+  std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+  for (int run=0;run<REPLAY_RUNS;run++)
+    for (int i=0;i<TRACE_COUNT;i++)
+      {
+      Filter filter;
+      replayResult r=replay(filter,runs[i],counts[i]);
+      updates+=r.updates;
+      changes+=r.changes;
+      }
+  double ns=std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now()-start).count();
+  printf("%-12s %10lu updates %8.1f ns each, %3lu output changes over the traces\n",
+         filterName,updates,ns/updates,changes/REPLAY_RUNS);
+  }
+
+void setUp()
+  {
+  }
+
+void tearDown()
+  {
+  }
+
+// The hold off takes every change as it comes, which is why the others are here
+void test_holdoff_follows_the_slosh()
+  {
+  checkTraces<holdoff>("holdoff",true);
+  holdoff filter;
+  TEST_ASSERT_GREATER_THAN(1,replay(filter,traceSloshFull).changes);
+  }
+
+void test_integrator()
+  {
+  checkTraces<integrator>("integrator",false);
+  checkWake<integrator>("integrator");
+  }
+
+// A vote over three seconds lets the longer dry spells of a heavy slosh through
+// now and then, so it isn't held to the change counts
+void test_majority()
+  {
+  checkTraces<majority>("majority",true);
+  checkWake<majority>("majority");
+  }
+
+void test_exponential()
+  {
+  checkTraces<exponential>("exponential",false);
+  checkWake<exponential>("exponential");
+  }
+
+void test_holdoff_wake()
+  {
+  checkWake<holdoff>("holdoff");
+  }
+
+void test_out_of_order_edge()
+  {
+  checkOutOfOrder<holdoff>("holdoff");
+  checkOutOfOrder<integrator>("integrator");
+  checkOutOfOrder<majority>("majority");
+  checkOutOfOrder<exponential>("exponential");
+  }
+
+void test_benchmark()
+  {
+  printf("\n");
+  benchmark<holdoff>("holdoff");
+  benchmark<integrator>("integrator");
+  benchmark<majority>("majority");
+  benchmark<exponential>("exponential");
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_holdoff_follows_the_slosh);
+  RUN_TEST(test_holdoff_wake);
+  RUN_TEST(test_integrator);
+  RUN_TEST(test_majority);
+  RUN_TEST(test_exponential);
+  RUN_TEST(test_out_of_order_edge);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+  }
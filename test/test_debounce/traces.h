@@ -0,0 +1,101 @@
+// Level sensor traces for the debounce filter replay tests, as level:milliseconds
+// run lengths.  Each starts where the filter is settled and ends with the level
+// held long enough for any filter to settle again.  Traces taken from a device
+// can be added in the same format.
+
+#ifndef TRACES_H
+#define TRACES_H
+
+#include <stdint.h>
+
+typedef struct
+  {
+  const char* name;
+  const char* runs;
+  uint8_t settled;    //where every filter but the hold off should end up
+  uint8_t maxChanges; //output changes allowed for the filters meant to ride out
+                      //slosh, which may go back and forth a little crossing the level
+  } sensorTrace;
+
+// The tank filling past the sensor: bouncing while the level is at it
+const char traceFill[]=
+  "0:5000 1:35 0:115 1:54 0:56 1:43 0:117 1:50 0:120 1:57 0:48 1:58 0:41 "
+  "1:10000";
+
+// Draining past it, sloshing for a few seconds at the level
+const char traceDrain[]=
+  "1:5000 0:90 1:107 0:56 1:131 0:152 1:69 0:53 1:47 0:35 1:132 0:170 1:104 "
+  "0:45 1:86 0:163 1:167 0:122 1:100 0:74 1:57 0:97 1:84 0:36 1:194 0:96 "
+  "1:99 0:79 1:72 0:109 1:104 0:190 1:125 0:52 1:185 0:116 1:129 0:159 1:93 "
+  "0:10075";
+
+// A full tank sloshing in a moving cart, dry about a third of the time
+const char traceSloshFull[]=
+  "1:3000 0:54 1:110 0:85 1:166 0:146 1:506 0:140 1:434 0:221 1:260 0:44 "
+  "1:545 0:27 1:445 0:130 1:48 0:198 1:502 0:88 1:280 0:171 1:150 0:250 "
+  "1:371 0:27 1:68 0:26 1:55 0:245 1:436 0:195 1:267 0:128 1:75 0:155 1:273 "
+  "0:215 1:494 0:146 1:284 0:108 1:282 0:193 1:270 0:214 1:516 0:94 1:68 "
+  "0:126 1:148 0:67 1:349 0:50 1:386 0:249 1:558 0:128 1:565 0:232 1:240 "
+  "0:97 1:336 0:170 1:557 0:236 1:563 0:120 1:81 0:142 1:294 0:210 1:459 "
+  "0:126 1:223 0:113 1:429 0:42 1:495 0:189 1:566 0:47 1:213 0:153 1:448 "
+  "0:114 1:547 0:207 1:76 0:140 1:90 0:98 1:449 0:185 1:220 0:63 1:560 0:78 "
+  "1:58 0:217 1:250 0:158 1:283 0:123 1:572 0:108 1:407 0:137 1:321 0:188 "
+  "1:51 0:118 1:570 0:227 1:178 0:152 1:256 0:129 1:103 0:143 1:419 0:165 "
+  "1:250 0:149 1:469 0:144 1:411 0:126 1:400 0:20 1:385 0:137 1:74 0:225 "
+  "1:281 0:182 1:227 0:160 1:231 0:240 1:139 0:224 1:307 0:28 1:118 0:41 "
+  "1:63 0:135 1:60 0:213 1:333 0:83 1:321 0:48 1:235 0:108 1:343 0:37 1:217 "
+  "0:60 1:307 0:155 1:218 0:188 1:325 0:185 1:347 0:136 1:375 0:147 1:531 "
+  "0:49 1:70 0:99 1:441 0:107 1:477 0:223 1:238 0:86 1:157 0:84 1:568 0:73 "
+  "1:488 0:229 1:67 0:77 1:64 0:121 1:195 0:29 1:210 0:134 1:564 0:193 1:482 "
+  "0:159 1:271 0:181 1:574 0:135 1:274 0:154 1:77 0:121 1:374 0:188 1:482 "
+  "0:35 1:351 0:52 1:263 0:244 1:94 0:98 1:118 0:239 1:124 0:99 1:351 0:210 "
+  "1:208 0:126 1:304 0:53 1:54 0:163 1:84 0:171 1:268 0:250 1:517 0:63 1:567 "
+  "0:29 1:433 0:71 1:401 0:45 1:256 0:166 1:489 0:171 1:244 0:146 1:152 "
+  "0:190 1:445 0:95 1:562 0:147 1:63 0:103 1:457 0:250 1:334 0:24 1:206 0:71 "
+  "1:381 0:227 1:184 0:106 1:485 0:74 1:318 0:192 1:144 0:234 1:434 0:160 "
+  "1:5000";
+
+// A low tank sloshing, wet about a third of the time
+const char traceSloshEmpty[]=
+  "0:3000 1:240 0:103 1:43 0:132 1:112 0:219 1:208 0:361 1:84 0:263 1:175 "
+  "0:82 1:168 0:208 1:130 0:448 1:225 0:567 1:115 0:501 1:148 0:320 1:250 "
+  "0:82 1:242 0:74 1:113 0:522 1:101 0:435 1:128 0:214 1:163 0:227 1:80 "
+  "0:282 1:26 0:226 1:103 0:223 1:54 0:568 1:150 0:414 1:151 0:232 1:248 "
+  "0:502 1:223 0:470 1:208 0:583 1:215 0:418 1:222 0:408 1:112 0:502 1:61 "
+  "0:455 1:203 0:518 1:187 0:301 1:145 0:331 1:147 0:558 1:151 0:408 1:189 "
+  "0:511 1:250 0:518 1:109 0:513 1:144 0:273 1:103 0:216 1:244 0:320 1:217 "
+  "0:537 1:99 0:356 1:224 0:562 1:163 0:576 1:149 0:462 1:99 0:258 1:145 "
+  "0:570 1:113 0:123 1:220 0:395 1:205 0:54 1:228 0:241 1:210 0:154 1:35 "
+  "0:96 1:89 0:278 1:194 0:154 1:213 0:580 1:54 0:318 1:82 0:261 1:245 0:107 "
+  "1:128 0:78 1:34 0:417 1:112 0:222 1:83 0:70 1:41 0:163 1:37 0:71 1:30 "
+  "0:67 1:115 0:307 1:52 0:206 1:208 0:234 1:153 0:47 1:118 0:90 1:223 0:299 "
+  "1:58 0:83 1:21 0:398 1:177 0:161 1:93 0:391 1:145 0:77 1:98 0:505 1:161 "
+  "0:92 1:250 0:316 1:213 0:457 1:240 0:203 1:141 0:276 1:43 0:369 1:234 "
+  "0:150 1:26 0:504 1:221 0:176 1:152 0:448 1:144 0:573 1:103 0:193 1:243 "
+  "0:395 1:86 0:314 1:175 0:475 1:187 0:64 1:199 0:189 1:191 0:104 1:84 0:80 "
+  "1:53 0:211 1:63 0:144 1:136 0:283 1:150 0:78 1:83 0:284 1:202 0:501 1:38 "
+  "0:302 1:40 0:279 1:179 0:414 1:85 0:479 1:91 0:50 1:58 0:82 1:118 0:464 "
+  "1:61 0:159 1:151 0:135 1:81 0:150 1:45 0:66 1:66 0:283 1:46 0:268 1:26 "
+  "0:579 1:191 0:521 1:136 0:363 1:157 0:435 1:74 0:261 1:206 0:490 1:128 "
+  "0:569 1:25 0:98 1:245 0:474 1:154 0:231 1:44 0:537 1:113 0:65 1:152 0:167 "
+  "1:176 0:421 1:94 0:427 1:98 0:65 1:243 0:468 1:45 0:153 1:98 0:249 1:235 "
+  "0:62 1:227 0:5000";
+
+// Electrical spikes on a dry sensor
+const char traceSpikes[]=
+  "0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 "
+  "1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 "
+  "0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 "
+  "1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 "
+  "0:1992 1:8 0:1992 1:8 0:1992 1:8 0:1992 1:8 0:5000";
+
+const sensorTrace traces[]=
+  {
+  {"fill",traceFill,1,3},
+  {"drain",traceDrain,0,3},
+  {"sloshFull",traceSloshFull,1,0},
+  {"sloshEmpty",traceSloshEmpty,0,0},
+  {"spikes",traceSpikes,0,0},
+  };
+
+#endif
@@ -0,0 +1,150 @@
+// Tests for the serial command reader, on the host:
+// "pio test -e native -f test_line_reader -v".
+//
+// LineReader is checked on its own for how it splits lines, and then the firmware
+// is fed serial commands for a long while through loop() to show that taking them
+// in doesn't use any more heap the longer it goes on, which the String based
+// reader it replaced did.
+
+#include <Arduino.h>
+#include <unity.h>
+#include "lineReader.h"
+#include "nativeHal.h"
+#include "tankReporter.h"
+
+#define HEAP_RUNS 2000 //passes over the commands below for the heap test
+
+// Commands that don't change any settings, so nothing is written to flash, along
+// with a blank line, a line split across passes of loop() and one that's too long
+static const char* const serialInput[]=
+  {
+  "version\r\n",
+  "\r\n",
+  "sta",
+  "tus\n",
+  "nosuchcommand\r",
+  "heartbeat\n",
+  NULL //the long line goes here
+  };
+
+/*
+ * Feed text to a reader a character at a time, returning the first line it gives
+ * back, or NULL
+ */
+template <size_t SIZE>
+const char* feed(LineReader<SIZE>& reader, const char* text)
+  {
+  while (*text)
+    if (reader.add(*text++))
+      return reader.poll(Serial);
+  return NULL;
+  }
+
+unsigned long tooLongAnswers=0; //times the firmware said a line was too long
+
+/*
+ * Run loop() for the given simulated time, a millisecond a pass, counting the
+ * answers to the long line and throwing away the rest of what the firmware prints
+ */
+void runFor(unsigned long ms)
+  {
+  char output[256];
+  for (unsigned long i=0;i<ms;i++)
+    {
+    loop();
+    halAdvanceMillis(1);
+    while (halSerialOutput(output,sizeof(output))>0)
+      if (strstr(output,"Command too long")!=NULL)
+        tooLongAnswers++;
+    }
+  }
+
+/*
+ * Send each of the commands above over the serial port, giving the firmware time
+ * to answer each one
+ */
+void sendCommands(const char* longLine)
+  {
+  for (int i=0;serialInput[i]!=NULL;i++)
+    {
+    halSerialInput(serialInput[i]);
+    runFor(20);
+    }
+  halSerialInput(longLine);
+  runFor(20);
+  }
+
+void setUp()
+  {
+  }
+
+void tearDown()
+  {
+  }
+
+void test_line_endings()
+  {
+  LineReader<16> reader;
+  TEST_ASSERT_EQUAL_STRING("one",feed(reader,"one\r"));
+  reader.next();
+  TEST_ASSERT_EQUAL_STRING("two",feed(reader,"\ntwo\n"));
+  reader.next();
+  TEST_ASSERT_EQUAL_STRING("three",feed(reader,"\r\n\r\nthree\r\n"));
+  reader.next();
+  TEST_ASSERT_NULL(feed(reader,"\n"));
+  TEST_ASSERT_FALSE(reader.overflowed());
+  }
+
+void test_long_line_is_dropped_whole()
+  {
+  LineReader<8> reader;
+  TEST_ASSERT_NULL(feed(reader,"much too long\r\n"));
+  TEST_ASSERT_TRUE(reader.overflowed());
+  TEST_ASSERT_FALSE(reader.overflowed());
+  TEST_ASSERT_EQUAL_UINT32(1,reader.overflowCount());
+  TEST_ASSERT_EQUAL_STRING("fits",feed(reader,"fits\n"));
+  }
+
+void test_line_waits_to_be_taken()
+  {
+  LineReader<8> reader;
+  TEST_ASSERT_EQUAL_STRING("first",feed(reader,"first\nsecond\n"));
+  TEST_ASSERT_EQUAL_STRING("first",feed(reader,"third\n")); //still there until next()
+  reader.next();
+  TEST_ASSERT_EQUAL_STRING("again",feed(reader,"again\n"));
+  }
+
+void test_heap_stays_flat()
+  {
+  char longLine[SERIAL_COMMAND_SIZE+8];
+  memset(longLine,'x',sizeof(longLine)-3);
+  strcpy(&longLine[sizeof(longLine)-3],"\r\n");
+
+  setup();
+  runFor(1000);
+  sendCommands(longLine); //anything allocated once, the first time through
+  size_t before=halHeapInUse();
+  size_t most=before;
+  for (int run=0;run<HEAP_RUNS;run++)
+    {
+    sendCommands(longLine);
+    size_t now=halHeapInUse();
+    if (now>most)
+      most=now;
+    }
+  size_t after=halHeapInUse();
+  printf("\nheap in use: %lu bytes before, %lu after %d passes, %lu at most\n",
+         (unsigned long)before,(unsigned long)after,HEAP_RUNS,(unsigned long)most);
+  TEST_ASSERT_EQUAL_UINT32(HEAP_RUNS+1,tooLongAnswers); //it was reading them all along
+  TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(before,after,"taking in serial commands uses more heap over time");
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_line_endings);
+  RUN_TEST(test_long_line_is_dropped_whole);
+  RUN_TEST(test_line_waits_to_be_taken);
+  RUN_TEST(test_heap_stays_flat);
+  return UNITY_END();
+  }
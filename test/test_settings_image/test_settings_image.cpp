@@ -0,0 +1,317 @@
+// Round trip tests for the saved settings, on the host:
+// "pio test -e native -f test_settings_image -v".
+//
+// Settings are written to the journal and read back from the bytes alone, through
+// a host directory the way the native program's image tool works, and from
+// records made here the way an older or newer version would have written them.
+// The settings are compared as the settings command sends them.
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <unity.h>
+#include "jsonWriter.h"
+#include "nativeHal.h"
+#include "tankReporter.h"
+
+// From src/main.cpp
+struct command;
+const char* processCommand(char* cmd, boolean fromMqtt, const command** matched);
+boolean readSettingsJournal();
+boolean flushSettings();
+void buildSettingsJson(JsonWriter& json);
+uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc);
+
+#define SETTINGS_JSON_SIZE 2048
+
+// A journal record header, as it is in flash
+typedef struct
+  {
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t erases;
+  uint16_t length;
+  uint16_t version;
+  uint32_t crc;
+  } journalRecord;
+
+// The whole settings struct as the first journal (version 0) and EEPROM held it
+typedef struct
+  {
+  unsigned int validConfig;
+  char ssid[100];
+  char wifiPassword[50];
+  char mqttBrokerAddress[30];
+  int mqttBrokerPort;
+  char mqttUsername[50];
+  char mqttPassword[50];
+  char mqttTopicRoot[150];
+  char mqttClientId[25];
+  bool debug;
+  uint32_t reportPeriod;
+  char staticIP[30];
+  char netmask[30];
+  char gateway[30];
+  char dns[30];
+  uint32_t sleepTime;
+  uint8_t reportMode;
+  uint32_t heartbeatPeriod;
+  uint8_t debounceFilter;
+  uint8_t queueDropPolicy;
+  uint16_t queueDepth;
+  } legacyConf;
+
+// Everything that can be set, with the strings at various lengths
+static const char* const everySetting[]=
+  {
+  "ssid=" HAL_SSID,
+  "wifipass=a wifi password",
+  "broker=broker.local",
+  "port=8883",
+  "user=tank",
+  "pass=an mqtt password",
+  "topicroot=home/tanks/golf cart/",
+  "staticaddress=192.168.1.50",
+  "netmask=255.255.255.0",
+  "gateway=192.168.1.1",
+  "dns=192.168.1.2",
+  "calibration=100:0,900:100",
+  "fingerprint=01:23:45:67:89:ab:cd:ef:01:23:45:67:89:ab:cd:ef:01:23:45:67",
+  "backupbrokers=second.local:1884,third.local",
+  "reportperiod=60",
+  "heartbeat=900",
+  "reportmode=change",
+  "metricsperiod=300",
+  "debug=1",
+  "filter=majority",
+  "queuedepth=500",
+  "sensors=2",
+  "analog=1",
+  "persistentsession=1"
+  };
+
+char journalName[SETTINGS_JOURNAL_NAME_SIZE];
+
+void runCommand(const char* text)
+  {
+  char cmd[SERIAL_COMMAND_SIZE];
+  snprintf(cmd,sizeof(cmd),"%s",text);
+  processCommand(cmd,false,NULL);
+  }
+
+std::string settingsJson()
+  {
+  char buf[SETTINGS_JSON_SIZE];
+  JsonWriter json(buf,sizeof(buf));
+  buildSettingsJson(json);
+  TEST_ASSERT_FALSE(json.truncated());
+  return buf;
+  }
+
+/*
+ * True if the settings JSON has name set to value
+ */
+bool hasSetting(const char* name, const char* value)
+  {
+  std::string pair=std::string("\"")+name+"\":\""+value+"\"";
+  return settingsJson().find(pair)!=std::string::npos;
+  }
+
+std::string readFile(const char* name)
+  {
+  File f=LittleFS.open(name,"r");
+  TEST_ASSERT_TRUE(f);
+  std::string data(f.size(),'\0');
+  f.read((uint8_t*)&data[0],data.size());
+  f.close();
+  return data;
+  }
+
+void writeFile(const char* name, const std::string& data)
+  {
+  File f=LittleFS.open(name,"w");
+  TEST_ASSERT_TRUE(f);
+  f.write((const uint8_t*)data.data(),data.size());
+  f.close();
+  }
+
+/*
+ * A journal record holding body
+ */
+std::string record(uint32_t sequence, uint16_t version, const std::string& body)
+  {
+  journalRecord r={SETTINGS_JOURNAL_MAGIC,sequence,0,(uint16_t)body.size(),version,0};
+  r.crc=crc32((const uint8_t*)&r,offsetof(journalRecord,crc),0);
+  r.crc=crc32((const uint8_t*)body.data(),body.size(),r.crc);
+  return std::string((const char*)&r,sizeof(r))+body;
+  }
+
+// A saved field: its id, length and value
+std::string field(uint8_t id, const void* value, uint8_t length)
+  {
+  return std::string(1,(char)id)+std::string(1,(char)length)+std::string((const char*)value,length);
+  }
+
+std::string textField(uint8_t id, const char* text)
+  {
+  return field(id,text,strlen(text));
+  }
+
+void setUp()
+  {
+  LittleFS.format();
+  }
+
+void tearDown()
+  {
+  char discard[256];
+  while (halSerialOutput(discard,sizeof(discard))>0)
+    ; //nobody is reading it
+  }
+
+void test_round_trip()
+  {
+  setup();
+  snprintf(journalName,sizeof(journalName),SETTINGS_JOURNAL_NAME,0);
+  for (size_t i=0;i<sizeof(everySetting)/sizeof(everySetting[0]);i++)
+    runCommand(everySetting[i]);
+  TEST_ASSERT_TRUE(flushSettings());
+  std::string saved=settingsJson();
+  std::string image=readFile(journalName);
+
+  runCommand("ssid=changed"); //in RAM only
+  runCommand("reportperiod=5");
+  LittleFS.format();
+  writeFile(journalName,image);
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  std::string loaded=settingsJson();
+  TEST_ASSERT_EQUAL_STRING(saved.c_str(),loaded.c_str());
+  }
+
+void test_image_directory()
+  {
+  char dir[]="/tmp/settingsImageXXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  TEST_ASSERT_TRUE(halFilesDirectory(dir));
+  runCommand("ssid=in a directory");
+  TEST_ASSERT_TRUE(flushSettings());
+  std::string saved=settingsJson();
+
+  halFilesDirectory(NULL);
+  LittleFS.format();
+  runCommand("ssid=changed");
+  TEST_ASSERT_TRUE(halFilesDirectory(dir)); //as the image tool starts
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  std::string loaded=settingsJson();
+  TEST_ASSERT_EQUAL_STRING(saved.c_str(),loaded.c_str());
+
+  halFilesDirectory(NULL);
+  std::string file=std::string(dir)+journalName;
+  TEST_ASSERT_EQUAL_INT(0,unlink(file.c_str()));
+  TEST_ASSERT_EQUAL_INT(0,rmdir(dir));
+  }
+
+// Missing fields keep their defaults and fields from a newer version are skipped
+void test_missing_and_unknown_fields()
+  {
+  uint32_t reportPeriod=45; //as the ESP8266 saves an unsigned long
+  writeFile(journalName,record(1,SETTINGS_SCHEMA_VERSION,
+      textField(2,"from a record")+textField(200,"not known yet")+field(11,&reportPeriod,sizeof(reportPeriod))));
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  TEST_ASSERT_TRUE(hasSetting("ssid","from a record"));
+  TEST_ASSERT_TRUE(hasSetting("reportPeriod","45"));
+  TEST_ASSERT_TRUE(hasSetting("heartbeat","3600"));
+  TEST_ASSERT_TRUE(hasSetting("calibration",DEFAULT_ANALOG_CALIBRATION));
+  TEST_ASSERT_TRUE(hasSetting("topicroot",""));
+  }
+
+void test_legacy_record()
+  {
+  legacyConf old;
+  memset(&old,0,sizeof(old));
+  old.validConfig=VALID_SETTINGS_FLAG;
+  strcpy(old.ssid,"from the old format");
+  strcpy(old.mqttTopicRoot,"old/root/");
+  old.mqttBrokerPort=1884;
+  old.reportPeriod=120;
+  old.heartbeatPeriod=1800;
+  old.reportMode=REPORT_MODE_CHANGE;
+  writeFile(journalName,record(7,0,std::string((const char*)&old,sizeof(old))));
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  TEST_ASSERT_TRUE(hasSetting("ssid","from the old format"));
+  TEST_ASSERT_TRUE(hasSetting("topicroot","old/root/"));
+  TEST_ASSERT_TRUE(hasSetting("reportPeriod","120"));
+  TEST_ASSERT_TRUE(hasSetting("heartbeat","1800"));
+  TEST_ASSERT_TRUE(hasSetting("reportmode","change"));
+  TEST_ASSERT_TRUE(hasSetting("calibration",DEFAULT_ANALOG_CALIBRATION)); //not in the old format
+  TEST_ASSERT_TRUE(settingsJson().find("\"port\":1884")!=std::string::npos);
+
+  // and it's written again in the current format
+  TEST_ASSERT_TRUE(flushSettings());
+  runCommand("ssid=changed");
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  TEST_ASSERT_TRUE(hasSetting("ssid","from the old format"));
+  }
+
+void test_bad_record_falls_back()
+  {
+  std::string older=record(3,SETTINGS_SCHEMA_VERSION,textField(2,"older"));
+  std::string newer=record(4,SETTINGS_SCHEMA_VERSION,textField(2,"newer"));
+  newer[newer.size()-1]^=1;
+  writeFile(journalName,older+newer);
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  TEST_ASSERT_TRUE(hasSetting("ssid","older"));
+  }
+
+// The strings share one space, so long ones can crowd each other out
+void test_strings_share_the_space()
+  {
+  writeFile(journalName,record(1,SETTINGS_SCHEMA_VERSION,""));
+  TEST_ASSERT_TRUE(readSettingsJournal());
+  static const struct
+    {
+    const char* name;
+    size_t size;
+    } longest[]=
+    {
+    {"topicroot",MQTT_TOPIC_SIZE},
+    {"backupbrokers",MQTT_BACKUP_BROKERS_SIZE},
+    {"fingerprint",TLS_FINGERPRINT_SIZE},
+    {"user",USERNAME_SIZE},
+    {"pass",PASSWORD_SIZE},
+    {"wifipass",PASSWORD_SIZE}
+    };
+  std::string value;
+  size_t rejected=0;
+  size_t used=0;
+  for (size_t i=0;i<sizeof(longest)/sizeof(longest[0]) && rejected==0;i++)
+    {
+    value=std::string(longest[i].size-1,'a'+i);
+    runCommand((std::string(longest[i].name)+"="+value).c_str());
+    if (hasSetting(longest[i].name,value.c_str()))
+      used+=value.size()+1;
+    else
+      rejected=i;
+    }
+  TEST_ASSERT_GREATER_THAN(0,rejected);
+  TEST_ASSERT_LESS_OR_EQUAL(SETTINGS_STRINGS_SIZE,used);
+  TEST_ASSERT_TRUE(hasSetting("topicroot",std::string(MQTT_TOPIC_SIZE-1,'a').c_str())); //untouched
+
+  runCommand("topicroot=short/"); //which makes room
+  runCommand((std::string(longest[rejected].name)+"="+value).c_str());
+  TEST_ASSERT_TRUE(hasSetting(longest[rejected].name,value.c_str()));
+  }
+
+int main(int argc, char** argv)
+  {
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_image_directory);
+  RUN_TEST(test_missing_and_unknown_fields);
+  RUN_TEST(test_legacy_record);
+  RUN_TEST(test_bad_record_falls_back);
+  RUN_TEST(test_strings_share_the_space);
+  return UNITY_END();
+  }